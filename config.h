@@ -0,0 +1,3 @@
+/* config.h: generated by configure.c */
+
+#define ENDIAN_LITTLE
@@ -0,0 +1,293 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "chainindex.h"
+
+/* A chain that grows past CHAININDEX_MIN_CHAIN items gets an array of its
+ * items sorted by hash, then length, then key, so that a lookup in it is a
+ * binary search rather than a walk with a memcmp at every item. The 
+ * entries carry a copy of the hash so that the search doesn't touch the 
+ * items until it has (nearly) found the right one.
+ *
+ * The index is only ever an optimisation: if it can't be allocated or 
+ * grown it is simply dropped, and the chain is walked as usual. Resizing 
+ * or rehashing the table drops all of them; a long chain gets a new one 
+ * the next time something is inserted into it. table_index itself, one 
+ * pointer per slot, is allocated when the first chain needs it. */
+struct hashtablechainentry
+{
+  ht_hash_t hash;
+  struct hashtableitem *item;
+};
+
+struct hashtablechainindex
+{
+  ht_size_t count;
+  ht_size_t size;
+  struct hashtablechainentry entries[];
+};
+
+#define chainindex_bytes(size) \
+  (sizeof(struct hashtablechainindex) + \
+   (size_t) (size) * sizeof(struct hashtablechainentry))
+
+static inline int chainindex_compare(ht_hash_t hash, const void *key,
+                                     size_t keylen, 
+                                     const struct hashtablechainentry *e);
+static ht_size_t chainindex_search(const struct hashtablechainindex *index,
+                                   ht_hash_t hash, const void *key, 
+                                   size_t keylen, int *found);
+static void chainindex_build(struct hashtable *ht, ht_size_t slot, 
+                             ht_size_t chain);
+
+static inline int chainindex_compare(ht_hash_t hash, const void *key,
+                                     size_t keylen, 
+                                     const struct hashtablechainentry *e)
+{
+  if (hash != e->hash)
+  {
+    return hash < e->hash ? -1 : 1;
+  }
+
+  if (keylen != e->item->keylen)
+  {
+    return keylen < e->item->keylen ? -1 : 1;
+  }
+
+  return memcmp(key, e->item->key, keylen);
+}
+
+/* Returns the position of the key if *found, or where it would go if not */
+static ht_size_t chainindex_search(const struct hashtablechainindex *index,
+                                   ht_hash_t hash, const void *key, 
+                                   size_t keylen, int *found)
+{
+  ht_size_t low, high, middle;
+  int c;
+
+  low  = 0;
+  high = index->count;
+
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+    c = chainindex_compare(hash, key, keylen, &index->entries[middle]);
+
+    if (c == 0)
+    {
+      *found = 1;
+      return middle;
+    }
+    else if (c < 0)
+    {
+      high = middle;
+    }
+    else
+    {
+      low = middle + 1;
+    }
+  }
+
+  *found = 0;
+  return low;
+}
+
+static void chainindex_build(struct hashtable *ht, ht_size_t slot, 
+                             ht_size_t chain)
+{
+  struct hashtablechainindex *index;
+  struct hashtableitem *j;
+  ht_size_t pos, size;
+  int found;
+
+  if (ht->table_index == NULL)
+  {
+    ht->table_index = hashtable_malloc(ht, HASHTABLE_MEMORY_INDEX, 
+                                       ht->table_size * 
+                                       sizeof(struct hashtablechainindex *));
+
+    if (ht->table_index == NULL)
+    {
+      return;
+    }
+
+    memset(ht->table_index, 0, ht->table_size * 
+                               sizeof(struct hashtablechainindex *));
+  }
+
+  size  = chain * 2;
+  index = hashtable_malloc(ht, HASHTABLE_MEMORY_INDEX, chainindex_bytes(size));
+
+  if (index == NULL)
+  {
+    return;
+  }
+
+  index->count = 0;
+  index->size  = size;
+
+  /* Insertion sort; chains this long are rare */
+  for (j = (ht->table)[slot]; j != NULL; j = j->next)
+  {
+    pos = chainindex_search(index, j->key_hash, j->key, j->keylen, &found);
+    memmove(&index->entries[pos + 1], &index->entries[pos],
+            (index->count - pos) * sizeof(struct hashtablechainentry));
+    index->entries[pos].hash = j->key_hash;
+    index->entries[pos].item = j;
+    index->count++;
+  }
+
+  (ht->table_index)[slot] = index;
+}
+
+/* Called after item has been added to the end of the chain in slot, which
+ * is now chain items long */
+void hashtable_index_insert(struct hashtable *ht, ht_size_t slot,
+                            struct hashtableitem *item, ht_size_t chain)
+{
+  struct hashtablechainindex *index, *grown;
+  ht_size_t pos;
+  int found;
+
+  index = hashtable_index_of(ht, slot);
+
+  if (index == NULL)
+  {
+    if (chain > CHAININDEX_MIN_CHAIN)
+    {
+      chainindex_build(ht, slot, chain);
+    }
+
+    return;
+  }
+
+  if (index->count == index->size)
+  {
+    grown = hashtable_realloc(ht, HASHTABLE_MEMORY_INDEX, index, 
+                              chainindex_bytes(index->size),
+                              chainindex_bytes(index->size * 2));
+
+    if (grown == NULL)
+    {
+      hashtable_index_drop(ht, slot);
+      return;
+    }
+
+    index = grown;
+    index->size *= 2;
+    (ht->table_index)[slot] = index;
+  }
+
+  pos = chainindex_search(index, item->key_hash, item->key, item->keylen, 
+                          &found);
+  memmove(&index->entries[pos + 1], &index->entries[pos],
+          (index->count - pos) * sizeof(struct hashtablechainentry));
+  index->entries[pos].hash = item->key_hash;
+  index->entries[pos].item = item;
+  index->count++;
+}
+
+/* Called before item is removed from the chain in slot */
+void hashtable_index_remove(struct hashtable *ht, ht_size_t slot,
+                            struct hashtableitem *item)
+{
+  struct hashtablechainindex *index;
+  ht_size_t pos;
+  int found;
+
+  index = hashtable_index_of(ht, slot);
+
+  if (index == NULL)
+  {
+    return;
+  }
+
+  if (index->count <= CHAININDEX_MIN_CHAIN / 2)
+  {
+    hashtable_index_drop(ht, slot);
+    return;
+  }
+
+  pos = chainindex_search(index, item->key_hash, item->key, item->keylen, 
+                          &found);
+
+  if (!found)
+  {
+    /* Shouldn't happen, but the index is certainly wrong if it does */
+    hashtable_index_drop(ht, slot);
+    return;
+  }
+
+  index->count--;
+  memmove(&index->entries[pos], &index->entries[pos + 1],
+          (index->count - pos) * sizeof(struct hashtablechainentry));
+}
+
+struct hashtableitem *hashtable_index_find(struct hashtable *ht, 
+                                           ht_size_t slot, const void *key,
+                                           size_t keylen, ht_hash_t hash)
+{
+  struct hashtablechainindex *index;
+  ht_size_t pos;
+  int found;
+
+  index = (ht->table_index)[slot];
+  pos = chainindex_search(index, hash, key, keylen, &found);
+
+  return found ? index->entries[pos].item : NULL;
+}
+
+void hashtable_index_drop(struct hashtable *ht, ht_size_t slot)
+{
+  struct hashtablechainindex *index;
+
+  index = hashtable_index_of(ht, slot);
+
+  if (index != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_INDEX, index, 
+                   chainindex_bytes(index->size));
+    (ht->table_index)[slot] = NULL;
+  }
+}
+
+/* Must be called before table_size changes */
+void hashtable_index_drop_all(struct hashtable *ht)
+{
+  ht_size_t slot;
+
+  if (ht->table_index == NULL)
+  {
+    return;
+  }
+
+  for (slot = 0; slot < ht->table_size; slot++)
+  {
+    hashtable_index_drop(ht, slot);
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_INDEX, ht->table_index, 
+                 ht->table_size * sizeof(struct hashtablechainindex *));
+  ht->table_index = NULL;
+}
@@ -0,0 +1,46 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sorted indexes of unusually long chains, for the chained engine. These 
+ * are called by hashtable.c; they are not part of the public interface. */
+
+#ifndef CHAININDEX_HEADER
+#define CHAININDEX_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+/* A chain gets an index once it is longer than this, and loses it again 
+ * once it is half as long */
+#define CHAININDEX_MIN_CHAIN  16
+
+#define hashtable_index_of(ht, slot) \
+  ((ht)->table_index != NULL ? ((ht)->table_index)[slot] : NULL)
+
+void hashtable_index_insert(struct hashtable *ht, ht_size_t slot,
+                            struct hashtableitem *item, ht_size_t chain);
+void hashtable_index_remove(struct hashtable *ht, ht_size_t slot,
+                            struct hashtableitem *item);
+struct hashtableitem *hashtable_index_find(struct hashtable *ht, 
+                                           ht_size_t slot, const void *key,
+                                           size_t keylen, ht_hash_t hash);
+void hashtable_index_drop(struct hashtable *ht, ht_size_t slot);
+void hashtable_index_drop_all(struct hashtable *ht);
+
+#endif  /* CHAININDEX_HEADER */
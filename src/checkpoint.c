@@ -0,0 +1,778 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License,
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "lookup_hash.h"
+#include "checkpoint.h"
+
+/* A checkpoint log is a series of records, each a header, a payload and a
+ * lookup3 checksum of the two. The payload is a list of slot images: a
+ * slot number and every key (and value) in that slot, at the table size
+ * and seed given in the header. An image says that those are exactly the
+ * keys that hash to that slot, at that size, so it stays true however the
+ * table is resized afterwards and can be replayed into a table of any
+ * size. A full record holds every non empty slot, and replaces everything
+ * before it. Everything is written in the machine's own byte order.
+ *
+ * A record that was only partly written, because of a crash, fails its
+ * checksum; the loader stops there and cuts it off. */
+#define CHECKPOINT_MAGIC   0x4b43484cu
+#define CHECKPOINT_FULL    1
+#define CHECKPOINT_SLOTS   2
+#define CHECKPOINT_BUFFER  8192
+
+struct checkpointheader
+{
+  uint32_t magic;
+  uint8_t type;
+  uint8_t size_p;
+  uint16_t reserved;
+  uint32_t seed;
+  uint32_t slots;
+  uint64_t bytes;
+};
+
+struct checkpointslot
+{
+  uint32_t slot;
+  uint32_t count;
+};
+
+struct checkpointitem
+{
+  uint64_t keylen;
+  int64_t value;
+};
+
+struct checkpointwriter
+{
+  int fd;
+  int failed;
+  struct lookup_hash_state checksum;
+  size_t used;
+  uint8_t buffer[CHECKPOINT_BUFFER];
+};
+
+#define checkpoint_dirty(cp, slot) \
+  ((cp)->dirty[(slot) >> 3] & (1 << ((slot) & 7)))
+
+static int checkpoint_write(struct hashtable *ht, int fd, int full);
+static void checkpoint_walk(struct hashtable *ht, int full,
+                            struct checkpointwriter *w,
+                            uint32_t *slots, uint64_t *bytes);
+static inline void checkpoint_put(struct checkpointwriter *w,
+                                  const void *data, size_t length);
+static void checkpoint_flush(struct checkpointwriter *w);
+static int checkpoint_write_all(int fd, const void *data, size_t length);
+static size_t checkpoint_read_all(int fd, void *data, size_t length);
+static int checkpoint_apply(struct hashtable *ht,
+                            const struct checkpointheader *header,
+                            const uint8_t *payload);
+static int checkpoint_clear_slot(struct hashtable *ht, ht_size_p_t size_p,
+                                 uint32_t slot, uint32_t seed);
+
+int hashtable_checkpoint_start(struct hashtable *ht)
+{
+  struct hashtablecheckpoint *cp;
+
+  cp = hashtable_malloc(ht, HASHTABLE_MEMORY_OTHER,
+                        sizeof(struct hashtablecheckpoint));
+
+  if (cp == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  /* The first checkpoint writes everything; the bitmap is allocated then */
+  cp->dirty      = NULL;
+  cp->full       = 1;
+  cp->log_bytes  = 0;
+  cp->full_bytes = 0;
+
+  ht->table_checkpoint = cp;
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* The table has just changed size. A slot that was dirty is now spread
+ * over several slots (or shares one with others), which are all dirty. If
+ * there isn't room for a new bitmap, the next checkpoint writes the whole
+ * table instead. */
+void hashtable_checkpoint_resize(struct hashtable *ht, ht_size_t old_size)
+{
+  struct hashtablecheckpoint *cp;
+  uint8_t *dirty;
+  ht_size_t slot, s, old_bytes, new_bytes, offset;
+
+  cp = ht->table_checkpoint;
+
+  if (cp == NULL || cp->dirty == NULL)
+  {
+    return;
+  }
+
+  old_bytes = hashtable_checkpoint_dirty_bytes(old_size);
+  new_bytes = hashtable_checkpoint_dirty_bytes(ht->table_size);
+  dirty = hashtable_malloc(ht, HASHTABLE_MEMORY_OTHER, new_bytes);
+
+  if (dirty != NULL && ht->table_size > old_size && old_size >= 8)
+  {
+    /* Slot s of the new table was slot s & (old_size - 1) */
+    for (offset = 0; offset < new_bytes; offset += old_bytes)
+    {
+      memcpy(dirty + offset, cp->dirty, old_bytes);
+    }
+  }
+  else if (dirty != NULL)
+  {
+    memset(dirty, 0, new_bytes);
+
+    for (slot = 0; slot < old_size; slot++)
+    {
+      if (!checkpoint_dirty(cp, slot))
+      {
+        continue;
+      }
+
+      if (ht->table_size > old_size)
+      {
+        for (s = slot; s < ht->table_size; s += old_size)
+        {
+          dirty[s >> 3] |= 1 << (s & 7);
+        }
+      }
+      else
+      {
+        s = slot & ht->table_mask;
+        dirty[s >> 3] |= 1 << (s & 7);
+      }
+    }
+  }
+  else
+  {
+    cp->full = 1;
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_OTHER, cp->dirty, old_bytes);
+  cp->dirty = dirty;
+}
+
+/* Every key has a new hash (after a reseed) */
+void hashtable_checkpoint_mark_all(struct hashtable *ht)
+{
+  if (ht->table_checkpoint != NULL)
+  {
+    ht->table_checkpoint->full = 1;
+  }
+}
+
+void hashtable_checkpoint_stop(struct hashtable *ht)
+{
+  struct hashtablecheckpoint *cp;
+
+  cp = ht->table_checkpoint;
+
+  if (cp == NULL)
+  {
+    return;
+  }
+
+  if (cp->dirty != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_OTHER, cp->dirty,
+                   hashtable_checkpoint_dirty_bytes(ht->table_size));
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_OTHER, cp,
+                 sizeof(struct hashtablecheckpoint));
+  ht->table_checkpoint = NULL;
+}
+
+int hashtable_checkpoint_touch(struct hashtable *ht,
+                               struct hashtableitem *item)
+{
+  hashtable_checkpoint_mark(ht, item->key_hash);
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_checkpoint(struct hashtable *ht, int fd, int *compact)
+{
+  struct hashtablecheckpoint *cp;
+  int r;
+
+  cp = ht->table_checkpoint;
+
+  if (cp == NULL)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  r = checkpoint_write(ht, fd, cp->full);
+
+  if (compact != NULL)
+  {
+    /* Once most of the log is images that have since been replaced */
+    *compact = cp->log_bytes > 2 * cp->full_bytes + CHECKPOINT_BUFFER;
+  }
+
+  return r;
+}
+
+int hashtable_checkpoint_compact(struct hashtable *ht, int fd)
+{
+  int r;
+
+  if (ht->table_checkpoint == NULL)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  r = checkpoint_write(ht, fd, 1);
+
+  if (r == HASHTABLE_SUCCESS)
+  {
+    /* fd is the new log, and this is all there is in it */
+    ht->table_checkpoint->log_bytes = ht->table_checkpoint->full_bytes;
+  }
+
+  return r;
+}
+
+static int checkpoint_write(struct hashtable *ht, int fd, int full)
+{
+  struct hashtablecheckpoint *cp;
+  struct checkpointheader header;
+  struct checkpointwriter w;
+  uint32_t checksum;
+  uint64_t record;
+  off_t start;
+
+  cp = ht->table_checkpoint;
+
+  if (cp->dirty == NULL)
+  {
+    full = 1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic  = CHECKPOINT_MAGIC;
+  header.type   = full ? CHECKPOINT_FULL : CHECKPOINT_SLOTS;
+  header.size_p = ht->table_size_p;
+  header.seed   = ht->table_seed;
+
+  /* Sized first, so that the header can go first */
+  checkpoint_walk(ht, full, NULL, &header.slots, &header.bytes);
+
+  if (!full && header.slots == 0)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  start = lseek(fd, 0, SEEK_END);
+
+  if (start == (off_t) -1)
+  {
+    return HASHTABLE_IO_ERROR;
+  }
+
+  w.fd     = fd;
+  w.failed = 0;
+  w.used   = 0;
+  lookup_hash_init(&w.checksum, sizeof(header) + header.bytes);
+
+  checkpoint_put(&w, &header, sizeof(header));
+  checkpoint_walk(ht, full, &w, NULL, NULL);
+  checkpoint_flush(&w);
+
+  checksum = lookup_hash_final(&w.checksum);
+
+  if (w.failed ||
+      checkpoint_write_all(fd, &checksum, sizeof(checksum)) != 0 ||
+      fdatasync(fd) != 0)
+  {
+    /* Don't leave half a record for the next one to be appended to */
+    if (ftruncate(fd, start) != 0)
+    {
+      /* The loader will cut it off instead */
+    }
+
+    return HASHTABLE_IO_ERROR;
+  }
+
+  record = sizeof(header) + header.bytes + sizeof(checksum);
+  cp->log_bytes += record;
+
+  if (full)
+  {
+    cp->full_bytes = record;
+
+    if (cp->dirty == NULL)
+    {
+      cp->dirty = hashtable_malloc(ht, HASHTABLE_MEMORY_OTHER,
+                    hashtable_checkpoint_dirty_bytes(ht->table_size));
+    }
+
+    /* Without a bitmap, every checkpoint is a full one */
+    cp->full = cp->dirty == NULL;
+  }
+
+  if (cp->dirty != NULL)
+  {
+    memset(cp->dirty, 0, hashtable_checkpoint_dirty_bytes(ht->table_size));
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Writes the images of every non empty slot, or of every dirty one, to w;
+ * or if w is NULL, counts them and their size */
+static void checkpoint_walk(struct hashtable *ht, int full,
+                            struct checkpointwriter *w,
+                            uint32_t *slots, uint64_t *bytes)
+{
+  struct hashtablecheckpoint *cp;
+  struct checkpointslot image;
+  struct checkpointitem entry;
+  struct hashtableitem *j;
+  ht_size_t slot;
+
+  cp = ht->table_checkpoint;
+
+  if (w == NULL)
+  {
+    *slots = 0;
+    *bytes = 0;
+  }
+
+  for (slot = 0; slot < ht->table_size; slot++)
+  {
+    if (full)
+    {
+      if (hashtable_slot_items(ht, slot) == NULL)
+      {
+        continue;
+      }
+    }
+    else
+    {
+      /* Most of the bitmap should be clear */
+      if (cp->dirty[slot >> 3] == 0)
+      {
+        slot |= 7;
+        continue;
+      }
+
+      if (!checkpoint_dirty(cp, slot))
+      {
+        continue;
+      }
+    }
+
+    image.slot  = slot;
+    image.count = 0;
+
+    for (j = hashtable_slot_items(ht, slot); j != NULL; j = j->next)
+    {
+      image.count++;
+    }
+
+    if (w == NULL)
+    {
+      (*slots)++;
+      *bytes += sizeof(image) + (uint64_t) image.count * sizeof(entry);
+
+      for (j = hashtable_slot_items(ht, slot); j != NULL; j = j->next)
+      {
+        *bytes += j->keylen;
+      }
+
+      continue;
+    }
+
+    checkpoint_put(w, &image, sizeof(image));
+
+    for (j = hashtable_slot_items(ht, slot); j != NULL; j = j->next)
+    {
+      entry.keylen = j->keylen;
+      entry.value  = (intptr_t) j->data;
+      checkpoint_put(w, &entry, sizeof(entry));
+      checkpoint_put(w, j->key, j->keylen);
+    }
+  }
+}
+
+static inline void checkpoint_put(struct checkpointwriter *w,
+                                  const void *data, size_t length)
+{
+  size_t n;
+
+  while (length != 0)
+  {
+    n = CHECKPOINT_BUFFER - w->used;
+
+    if (n > length)
+    {
+      n = length;
+    }
+
+    memcpy(w->buffer + w->used, data, n);
+    w->used += n;
+    data     = (const uint8_t *) data + n;
+    length  -= n;
+
+    if (w->used == CHECKPOINT_BUFFER)
+    {
+      checkpoint_flush(w);
+    }
+  }
+}
+
+static void checkpoint_flush(struct checkpointwriter *w)
+{
+  lookup_hash_update(&w->checksum, w->buffer, w->used);
+
+  if (!w->failed && checkpoint_write_all(w->fd, w->buffer, w->used) != 0)
+  {
+    w->failed = 1;
+  }
+
+  w->used = 0;
+}
+
+static int checkpoint_write_all(int fd, const void *data, size_t length)
+{
+  ssize_t n;
+
+  while (length != 0)
+  {
+    n = write(fd, data, length);
+
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+
+    if (n <= 0)
+    {
+      return -1;
+    }
+
+    data    = (const uint8_t *) data + n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+/* Returns the number of bytes read, which is less than length at the end
+ * of the file or on an error */
+static size_t checkpoint_read_all(int fd, void *data, size_t length)
+{
+  size_t done;
+  ssize_t n;
+
+  for (done = 0; done < length; done += n)
+  {
+    n = read(fd, (uint8_t *) data + done, length - done);
+
+    if (n < 0 && errno == EINTR)
+    {
+      n = 0;
+      continue;
+    }
+
+    if (n <= 0)
+    {
+      break;
+    }
+  }
+
+  return done;
+}
+
+int hashtable_checkpoint_load(struct hashtable *ht, int fd)
+{
+  struct hashtablecheckpoint *cp;
+  struct checkpointheader header;
+  struct stat st;
+  uint8_t *record;
+  uint64_t size, log_bytes, full_bytes;
+  uint32_t checksum;
+  off_t offset;
+  int r, i, loaded_full;
+
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED ||
+      ht->table_settings.multimap || ht->table_itemcount != 0)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  offset = lseek(fd, 0, SEEK_CUR);
+
+  if (offset == (off_t) -1 || fstat(fd, &st) != 0)
+  {
+    return HASHTABLE_IO_ERROR;
+  }
+
+  log_bytes   = 0;
+  full_bytes  = 0;
+  loaded_full = 0;
+  i = HASHTABLE_SUCCESS;
+
+  for (;;)
+  {
+    if (checkpoint_read_all(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != CHECKPOINT_MAGIC ||
+        (header.type != CHECKPOINT_FULL && header.type != CHECKPOINT_SLOTS) ||
+        header.size_p > ht_size_lim_p ||
+        header.bytes > (uint64_t) st.st_size - offset - sizeof(header))
+    {
+      break;
+    }
+
+    size = sizeof(header) + header.bytes + sizeof(checksum);
+    record = hashtable_malloc(ht, HASHTABLE_MEMORY_OTHER, size);
+
+    if (record == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    memcpy(record, &header, sizeof(header));
+
+    if (checkpoint_read_all(fd, record + sizeof(header),
+                            size - sizeof(header)) != size - sizeof(header))
+    {
+      hashtable_free(ht, HASHTABLE_MEMORY_OTHER, record, size);
+      break;
+    }
+
+    memcpy(&checksum, record + size - sizeof(checksum), sizeof(checksum));
+
+    if (checksum != lookup_hash(record, size - sizeof(checksum)))
+    {
+      hashtable_free(ht, HASHTABLE_MEMORY_OTHER, record, size);
+      break;
+    }
+
+    r = checkpoint_apply(ht, &header, record + sizeof(header));
+    hashtable_free(ht, HASHTABLE_MEMORY_OTHER, record, size);
+
+    if (r == HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY)
+    {
+      i = r;
+    }
+    else if (r != HASHTABLE_SUCCESS)
+    {
+      return r;
+    }
+
+    offset    += size;
+    log_bytes += size;
+
+    if (header.type == CHECKPOINT_FULL)
+    {
+      full_bytes  = size;
+      loaded_full = 1;
+    }
+  }
+
+  /* Anything after the last good record was being written in a crash */
+  if (offset < st.st_size && ftruncate(fd, offset) != 0)
+  {
+    /* A read only fd; there is nothing to append to anyway */
+  }
+
+  lseek(fd, offset, SEEK_SET);
+
+  /* The table now matches the log, which can be carried on with */
+  cp = ht->table_checkpoint;
+
+  if (cp != NULL)
+  {
+    if (cp->dirty != NULL)
+    {
+      memset(cp->dirty, 0, hashtable_checkpoint_dirty_bytes(ht->table_size));
+    }
+
+    cp->full       = !loaded_full || cp->dirty == NULL;
+    cp->log_bytes  = log_bytes;
+    cp->full_bytes = full_bytes;
+  }
+
+  return i;
+}
+
+static int checkpoint_apply(struct hashtable *ht,
+                            const struct checkpointheader *header,
+                            const uint8_t *payload)
+{
+  struct checkpointslot image;
+  struct checkpointitem entry;
+  struct hashtableitem *i, *j;
+  struct iovec iov;
+  const uint8_t *end;
+  ht_size_t slot;
+  uint32_t n, k;
+  int r, result;
+
+  end    = payload + header->bytes;
+  result = HASHTABLE_SUCCESS;
+
+  if (header->type == CHECKPOINT_FULL)
+  {
+    for (slot = 0; slot < ht->table_size; slot++)
+    {
+      for (j = hashtable_slot_items(ht, slot); j != NULL; j = i)
+      {
+        i = j->next;
+        hashtable_unset_item(ht, j);
+      }
+    }
+
+    /* The table is empty, so its seed can be changed freely */
+    ht->table_seed = header->seed;
+  }
+
+  for (n = 0; n < header->slots; n++)
+  {
+    if ((size_t) (end - payload) < sizeof(image))
+    {
+      return HASHTABLE_INVALID_ARG;
+    }
+
+    memcpy(&image, payload, sizeof(image));
+    payload += sizeof(image);
+
+    if (header->type == CHECKPOINT_SLOTS)
+    {
+      r = checkpoint_clear_slot(ht, header->size_p, image.slot, header->seed);
+
+      if (r != HASHTABLE_SUCCESS)
+      {
+        return r;
+      }
+    }
+
+    for (k = 0; k < image.count; k++)
+    {
+      if ((size_t) (end - payload) < sizeof(entry))
+      {
+        return HASHTABLE_INVALID_ARG;
+      }
+
+      memcpy(&entry, payload, sizeof(entry));
+      payload += sizeof(entry);
+
+      if ((uint64_t) (end - payload) < entry.keylen)
+      {
+        return HASHTABLE_INVALID_ARG;
+      }
+
+      iov.iov_base = (void *) payload;
+      iov.iov_len  = entry.keylen;
+      payload     += entry.keylen;
+
+      r = hashtable_setv(ht, &iov, 1, (void *) (intptr_t) entry.value);
+
+      if (r == HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY)
+      {
+        result = r;
+      }
+      else if (r != HASHTABLE_SUCCESS)
+      {
+        return r;
+      }
+    }
+  }
+
+  return result;
+}
+
+/* Removes every key that hashed to slot in a table of 2^size_p slots */
+static int checkpoint_clear_slot(struct hashtable *ht, ht_size_p_t size_p,
+                                 uint32_t slot, uint32_t seed)
+{
+  struct hashtableitem *i, *j;
+  ht_hash_t mask, hash;
+  ht_size_t s, step;
+  int r;
+
+  mask = ((ht_hash_t) 1 << size_p) - 1;
+
+  /* The table has been reseeded since it was written (or is now); every
+   * key has to be hashed again to find them */
+  if (ht->table_settings.hashfunction == lookup_hash &&
+      seed != ht->table_seed)
+  {
+    for (s = 0; s < ht->table_size; s++)
+    {
+      for (j = hashtable_slot_items(ht, s); j != NULL; j = i)
+      {
+        i = j->next;
+        hash = lookup_hash_seeded(j->key, j->keylen, seed);
+
+        if ((hash & mask) == slot &&
+            (r = hashtable_unset_item(ht, j)) != HASHTABLE_SUCCESS)
+        {
+          return r;
+        }
+      }
+    }
+
+    return HASHTABLE_SUCCESS;
+  }
+
+  /* Otherwise they can only be in the slots that agree with slot in the
+   * bits they have in common */
+  if (ht->table_size_p >= size_p)
+  {
+    s    = slot;
+    step = (ht_size_t) 1 << size_p;
+  }
+  else
+  {
+    s    = slot & ht->table_mask;
+    step = ht->table_size;
+  }
+
+  for (; s < ht->table_size; s += step)
+  {
+    for (j = hashtable_slot_items(ht, s); j != NULL; j = i)
+    {
+      i = j->next;
+
+      if ((j->key_hash & mask) == slot &&
+          (r = hashtable_unset_item(ht, j)) != HASHTABLE_SUCCESS)
+      {
+        return r;
+      }
+    }
+  }
+
+  return HASHTABLE_SUCCESS;
+}
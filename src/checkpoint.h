@@ -0,0 +1,79 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Tracking of the slots changed since the last checkpoint, for the chained
+ * engine. These are called by hashtable.c; they are not part of the 
+ * public interface. */
+
+#ifndef CHECKPOINT_HEADER
+#define CHECKPOINT_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+/* dirty has a bit for each slot. If full is set then the next checkpoint
+ * writes the whole table, and dirty may be NULL. */
+struct hashtablecheckpoint
+{
+  uint8_t *dirty;
+  uint8_t full;
+  uint64_t log_bytes;
+  uint64_t full_bytes;
+};
+
+#define hashtable_checkpoint_dirty_bytes(size)  (((size) + 7) / 8)
+
+static inline void hashtable_checkpoint_mark(struct hashtable *ht,
+                                             ht_hash_t hash);
+static inline void hashtable_checkpoint_mark_shared(struct hashtable *ht,
+                                                    ht_hash_t hash);
+
+static inline void hashtable_checkpoint_mark(struct hashtable *ht,
+                                             ht_hash_t hash)
+{
+  ht_size_t slot;
+
+  if (ht->table_checkpoint != NULL && ht->table_checkpoint->dirty != NULL)
+  {
+    slot = hash & ht->table_mask;
+    ht->table_checkpoint->dirty[slot >> 3] |= 1 << (slot & 7);
+  }
+}
+
+/* For hashtable_merge_range, where other threads mark the same bitmap */
+static inline void hashtable_checkpoint_mark_shared(struct hashtable *ht,
+                                                    ht_hash_t hash)
+{
+  ht_size_t slot;
+
+  if (ht->table_checkpoint != NULL && ht->table_checkpoint->dirty != NULL)
+  {
+    slot = hash & ht->table_mask;
+    __atomic_fetch_or(&ht->table_checkpoint->dirty[slot >> 3], 
+                      1 << (slot & 7), __ATOMIC_RELAXED);
+  }
+}
+
+int hashtable_checkpoint_start(struct hashtable *ht);
+void hashtable_checkpoint_resize(struct hashtable *ht, 
+                                 ht_size_t old_size);
+void hashtable_checkpoint_mark_all(struct hashtable *ht);
+void hashtable_checkpoint_stop(struct hashtable *ht);
+
+#endif  /* CHECKPOINT_HEADER */
@@ -0,0 +1,301 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "cuckoo.h"
+
+/* Each of the 2^table_size_p buckets holds CUCKOO_WAYS slots, and every 
+ * key may live in one of two buckets: one picked by its hash, as in the 
+ * chained engine, and one picked by a remix of that hash. A lookup 
+ * therefore reads at most two buckets. 
+ *
+ * Each slot has a tag byte, zero if the slot is empty and otherwise taken
+ * from the top of the hash, so that most slots can be rejected without
+ * reading them. The tags live after the slots, in the same allocation. */
+#define CUCKOO_QUEUE_SIZE  256
+
+#define cuckoo_tag(hash)  ((uint8_t) (((hash) >> 24) | 1))
+#define cuckoo_table_bytes(size) \
+  ((size_t) (size) * CUCKOO_WAYS * \
+   (sizeof(struct hashtableslot) + sizeof(uint8_t)))
+
+struct cuckoo_step
+{
+  ht_size_t bucket;
+  int parent;
+  int way;
+};
+
+static inline ht_hash_t cuckoo_hash2(ht_hash_t hash);
+static inline ht_size_t cuckoo_alternate(ht_hash_t hash, ht_size_t bucket,
+                                         ht_hash_t mask);
+static int cuckoo_place(struct hashtableslot *slots, uint8_t *tags, 
+                        ht_hash_t mask, ht_hash_t hash, ht_size_t *index);
+
+static inline ht_hash_t cuckoo_hash2(ht_hash_t hash)
+{
+  /* fmix32 from MurmurHash3. The second bucket depends on all the bits of 
+   * the hash, while the first only depends on the bottom few. */
+  hash ^= 0x5bd1e995;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
+static inline ht_size_t cuckoo_alternate(ht_hash_t hash, ht_size_t bucket,
+                                         ht_hash_t mask)
+{
+  if ((hash & mask) == bucket)
+  {
+    return cuckoo_hash2(hash) & mask;
+  }
+  else
+  {
+    return hash & mask;
+  }
+}
+
+/* Finds a free slot for hash in one of its two buckets, breadth first 
+ * searching for the shortest chain of displacements that will produce one
+ * if both are full. On success the slot's tag and key_hash are set. */
+static int cuckoo_place(struct hashtableslot *slots, uint8_t *tags, 
+                        ht_hash_t mask, ht_hash_t hash, ht_size_t *index)
+{
+  struct cuckoo_step queue[CUCKOO_QUEUE_SIZE];
+  int head, tail, way, cur, k;
+  ht_size_t bucket, next, to, from;
+
+  queue[0].bucket = hash & mask;
+  queue[0].parent = -1;
+  queue[1].bucket = cuckoo_hash2(hash) & mask;
+  queue[1].parent = -1;
+  tail = (queue[0].bucket == queue[1].bucket) ? 1 : 2;
+
+  for (head = 0; head < tail; head++)
+  {
+    bucket = queue[head].bucket;
+
+    for (way = 0; way < CUCKOO_WAYS; way++)
+    {
+      if (tags[bucket * CUCKOO_WAYS + way] == 0)
+      {
+        goto found;
+      }
+    }
+
+    for (way = 0; way < CUCKOO_WAYS && tail < CUCKOO_QUEUE_SIZE; way++)
+    {
+      next = cuckoo_alternate(slots[bucket * CUCKOO_WAYS + way].key_hash,
+                              bucket, mask);
+
+      /* Never visit a bucket twice, so that a path can't cross itself */
+      for (k = 0; k < tail && queue[k].bucket != next; k++);
+
+      if (k == tail)
+      {
+        queue[tail].bucket = next;
+        queue[tail].parent = head;
+        queue[tail].way    = way;
+        tail++;
+      }
+    }
+  }
+
+  return HASHTABLE_OUT_OF_MEMORY;
+
+found:
+  /* Walk back up the path, moving each item into the hole below it */
+  to = bucket * CUCKOO_WAYS + way;
+
+  for (cur = head; queue[cur].parent != -1; cur = queue[cur].parent)
+  {
+    from = queue[queue[cur].parent].bucket * CUCKOO_WAYS + queue[cur].way;
+
+    slots[to] = slots[from];
+    tags[to]  = tags[from];
+
+    to = from;
+  }
+
+  slots[to].key_hash = hash;
+  tags[to] = cuckoo_tag(hash);
+  *index = to;
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_cuckoo_resize(struct hashtable *ht, ht_size_p_t new_size_p)
+{
+  struct hashtableslot *slots;
+  uint8_t *tags;
+  ht_size_t size, mask, i, index, old_slots;
+
+  old_slots = ht->table_size * CUCKOO_WAYS;
+
+  for (;;)
+  {
+    size = 1 << new_size_p;
+    mask = size - 1;
+
+    slots = hashtable_malloc(ht, HASHTABLE_MEMORY_TABLE, 
+                             cuckoo_table_bytes(size));
+
+    if (slots == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    tags = (uint8_t *) (slots + size * CUCKOO_WAYS);
+    memset(tags, 0, size * CUCKOO_WAYS * sizeof(uint8_t));
+
+    for (i = 0; i < old_slots; i++)
+    {
+      if ((ht->table_tags)[i] != 0)
+      {
+        if (cuckoo_place(slots, tags, mask, (ht->slots)[i].key_hash, 
+                         &index) != HASHTABLE_SUCCESS)
+        {
+          break;
+        }
+
+        slots[index] = (ht->slots)[i];
+      }
+    }
+
+    if (i == old_slots)
+    {
+      break;
+    }
+
+    /* Very unlucky; the old table is still intact, so try a bigger one */
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, slots, 
+                   cuckoo_table_bytes(size));
+
+    new_size_p += ht->table_settings.size_extend;
+
+    if (new_size_p > ht->table_settings.size_maximum || 
+        new_size_p > ht_size_lim_p)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+
+  if (ht->slots != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, ht->slots, 
+                   cuckoo_table_bytes(ht->table_size));
+  }
+
+  ht->slots        = slots;
+  ht->table_tags   = tags;
+  ht->table_size_p = new_size_p;
+  ht->table_size   = size;
+  ht->table_mask   = mask;
+
+  return HASHTABLE_SUCCESS;
+}
+
+struct hashtableitem *hashtable_cuckoo_find(struct hashtable *ht, 
+                                            const void *key, size_t keylen,
+                                            ht_hash_t hash)
+{
+  ht_size_t bucket, index;
+  uint8_t tag;
+  int i, way;
+
+  tag    = cuckoo_tag(hash);
+  bucket = hash & ht->table_mask;
+
+  for (i = 0; i < 2; i++)
+  {
+    for (way = 0; way < CUCKOO_WAYS; way++)
+    {
+      index = bucket * CUCKOO_WAYS + way;
+
+      if ((ht->table_tags)[index] == tag &&
+          (ht->slots)[index].key_hash == hash &&
+          (ht->slots)[index].keylen   == keylen &&
+          memcmp((ht->slots)[index].key, key, keylen) == 0)
+      {
+        return (struct hashtableitem *) &((ht->slots)[index]);
+      }
+    }
+
+    bucket = cuckoo_hash2(hash) & ht->table_mask;
+  }
+
+  return NULL;
+}
+
+int hashtable_cuckoo_reserve(struct hashtable *ht, ht_hash_t hash,
+                             struct hashtableslot **slot)
+{
+  int r;
+  ht_size_t index;
+  ht_size_p_t extend;
+
+  while (cuckoo_place(ht->slots, ht->table_tags, ht->table_mask, 
+                      hash, &index) != HASHTABLE_SUCCESS)
+  {
+    /* Unlike the chained engine, the table has to grow for the insert
+     * to succeed at all */
+    extend = ht->table_size_p + ht->table_settings.size_extend;
+
+    if (extend > ht->table_settings.size_maximum || extend > ht_size_lim_p)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    r = hashtable_probe_resize(ht, extend, hashtable_cuckoo_resize);
+
+    if (r != HASHTABLE_SUCCESS)
+    {
+      return r;
+    }
+  }
+
+  *slot = &((ht->slots)[index]);
+
+  return HASHTABLE_SUCCESS;
+}
+
+void hashtable_cuckoo_remove(struct hashtable *ht, 
+                             struct hashtableslot *slot)
+{
+  (ht->table_tags)[slot - ht->slots] = 0;
+}
+
+void hashtable_cuckoo_delete(struct hashtable *ht)
+{
+  if (ht->slots != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, ht->slots, 
+                   cuckoo_table_bytes(ht->table_size));
+    ht->slots = NULL;
+    ht->table_tags = NULL;
+  }
+}
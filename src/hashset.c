@@ -0,0 +1,601 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "hashset.h"
+#include "lookup_hash.h"
+
+/* A hashset is laid out like a chained hashtable, but its items have no 
+ * data pointer and are only linked one way, which makes them two thirds 
+ * the size of a hashtableitem. 
+ *
+ * Two sets that hash keys the same way (the same hashfunction and, for
+ * lookup_hash, the same seed) can reuse each other's stored hashes, 
+ * and if they are also the same size, every key lives in the same slot of
+ * both. The operations on pairs of sets then simply walk the two slot 
+ * arrays side by side, comparing one chain of each at a time. 
+ *
+ * As with hashtables, the seed is hash_seed, or random if that is 0, so 
+ * that nobody can pick keys that collide. Sets that should be compatible
+ * are made with hashset_new_like, which copies the seed. Sets are never 
+ * reseeded, since that would break their compatibility. */
+
+static inline void *hashset_malloc(struct hashset *hs, size_t size);
+static inline void hashset_free(struct hashset *hs, void *ptr, size_t size);
+static inline ht_hash_t hashset_hash(struct hashset *hs, const void *key, 
+                                     size_t keylen);
+static inline int hashset_compatible(struct hashset *a, struct hashset *b);
+static inline struct hashsetitem **hashset_find(struct hashset *hs, 
+                                                ht_size_t slot,
+                                                const void *key, 
+                                                size_t keylen, 
+                                                ht_hash_t hash);
+static inline int hashset_link(struct hashset *hs, ht_size_t slot,
+                               const void *key, size_t keylen, 
+                               ht_hash_t hash);
+static inline void hashset_unlink(struct hashset *hs, 
+                                  struct hashsetitem **link);
+static int hashset_grow(struct hashset *hs);
+static int hashset_resize(struct hashset *hs, ht_size_p_t new_size_p);
+static inline int hashset_range_check(struct hashset *a, struct hashset *b,
+                                      ht_size_t first, ht_size_t count);
+static int hashset_merge(struct hashset *dst, struct hashset *src, 
+                         ht_size_t first, ht_size_t count, int aligned);
+static int hashset_filter(struct hashset *dst, struct hashset *src, 
+                          ht_size_t first, ht_size_t count, int aligned,
+                          int keep_if_found);
+static int hashset_subset(struct hashset *a, struct hashset *b, 
+                          ht_size_t first, ht_size_t count, int aligned);
+
+int hashset_new_custom(struct hashset *hs, 
+                       const struct hashtablesettings *s)
+{
+  if (s->size_initial > ht_size_lim_p || s->size_maximum > ht_size_lim_p || 
+      s->size_extend > ht_size_lim_p || s->size_extend == 0 ||
+      s->size_extend_trigger > ht_size_lim_p || 
+      s->engine != HASHTABLE_ENGINE_CHAINED || s->bloom_bits != 0 || 
+      s->seqlock || s->multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hs->table           = NULL;
+  hs->table_size_p    = 0;
+  hs->table_size      = 0;
+  hs->table_itemcount = 0;
+  hs->table_mask      = 0;
+  hs->table_settings  = *s;
+  hashtable_settings_fill(&hs->table_settings);
+
+  if (s->hash_seed != 0)
+  {
+    hs->table_seed = s->hash_seed;
+  }
+  else
+  {
+    hs->table_seed = hashtable_random_seed(hs);
+  }
+
+  return hashset_resize(hs, s->size_initial);
+}
+
+int hashset_new(struct hashset *hs)
+{
+  return hashset_new_custom(hs, &hashtable_defaults);
+}
+
+/* The new set starts out the same size as like, so that operations on 
+ * the pair walk the two slot by slot until one of them grows */
+int hashset_new_like(struct hashset *hs, struct hashset *like)
+{
+  hs->table           = NULL;
+  hs->table_size_p    = 0;
+  hs->table_size      = 0;
+  hs->table_itemcount = 0;
+  hs->table_mask      = 0;
+  hs->table_seed      = like->table_seed;
+  hs->table_settings  = like->table_settings;
+
+  return hashset_resize(hs, like->table_size_p);
+}
+
+int hashset_add(struct hashset *hs, const void *key, size_t keylen)
+{
+  int r, i;
+  ht_hash_t hash;
+
+  hash = hashset_hash(hs, key, keylen);
+
+  if (hashset_find(hs, hash & hs->table_mask, key, keylen, hash) != NULL)
+  {
+    return HASHTABLE_DUPLICATE;
+  }
+
+  /* As with hashtables, a set that can't grow just gets longer chains */
+  i = hashset_grow(hs);
+  r = hashset_link(hs, hash & hs->table_mask, key, keylen, hash);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  (hs->table_itemcount)++;
+
+  if (i == HASHTABLE_OUT_OF_MEMORY)
+  {
+    return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashset_contains(struct hashset *hs, const void *key, size_t keylen)
+{
+  ht_hash_t hash;
+
+  hash = hashset_hash(hs, key, keylen);
+
+  if (hashset_find(hs, hash & hs->table_mask, key, keylen, hash) == NULL)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashset_remove(struct hashset *hs, const void *key, size_t keylen)
+{
+  struct hashsetitem **link;
+  ht_hash_t hash;
+
+  hash = hashset_hash(hs, key, keylen);
+  link = hashset_find(hs, hash & hs->table_mask, key, keylen, hash);
+
+  if (link == NULL)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  hashset_unlink(hs, link);
+  (hs->table_itemcount)--;
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashset_union(struct hashset *dst, struct hashset *src)
+{
+  int r;
+
+  /* dst is not grown until the end, so that it stays aligned with src */
+  r = hashset_merge(dst, src, 0, src->table_size, 
+                    dst->table_mask == src->table_mask);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return hashset_union_finish(dst);
+}
+
+int hashset_intersect(struct hashset *dst, struct hashset *src)
+{
+  return hashset_filter(dst, src, 0, dst->table_size, 
+                        dst->table_mask == src->table_mask, 1);
+}
+
+int hashset_difference(struct hashset *dst, struct hashset *src)
+{
+  return hashset_filter(dst, src, 0, dst->table_size, 
+                        dst->table_mask == src->table_mask, 0);
+}
+
+int hashset_is_subset(struct hashset *a, struct hashset *b)
+{
+  if (a->table_itemcount > b->table_itemcount)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  return hashset_subset(a, b, 0, a->table_size, 
+                        a->table_mask == b->table_mask);
+}
+
+/* The _range versions only work on slots first to first + count - 1 of 
+ * both sets, which must be compatible and the same size, so calls on 
+ * disjoint ranges may run at once. Item counts are updated atomically, 
+ * once per call, and dst is not grown until hashset_union_finish. */
+int hashset_union_range(struct hashset *dst, struct hashset *src, 
+                        ht_size_t first, ht_size_t count)
+{
+  int r;
+
+  r = hashset_range_check(dst, src, first, count);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return hashset_merge(dst, src, first, count, 1);
+}
+
+/* Grows dst to fit the keys that hashset_union_range added */
+int hashset_union_finish(struct hashset *dst)
+{
+  if (hashset_grow(dst) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashset_intersect_range(struct hashset *dst, struct hashset *src, 
+                            ht_size_t first, ht_size_t count)
+{
+  int r;
+
+  r = hashset_range_check(dst, src, first, count);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return hashset_filter(dst, src, first, count, 1, 1);
+}
+
+int hashset_difference_range(struct hashset *dst, struct hashset *src, 
+                             ht_size_t first, ht_size_t count)
+{
+  int r;
+
+  r = hashset_range_check(dst, src, first, count);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return hashset_filter(dst, src, first, count, 1, 0);
+}
+
+int hashset_is_subset_range(struct hashset *a, struct hashset *b, 
+                            ht_size_t first, ht_size_t count)
+{
+  int r;
+
+  r = hashset_range_check(a, b, first, count);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return hashset_subset(a, b, first, count, 1);
+}
+
+void hashset_delete(struct hashset *hs)
+{
+  struct hashsetitem *j, *next;
+  ht_size_t slot;
+
+  if (!hs->table_settings.arena)
+  {
+    for (slot = 0; slot < hs->table_size; slot++)
+    {
+      for (j = hs->table[slot]; j != NULL; j = next)
+      {
+        next = j->next;
+        hashset_free(hs, j, sizeof(struct hashsetitem));
+      }
+    }
+
+    hashset_free(hs, hs->table, 
+                 hs->table_size * sizeof(struct hashsetitem *));
+  }
+
+  hs->table           = NULL;
+  hs->table_size_p    = 0;
+  hs->table_size      = 0;
+  hs->table_itemcount = 0;
+  hs->table_mask      = 0;
+}
+
+/* Each key only goes to one slot of a set the same size as src */
+static inline int hashset_range_check(struct hashset *a, struct hashset *b,
+                                      ht_size_t first, ht_size_t count)
+{
+  if (!hashset_compatible(a, b) || a->table_mask != b->table_mask ||
+      first > a->table_size || count > a->table_size - first)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Adds to dst the keys in slots first to first + count - 1 of src. If 
+ * aligned, the sets are known to be compatible and the same size, and 
+ * only the same slots of dst are touched. */
+static int hashset_merge(struct hashset *dst, struct hashset *src, 
+                         ht_size_t first, ht_size_t count, int aligned)
+{
+  struct hashsetitem *j;
+  ht_size_t slot, dst_slot, added;
+  ht_hash_t hash;
+  int compatible, r;
+
+  compatible = hashset_compatible(dst, src);
+  aligned = aligned && compatible;
+  added = 0;
+  r = HASHTABLE_SUCCESS;
+
+  for (slot = first; slot < first + count && r == HASHTABLE_SUCCESS; slot++)
+  {
+    for (j = src->table[slot]; j != NULL; j = j->next)
+    {
+      hash = compatible ? j->key_hash : hashset_hash(dst, j->key, j->keylen);
+      dst_slot = aligned ? slot : hash & dst->table_mask;
+
+      if (hashset_find(dst, dst_slot, j->key, j->keylen, hash) == NULL)
+      {
+        r = hashset_link(dst, dst_slot, j->key, j->keylen, hash);
+
+        if (r != HASHTABLE_SUCCESS)
+        {
+          break;
+        }
+
+        added++;
+      }
+    }
+  }
+
+  __atomic_add_fetch(&dst->table_itemcount, added, __ATOMIC_RELAXED);
+
+  return r;
+}
+
+/* Removes from slots first to first + count - 1 of dst every key that is
+ * (keep_if_found == 0) or is not (keep_if_found == 1) in src */
+static int hashset_filter(struct hashset *dst, struct hashset *src, 
+                          ht_size_t first, ht_size_t count, int aligned,
+                          int keep_if_found)
+{
+  struct hashsetitem **link, *j;
+  ht_size_t slot, removed;
+  ht_hash_t hash;
+  int compatible, found;
+
+  compatible = hashset_compatible(dst, src);
+  aligned = aligned && compatible;
+  removed = 0;
+
+  for (slot = first; slot < first + count; slot++)
+  {
+    link = &(dst->table[slot]);
+
+    while (*link != NULL)
+    {
+      j = *link;
+      hash = compatible ? j->key_hash : hashset_hash(src, j->key, j->keylen);
+      found = hashset_find(src, aligned ? slot : hash & src->table_mask, 
+                           j->key, j->keylen, hash) != NULL;
+
+      if (found != keep_if_found)
+      {
+        hashset_unlink(dst, link);
+        removed++;
+      }
+      else
+      {
+        link = &(j->next);
+      }
+    }
+  }
+
+  __atomic_sub_fetch(&dst->table_itemcount, removed, __ATOMIC_RELAXED);
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Whether every key in slots first to first + count - 1 of a is in b */
+static int hashset_subset(struct hashset *a, struct hashset *b, 
+                          ht_size_t first, ht_size_t count, int aligned)
+{
+  struct hashsetitem *j;
+  ht_size_t slot;
+  ht_hash_t hash;
+  int compatible;
+
+  compatible = hashset_compatible(a, b);
+  aligned = aligned && compatible;
+
+  for (slot = first; slot < first + count; slot++)
+  {
+    for (j = a->table[slot]; j != NULL; j = j->next)
+    {
+      hash = compatible ? j->key_hash : hashset_hash(b, j->key, j->keylen);
+
+      if (hashset_find(b, aligned ? slot : hash & b->table_mask, 
+                       j->key, j->keylen, hash) == NULL)
+      {
+        return HASHTABLE_KEY_NOT_FOUND;
+      }
+    }
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+static inline void *hashset_malloc(struct hashset *hs, size_t size)
+{
+  return (hs->table_settings.mallocfunction)
+                      (hs->table_settings.alloc_context, size);
+}
+
+static inline void hashset_free(struct hashset *hs, void *ptr, size_t size)
+{
+  if (!hs->table_settings.arena)
+  {
+    (hs->table_settings.freefunction)
+                      (hs->table_settings.alloc_context, ptr, size);
+  }
+}
+
+static inline ht_hash_t hashset_hash(struct hashset *hs, const void *key, 
+                                     size_t keylen)
+{
+  if (hs->table_settings.hashfunction == lookup_hash)
+  {
+    return lookup_hash_seeded(key, keylen, hs->table_seed);
+  }
+
+  return (hs->table_settings.hashfunction)(key, keylen);
+}
+
+static inline int hashset_compatible(struct hashset *a, struct hashset *b)
+{
+  return a->table_settings.hashfunction == b->table_settings.hashfunction &&
+         (a->table_settings.hashfunction != lookup_hash ||
+          a->table_seed == b->table_seed);
+}
+
+/* Returns the pointer that points at the key's item, so that it can be 
+ * unlinked, or NULL if the key is not in slot */
+static inline struct hashsetitem **hashset_find(struct hashset *hs, 
+                                                ht_size_t slot,
+                                                const void *key, 
+                                                size_t keylen, 
+                                                ht_hash_t hash)
+{
+  struct hashsetitem **link, *j;
+
+  for (link = &(hs->table[slot]); (j = *link) != NULL; link = &(j->next))
+  {
+    if (j->key_hash == hash && j->keylen == keylen && 
+        memcmp(j->key, key, keylen) == 0)
+    {
+      return link;
+    }
+  }
+
+  return NULL;
+}
+
+static inline int hashset_link(struct hashset *hs, ht_size_t slot,
+                               const void *key, size_t keylen, 
+                               ht_hash_t hash)
+{
+  struct hashsetitem *new_item;
+
+  new_item = hashset_malloc(hs, sizeof(struct hashsetitem));
+
+  if (new_item == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  new_item->key      = key;
+  new_item->keylen   = keylen;
+  new_item->key_hash = hash;
+  new_item->next     = hs->table[slot];
+  hs->table[slot]    = new_item;
+
+  return HASHTABLE_SUCCESS;
+}
+
+static inline void hashset_unlink(struct hashset *hs, 
+                                  struct hashsetitem **link)
+{
+  struct hashsetitem *j;
+
+  j = *link;
+  *link = j->next;
+  hashset_free(hs, j, sizeof(struct hashsetitem));
+}
+
+/* Grows the set as many times as its item count calls for, which may be 
+ * more than once after a union */
+static int hashset_grow(struct hashset *hs)
+{
+  ht_size_p_t extend, extend_trigger;
+
+  for (;;)
+  {
+    extend         = hs->table_size_p + hs->table_settings.size_extend;
+    extend_trigger = hs->table_size_p + hs->table_settings.size_extend_trigger;
+
+    if (extend > hs->table_settings.size_maximum || extend > ht_size_lim_p || 
+        extend_trigger > ht_size_lim_p || 
+        hs->table_itemcount < ((ht_size_t) 1 << extend_trigger))
+    {
+      return HASHTABLE_SUCCESS;
+    }
+
+    if (hashset_resize(hs, extend) != HASHTABLE_SUCCESS)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+}
+
+static int hashset_resize(struct hashset *hs, ht_size_p_t new_size_p)
+{
+  struct hashsetitem **table, *j, *next;
+  ht_size_t slot, new_size;
+  ht_hash_t new_mask;
+
+  new_size = 1 << new_size_p;
+  new_mask = new_size - 1;
+  table = hashset_malloc(hs, new_size * sizeof(struct hashsetitem *));
+
+  if (table == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  memset(table, 0, new_size * sizeof(struct hashsetitem *));
+
+  for (slot = 0; slot < hs->table_size; slot++)
+  {
+    for (j = hs->table[slot]; j != NULL; j = next)
+    {
+      next = j->next;
+      j->next = table[j->key_hash & new_mask];
+      table[j->key_hash & new_mask] = j;
+    }
+  }
+
+  if (hs->table != NULL)
+  {
+    hashset_free(hs, hs->table, 
+                 hs->table_size * sizeof(struct hashsetitem *));
+  }
+
+  hs->table        = table;
+  hs->table_size_p = new_size_p;
+  hs->table_size   = new_size;
+  hs->table_mask   = new_mask;
+
+  return HASHTABLE_SUCCESS;
+}
@@ -0,0 +1,70 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sets of keys: tables with no data pointer, for when all you need to 
+ * know is whether a key is present, plus operations on pairs of sets. */
+
+#ifndef HASHSET_HEADER
+#define HASHSET_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+struct hashsetitem
+{
+  const void *key;
+  size_t keylen;
+  ht_hash_t key_hash;
+  struct hashsetitem *next;
+};
+
+struct hashset
+{
+  struct hashsetitem **table;
+  ht_size_p_t table_size_p;
+  ht_size_t table_size;
+  ht_size_t table_itemcount;
+  ht_hash_t table_mask;
+  uint32_t table_seed;
+  struct hashtablesettings table_settings;
+};
+
+int hashset_new_custom(struct hashset *hs, 
+                       const struct hashtablesettings *s);
+int hashset_new(struct hashset *hs);
+int hashset_new_like(struct hashset *hs, struct hashset *like);
+int hashset_add(struct hashset *hs, const void *key, size_t keylen);
+int hashset_contains(struct hashset *hs, const void *key, size_t keylen);
+int hashset_remove(struct hashset *hs, const void *key, size_t keylen);
+int hashset_union(struct hashset *dst, struct hashset *src);
+int hashset_intersect(struct hashset *dst, struct hashset *src);
+int hashset_difference(struct hashset *dst, struct hashset *src);
+int hashset_is_subset(struct hashset *a, struct hashset *b);
+int hashset_union_range(struct hashset *dst, struct hashset *src, 
+                        ht_size_t first, ht_size_t count);
+int hashset_union_finish(struct hashset *dst);
+int hashset_intersect_range(struct hashset *dst, struct hashset *src, 
+                            ht_size_t first, ht_size_t count);
+int hashset_difference_range(struct hashset *dst, struct hashset *src, 
+                             ht_size_t first, ht_size_t count);
+int hashset_is_subset_range(struct hashset *a, struct hashset *b, 
+                            ht_size_t first, ht_size_t count);
+void hashset_delete(struct hashset *hs);
+
+#endif  /* HASHSET_HEADER */
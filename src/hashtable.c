@@ -19,30 +19,246 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sys/random.h>
 
 #include "hashtable.h"
+#include "hashtable_internal.h"
 #include "lookup_hash.h"
+#include "cuckoo.h"
+#include "robinhood.h"
+#include "chainindex.h"
+#include "checkpoint.h"
+#include "latency.h"
 
 #define HASHTABLE_GET_ITEM 0
 #define HASHTABLE_GET_DATA 1
 
+/* Each slot has a tag byte with one bit set for every item in its chain,
+ * chosen by the top three bits of the item's hash. These are never used 
+ * to pick a slot until the table reaches 2^29 slots, so a lookup for an 
+ * absent key can usually be rejected without touching any items. The tags 
+ * live directly after the slot pointers, in the same allocation. */
+#define hashtable_tag(hash)         ((uint8_t) (1 << ((hash) >> 29)))
+#define hashtable_table_bytes(size) \
+  ((size) * (sizeof(struct hashtableitem *) + sizeof(uint8_t)))
+
+/* Items inserted by hashtable_setv carry their own copy of the key, placed
+ * directly after the item in the same allocation. */
+#define hashtable_item_owns_key(item) \
+  ((item)->key == (const void *) ((item) + 1))
+#define hashtable_item_key_bytes(item) \
+  (hashtable_item_owns_key(item) ? (item)->keylen : 0)
+#define hashtable_item_bytes(item) \
+  (sizeof(struct hashtableitem) + hashtable_item_key_bytes(item))
+
+/* hashtable_clone allocates all of a table's items in one block, the pool,
+ * each padded to keep the next aligned. Pooled items are never freed one
+ * by one; their bytes are counted as OTHER once they have been removed, 
+ * and the block goes in hashtable_delete. */
+#define hashtable_pool_bytes(item) \
+  ((hashtable_item_bytes(item) + sizeof(void *) - 1) & \
+   ~(sizeof(void *) - 1))
+#define hashtable_item_pooled(ht, item) \
+  ((ht)->table_pool != NULL && \
+   (const char *) (item) >= (const char *) (ht)->table_pool && \
+   (const char *) (item) < (const char *) (ht)->table_pool + \
+                           (ht)->table_pool_bytes)
+
+/* While a snapshot is alive, the snapshot keeps the table and items as 
+ * they were and the table gets a new, uninitialised, array of slots. 
+ * table_cow has a bit for each slot, set once that slot's chain has been
+ * copied for the table's own use; until then, its contents are read from 
+ * the snapshot's array. Anything that is about to modify a slot, or hand 
+ * out an item that could be modified, copies the slot first. */
+#define hashtable_cow_bytes(size)  (((size) + 7) / 8)
+
+/* In seqlock mode there is one writer and any number of readers, which 
+ * take no locks. Each stripe of slots has a sequence counter, which the
+ * writer makes odd while it modifies a slot in the stripe, and there is
+ * one more for resizes, which modify everything. A reader notes the 
+ * counters, searches, and then starts again if either of them changed.
+ *
+ * A reader may therefore be looking at an item or an old slot array after
+ * the writer is done with it; such memory is put on the retired list 
+ * instead of being freed, until hashtable_seqlock_reclaim is called. */
+#define HASHTABLE_SEQLOCK_STRIPES  256
+
+struct hashtableretired
+{
+  void *ptr;
+  size_t size;
+};
+
+struct hashtableseqlock
+{
+  uint32_t resize;
+  uint32_t stripes[HASHTABLE_SEQLOCK_STRIPES];
+  struct hashtableretired *retired;
+  size_t retired_count;
+  size_t retired_size;
+};
+
+#define hashtable_seqlock_stripe(ht, slot) \
+  (&((ht)->table_seqlock->stripes[(slot) & (HASHTABLE_SEQLOCK_STRIPES - 1)]))
+
+/* The optional bloom filter is made of 64 byte blocks, so that checking a 
+ * key costs at most one cache line. A block is chosen by a remix of the 
+ * key's hash and four of its 512 bits are set, chosen by a second one. */
+#define HASHTABLE_BLOOM_BLOCK_WORDS  8
+#define HASHTABLE_BLOOM_BLOCK_BITS   (HASHTABLE_BLOOM_BLOCK_WORDS * 64)
+#define HASHTABLE_BLOOM_PROBES       4
+
+/* A chain this much longer than the average suggests that someone is 
+ * choosing keys that collide, and the table picks a new seed (if it may).
+ * It then waits for another table_size insertions before it will do so
+ * again, in case that was bad luck after all. */
+#define HASHTABLE_FLOOD_CHAIN  32
+
+/* hashtable_aggregate hashes this many records and prefetches their slots
+ * before looking any of them up, so that the cache misses overlap */
+#define HASHTABLE_AGGREGATE_BATCH  16
+
+/* In multimap mode each item's data points to one of these, holding all 
+ * of the key's values */
+struct hashtablegroup
+{
+  size_t count;
+  size_t size;
+  void *values[];
+};
+
+#define hashtable_group_bytes(size) \
+  (sizeof(struct hashtablegroup) + (size_t) (size) * sizeof(void *))
+
+struct hashtablemerge
+{
+  struct hashtable *dst;
+  struct hashtable *src;
+  int op;
+  int result;
+};
+
 const struct hashtablesettings hashtable_defaults = 
 {
   /* size_initial         */ 3,
   /* size_maximum         */ 4,
   /* size_extend          */ 1,
   /* size_extend_trigger  */ 0,
-  /* hashfunction         */ lookup_hash
+  /* hashfunction         */ lookup_hash,
+  /* mallocfunction       */ hashtable_std_malloc,
+  /* reallocfunction      */ hashtable_std_realloc,
+  /* freefunction         */ hashtable_std_free,
+  /* alloc_context        */ NULL,
+  /* bloom_bits           */ 0,
+  /* engine               */ HASHTABLE_ENGINE_CHAINED,
+  /* seqlock              */ 0,
+  /* hash_seed            */ 0,
+  /* multimap             */ 0,
+  /* max_bytes            */ 0,
+  /* checkpoint           */ 0,
+  /* latency_sample       */ 0,
+  /* arena                */ 0
 };
 
 static inline int hashtable_verify_settings(const struct hashtablesettings *s);
 static inline int hashtable_resize(struct hashtable *ht, 
                                    ht_size_p_t new_size_p);
-static inline void hashtable_insert(struct hashtable *ht, 
-                                    struct hashtableitem *item);
+static inline ht_size_t hashtable_insert(struct hashtable *ht, 
+                                         struct hashtableitem *item);
 static inline int hashtable_get_target(struct hashtable *ht,  
                                        const void *key, size_t keylen, 
                                        void **target, const int target_type);
+static inline struct hashtableitem *hashtable_find(struct hashtable *ht,
+                                                   const void *key, 
+                                                   size_t keylen,
+                                                   ht_hash_t hash);
+static inline struct hashtableitem *hashtable_chain_head(
+                                                   struct hashtable *ht,
+                                                   ht_hash_t hash);
+static struct hashtableitem *hashtable_chain_findv(struct hashtable *ht,
+                                                   const struct iovec *iov,
+                                                   int iovcnt, size_t keylen,
+                                                   ht_hash_t hash);
+static inline int hashtable_hashv(struct hashtable *ht, 
+                                  const struct iovec *iov, int iovcnt,
+                                  size_t *keylen, ht_hash_t *hash);
+static inline struct hashtableitem *hashtable_chain_find(
+                                                   struct hashtable *ht,
+                                                   const void *key, 
+                                                   size_t keylen,
+                                                   ht_hash_t hash);
+static inline uint64_t *hashtable_bloom_block(uint64_t *bloom, 
+                                              ht_size_t blocks,
+                                              ht_hash_t hash);
+static inline void hashtable_bloom_add(uint64_t *bloom, ht_size_t blocks,
+                                       ht_hash_t hash);
+static inline int hashtable_bloom_check(uint64_t *bloom, ht_size_t blocks,
+                                        ht_hash_t hash);
+static inline int hashtable_link(struct hashtable *ht, 
+                                 const void *key, size_t keylen,
+                                 const struct iovec *keyv, int keyc,
+                                 ht_hash_t hash, void *data,
+                                 construct_function construct, void *context,
+                                 struct hashtableitem **item);
+static inline int hashtable_cow_prepare(struct hashtable *ht, 
+                                        ht_hash_t hash);
+static int hashtable_cow_copy(struct hashtable *ht, ht_size_t slot);
+static int hashtable_cow_copy_all(struct hashtable *ht);
+static inline int hashtable_link_slot(struct hashtable *ht, 
+                                      const void *key, size_t keylen,
+                                      ht_hash_t hash, void *data,
+                                      construct_function construct, 
+                                      void *context,
+                                      struct hashtableitem **item);
+static inline void hashtable_slot_remove(struct hashtable *ht,
+                                         struct hashtableslot *slot);
+static inline void hashtable_prefetch(struct hashtable *ht, ht_hash_t hash);
+static inline int hashtable_accumulate(struct hashtable *ht, 
+                                       const void *key, size_t keylen,
+                                       ht_hash_t hash, intptr_t value, 
+                                       int op);
+static int hashtable_walk(struct hashtable *ht, 
+                          int (*fn)(void *context, struct hashtableitem *item),
+                          void *context);
+static int hashtable_merge_item(void *context, struct hashtableitem *item);
+static inline int hashtable_merge_check(struct hashtable *dst, 
+                                        struct hashtable *src);
+static inline void hashtable_account_shared(struct hashtable *ht, 
+                                            int category, size_t allocated,
+                                            size_t freed);
+static inline void hashtable_bloom_add_shared(uint64_t *bloom, 
+                                              ht_size_t blocks,
+                                              ht_hash_t hash);
+static inline void hashtable_seq_begin(uint32_t *seq);
+static inline void hashtable_seq_end(uint32_t *seq);
+static struct hashtableitem *hashtable_seqlock_find(struct hashtable *ht,
+                                                    const void *key, 
+                                                    size_t keylen,
+                                                    ht_hash_t hash,
+                                                    void **data);
+static int hashtable_retire_reserve(struct hashtable *ht, size_t n);
+static inline void hashtable_retire(struct hashtable *ht, int category,
+                                    void *ptr, size_t size);
+static inline struct hashtableitem *hashtable_item_alloc(struct hashtable *ht,
+                                                        size_t key_bytes);
+static inline void hashtable_item_free(struct hashtable *ht, 
+                                       struct hashtableitem *item,
+                                       size_t key_bytes);
+static inline int hashtable_chain_resize(struct hashtable *ht, 
+                                         ht_size_p_t new_size_p);
+static inline int hashtable_remove_check(struct hashtable *ht);
+static int hashtable_chain_shrink(struct hashtable *ht, 
+                                  ht_size_p_t new_size_p);
+static inline ht_hash_t hashtable_hash(struct hashtable *ht, 
+                                       const void *key, size_t keylen);
+static inline void hashtable_flood_check(struct hashtable *ht, 
+                                         ht_size_t chain);
+static int hashtable_reseed(struct hashtable *ht);
+static inline void hashtable_group_free(struct hashtable *ht, 
+                                        struct hashtablegroup *group);
+static int hashtable_group_free_item(void *context, 
+                                     struct hashtableitem *item);
 
 int hashtable_new_custom(struct hashtable *ht, 
                          const struct hashtablesettings *s)
@@ -56,15 +272,84 @@ int hashtable_new_custom(struct hashtable *ht,
   }
 
   ht->table              = NULL;
+  ht->slots              = NULL;
+  ht->table_tags         = NULL;
+  ht->table_bloom        = NULL;
+  ht->table_bloom_blocks = 0;
   ht->table_size_p       = 0;
   ht->table_size         = 0;
   ht->table_itemcount    = 0;
   ht->table_mask         = 0;
   ht->table_settings     = *s;
+  ht->table_snapshot     = NULL;
+  ht->table_cow          = NULL;
+  ht->table_seqlock      = NULL;
+  ht->table_index        = NULL;
+  ht->table_reseed_wait  = 0;
+  ht->table_memory_total = 0;
+  ht->table_pool         = NULL;
+  ht->table_pool_bytes   = 0;
+  ht->table_checkpoint   = NULL;
+  ht->table_latency      = NULL;
+  memset(ht->table_memory, 0, sizeof(ht->table_memory));
+  hashtable_settings_fill(&ht->table_settings);
+
+  if (s->hash_seed != 0)
+  {
+    ht->table_seed = s->hash_seed;
+  }
+  else
+  {
+    ht->table_seed = hashtable_random_seed(ht);
+  }
+
+  if (s->checkpoint && 
+      hashtable_checkpoint_start(ht) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  if (s->latency_sample != 0 &&
+      hashtable_latency_start(ht) != HASHTABLE_SUCCESS)
+  {
+    hashtable_checkpoint_stop(ht);
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  if (s->seqlock)
+  {
+    ht->table_seqlock = hashtable_malloc(ht, HASHTABLE_MEMORY_OTHER,
+                                         sizeof(struct hashtableseqlock));
+
+    if (ht->table_seqlock == NULL)
+    {
+      hashtable_latency_stop(ht);
+      hashtable_checkpoint_stop(ht);
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    memset(ht->table_seqlock, 0, sizeof(struct hashtableseqlock));
+  }
 
-  /* If this fails now it won't have allocated any memory 
+  /* If this fails now it won't have allocated any table memory 
    * (this is not true for its later use in hashtable_set) */
-  return hashtable_resize(ht, ht->table_settings.size_initial);
+  r = hashtable_resize(ht, ht->table_settings.size_initial);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    if (ht->table_seqlock != NULL)
+    {
+      hashtable_seqlock_reclaim(ht);
+      hashtable_free(ht, HASHTABLE_MEMORY_OTHER, ht->table_seqlock,
+                     sizeof(struct hashtableseqlock));
+      ht->table_seqlock = NULL;
+    }
+
+    hashtable_latency_stop(ht);
+    hashtable_checkpoint_stop(ht);
+  }
+
+  return r;
 }
 
 int hashtable_new(struct hashtable *ht)
@@ -78,7 +363,13 @@ int hashtable_verify_settings(const struct hashtablesettings *s)
       s->size_maximum <= ht_size_lim_p && 
       s->size_extend <= ht_size_lim_p && 
       s->size_extend_trigger <= ht_size_lim_p && 
-      s->size_extend != 0)
+      s->size_extend != 0 &&
+      s->engine <= HASHTABLE_ENGINE_ROBINHOOD &&
+      (s->engine == HASHTABLE_ENGINE_CHAINED || s->bloom_bits == 0) &&
+      (!s->seqlock || (s->engine == HASHTABLE_ENGINE_CHAINED && 
+                       s->bloom_bits == 0 && !s->multimap)) &&
+      (!s->checkpoint || (s->engine == HASHTABLE_ENGINE_CHAINED &&
+                          !s->multimap)))
   {
     return HASHTABLE_SUCCESS;
   }
@@ -88,6 +379,46 @@ int hashtable_verify_settings(const struct hashtablesettings *s)
   }
 }
 
+/* Allocator functions left NULL are the hashtable_std_* ones. A NULL 
+ * reallocfunction next to a custom malloc or free is emulated instead,
+ * since realloc can't be handed another allocator's blocks. */
+void hashtable_settings_fill(struct hashtablesettings *s)
+{
+  if (s->reallocfunction == NULL && 
+      (s->mallocfunction == NULL || 
+       s->mallocfunction == hashtable_std_malloc) &&
+      (s->freefunction == NULL || s->freefunction == hashtable_std_free))
+  {
+    s->reallocfunction = hashtable_std_realloc;
+  }
+
+  if (s->mallocfunction == NULL)
+  {
+    s->mallocfunction = hashtable_std_malloc;
+  }
+
+  if (s->freefunction == NULL)
+  {
+    s->freefunction = hashtable_std_free;
+  }
+}
+
+void *hashtable_std_malloc(void *context, size_t size)
+{
+  return malloc(size);
+}
+
+void *hashtable_std_realloc(void *context, void *ptr, 
+                            size_t old_size, size_t new_size)
+{
+  return realloc(ptr, new_size);
+}
+
+void hashtable_std_free(void *context, void *ptr, size_t size)
+{
+  free(ptr);
+}
+
 int hashtable_get_item(struct hashtable *ht, const void *key, size_t keylen, 
                        struct hashtableitem **item)
 {
@@ -98,43 +429,68 @@ int hashtable_get_item(struct hashtable *ht, const void *key, size_t keylen,
 int hashtable_get(struct hashtable *ht, const void *key, size_t keylen, 
                   void **data)
 {
-  return hashtable_get_target(ht, key, keylen, (void **) data, 
-                              HASHTABLE_GET_DATA);
+  uint64_t start;
+  int r;
+
+  start = hashtable_latency_begin(ht);
+  r = hashtable_get_target(ht, key, keylen, (void **) data, 
+                           HASHTABLE_GET_DATA);
+  hashtable_latency_end(ht, HASHTABLE_LATENCY_GET, start);
+
+  return r;
 }
 
 static inline int hashtable_get_target(struct hashtable *ht,  
                                        const void *key, size_t keylen, 
                                        void **target, const int target_type)
 {
+  int r;
   ht_hash_t hash;
   struct hashtableitem *j;
+  void *data;
+
+  hash = hashtable_hash(ht, key, keylen);
 
-  hash = (ht->table_settings.hashfunction)(key, keylen);
+  /* The caller might modify the item */
+  if (target_type == HASHTABLE_GET_ITEM)
+  {
+    r = hashtable_cow_prepare(ht, hash);
 
-  j = (ht->table)[hash & ht->table_mask];
+    if (r != HASHTABLE_SUCCESS)
+    {
+      return r;
+    }
+  }
 
-  while (j != NULL)
+  if (ht->table_seqlock != NULL)
   {
-    if (j->key_hash == hash &&
-        j->keylen   == keylen &&
-        memcmp(j->key, key, keylen) == 0)
+    j = hashtable_seqlock_find(ht, key, keylen, hash, &data);
+  }
+  else
+  {
+    j = hashtable_find(ht, key, keylen, hash);
+
+    if (j != NULL)
+    {
+      data = j->data;
+    }
+  }
+
+  if (j != NULL)
+  {
+    if (target != NULL)
     {
-      if (target != NULL)
+      if (target_type == HASHTABLE_GET_ITEM)
       {
-        if (target_type == HASHTABLE_GET_ITEM)
-        {
-          *target = j;
-        }
-        else  /* HASHTABLE_GET_DATA */
-        {
-          hashtable_get_item_data(ht, j, target);
-        }
+        *target = j;
+      }
+      else  /* HASHTABLE_GET_DATA */
+      {
+        *target = data;
       }
-
-      return HASHTABLE_SUCCESS;
     }
 
-    j = j->next;
+    return HASHTABLE_SUCCESS;
   }
 
   /* otherwise... */
@@ -146,186 +502,2501 @@ static inline int hashtable_get_target(struct hashtable *ht,
   return HASHTABLE_KEY_NOT_FOUND;
 }
 
-int hashtable_set(struct hashtable *ht, const void *key, size_t keylen,
-                  void *data)
+static inline struct hashtableitem *hashtable_find(struct hashtable *ht,
+                                                   const void *key, 
+                                                   size_t keylen,
+                                                   ht_hash_t hash)
 {
-  int i, k;
-  ht_size_p_t extend_trigger, extend;
-  struct hashtableitem *new_item;
-
-  k = hashtable_get(ht, key, keylen, NULL);
-
-  if (k == HASHTABLE_SUCCESS)
-  {
-    return HASHTABLE_DUPLICATE;
-  }
-  else if (k != HASHTABLE_KEY_NOT_FOUND)
+  switch (ht->table_settings.engine)
   {
-    /* some other error; bail */
-    return k;
+    case HASHTABLE_ENGINE_CUCKOO:
+      return hashtable_cuckoo_find(ht, key, keylen, hash);
+    case HASHTABLE_ENGINE_ROBINHOOD:
+      return hashtable_robinhood_find(ht, key, keylen, hash);
+    default:
+      return hashtable_chain_find(ht, key, keylen, hash);
   }
+}
 
-  extend         = ht->table_size_p + ht->table_settings.size_extend;
-  extend_trigger = ht->table_size_p + ht->table_settings.size_extend_trigger;
+static inline struct hashtableitem *hashtable_chain_find(
+                                                   struct hashtable *ht,
+                                                   const void *key, 
+                                                   size_t keylen,
+                                                   ht_hash_t hash)
+{
+  struct hashtableitem *j;
+  ht_size_t probes;
 
-  if (extend <= ht->table_settings.size_maximum && 
-      extend <= ht_size_lim_p && extend_trigger <= ht_size_lim_p && 
-      ht->table_itemcount == (1 << extend_trigger))
+  j = hashtable_chain_head(ht, hash);
+
+  if (j != NULL && ht->table_index != NULL && 
+      hashtable_index_of(ht, hash & ht->table_mask) != NULL)
   {
-    i = hashtable_resize(ht, extend);
+    return hashtable_index_find(ht, hash & ht->table_mask, key, keylen, 
+                                hash);
   }
-  else
+
+  for (probes = 0; j != NULL; j = j->next)
   {
-    i = HASHTABLE_SUCCESS;
+    probes++;
+
+    if (j->key_hash == hash &&
+        j->keylen   == keylen &&
+        memcmp(j->key, key, keylen) == 0)
+    {
+      break;
+    }
   }
 
-  new_item = malloc(sizeof(struct hashtableitem));
+  hashtable_probe_long(ht, hash, probes);
 
-  if (new_item == NULL)
-  {
-    return HASHTABLE_OUT_OF_MEMORY;
-  }
+  return j;
+}
 
-  new_item->key      = key;
-  new_item->keylen   = keylen;
-  new_item->key_hash = (ht->table_settings.hashfunction)(key, keylen);
-  new_item->data     = data;
+/* Returns the first item of the chain that hash would be in, or NULL if 
+ * the bloom filter or tag show that it can't be there */
+static inline struct hashtableitem *hashtable_chain_head(
+                                                   struct hashtable *ht,
+                                                   ht_hash_t hash)
+{
+  ht_size_t slot;
+  struct hashtableitem **table;
+  uint8_t *tags;
 
-  hashtable_insert(ht, new_item);
+  if (ht->table_bloom != NULL && 
+      !hashtable_bloom_check(ht->table_bloom, ht->table_bloom_blocks, hash))
+  {
+    return NULL;
+  }
 
-  (ht->table_itemcount)++;
+  slot  = hash & ht->table_mask;
+  table = ht->table;
+  tags  = ht->table_tags;
 
-  if (i == HASHTABLE_OUT_OF_MEMORY)
+  if (ht->table_cow != NULL && !hashtable_cow_copied(ht, slot))
   {
-    return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+    table = ht->table_snapshot->table;
+    tags  = ht->table_snapshot->table_tags;
   }
-  else
+
+  if ((tags[slot] & hashtable_tag(hash)) == 0)
   {
-    return HASHTABLE_SUCCESS;
+    return NULL;
   }
+
+  return table[slot];
 }
 
-int hashtable_update(struct hashtable *ht, const void *key, size_t keylen, 
-                     void *data)
+/* hashtable_chain_find, comparing the stored keys against the key's pieces 
+ * one by one */
+static struct hashtableitem *hashtable_chain_findv(struct hashtable *ht,
+                                                   const struct iovec *iov,
+                                                   int iovcnt, size_t keylen,
+                                                   ht_hash_t hash)
 {
-  int i;
-  struct hashtableitem *item;
-
-  i = hashtable_get_item(ht, key, keylen, &item);
+  struct hashtableitem *j;
+  const char *key;
+  int piece;
 
-  if (i != HASHTABLE_SUCCESS)
+  for (j = hashtable_chain_head(ht, hash); j != NULL; j = j->next)
   {
-    return i;
+    if (j->key_hash != hash || j->keylen != keylen)
+    {
+      continue;
+    }
+
+    key = j->key;
+
+    for (piece = 0; piece < iovcnt; piece++)
+    {
+      if (memcmp(key, iov[piece].iov_base, iov[piece].iov_len) != 0)
+      {
+        break;
+      }
+
+      key += iov[piece].iov_len;
+    }
+
+    if (piece == iovcnt)
+    {
+      return j;
+    }
   }
 
-  return hashtable_update_item(ht, item, data);
+  return NULL;
 }
 
-int hashtable_unset_item(struct hashtable *ht, struct hashtableitem *item)
+/* lookup_hash is the only hash function that can be fed a key in pieces,
+ * and only chained items have room for a copy of the key */
+static inline int hashtable_hashv(struct hashtable *ht, 
+                                  const struct iovec *iov, int iovcnt,
+                                  size_t *keylen, ht_hash_t *hash)
 {
-  ht_size_t slot;
+  struct lookup_hash_state state;
+  int piece;
 
-  if (item->prev == NULL)
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED || iovcnt < 0)
   {
-    slot = (item->key_hash & ht->table_mask);
-    (ht->table)[slot] = item->next;
+    return HASHTABLE_INVALID_ARG;
   }
-  else
+
+  /* Other hash functions can only be given the key in one piece */
+  if (ht->table_settings.hashfunction != lookup_hash)
   {
-    item->prev->next = item->next;
-  }
+    if (iovcnt > 1)
+    {
+      return HASHTABLE_INVALID_ARG;
+    }
 
-  ht->table_itemcount--;
+    *keylen = iovcnt == 1 ? iov[0].iov_len : 0;
+    *hash   = hashtable_hash(ht, iovcnt == 1 ? iov[0].iov_base : "", 
+                             *keylen);
 
-  free(item);
+    return HASHTABLE_SUCCESS;
+  }
 
-  return HASHTABLE_SUCCESS;
-}
+  *keylen = 0;
 
-int hashtable_unset(struct hashtable *ht, const void *key, size_t keylen)
-{
-  int i;
-  struct hashtableitem *item;
+  for (piece = 0; piece < iovcnt; piece++)
+  {
+    *keylen += iov[piece].iov_len;
+  }
 
-  i = hashtable_get_item(ht, key, keylen, &item);
+  lookup_hash_init_seeded(&state, *keylen, ht->table_seed);
 
-  if (i != HASHTABLE_SUCCESS)
+  for (piece = 0; piece < iovcnt; piece++)
   {
-    return i;
+    lookup_hash_update(&state, iov[piece].iov_base, iov[piece].iov_len);
   }
 
-  return hashtable_unset_item(ht, item);
+  *hash = lookup_hash_final(&state);
+
+  return HASHTABLE_SUCCESS;
 }
 
-void hashtable_delete(struct hashtable *ht)
+int hashtable_getv(struct hashtable *ht, const struct iovec *iov, 
+                   int iovcnt, void **data)
 {
-  ht_size_t slot;
-  struct hashtableitem *i, *j;
+  int r;
+  size_t keylen;
+  ht_hash_t hash;
+  struct hashtableitem *j;
 
-  for (slot = 0; slot < ht->table_size; slot++)
+  r = hashtable_hashv(ht, iov, iovcnt, &keylen, &hash);
+
+  if (r != HASHTABLE_SUCCESS)
   {
-    j = (ht->table)[slot];
+    return r;
+  }
+
+  j = hashtable_chain_findv(ht, iov, iovcnt, keylen, hash);
 
-    while (j != NULL)
+  if (j == NULL)
+  {
+    if (data != NULL)
     {
-      i = j->next;
-      free(j);
-      j = i;
+      *data = NULL;
     }
+
+    return HASHTABLE_KEY_NOT_FOUND;
   }
 
-  if (ht->table != NULL)
+  if (data != NULL)
   {
-    free(ht->table);
-    ht->table = NULL;
+    *data = j->data;
   }
 
-  ht->table_size_p    = 0;
-  ht->table_size      = 0;
-  ht->table_itemcount = 0;
-  ht->table_mask      = 0;
+  return HASHTABLE_SUCCESS;
 }
 
-static inline int hashtable_resize(struct hashtable *ht, 
-                                   ht_size_p_t new_size_p)
+int hashtable_setv(struct hashtable *ht, const struct iovec *iov, 
+                   int iovcnt, void *data)
 {
-  struct hashtable temp;
-  struct hashtableitem *i, *j;
-  ht_size_t slot, old_size;
+  int r;
+  size_t keylen;
+  ht_hash_t hash;
 
-  temp.table_size_p = new_size_p;
-  temp.table_size = 1 << temp.table_size_p;
-  temp.table_mask = temp.table_size - 1;
+  if (ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
 
-  /* if realloc fails, it leaves the original memory area untouched */
-  temp.table = realloc(ht->table,
-                       sizeof(struct hashtableitem *) * temp.table_size);
+  r = hashtable_hashv(ht, iov, iovcnt, &keylen, &hash);
 
-  if (temp.table == NULL)
+  if (r != HASHTABLE_SUCCESS)
   {
-    /* therefore, we can still bail and keep the original table intact */
-    return HASHTABLE_OUT_OF_MEMORY;
+    return r;
   }
 
-  /* zero the new, uninitialised, area of memory */
-  memset(temp.table + ht->table_size, 0, 
-         (temp.table_size - ht->table_size) * sizeof(struct hashtableitem *));
+  if (hashtable_chain_findv(ht, iov, iovcnt, keylen, hash) != NULL)
+  {
+    return HASHTABLE_DUPLICATE;
+  }
 
-  /* now update ht */
-  old_size         = ht->table_size;
-  ht->table        = temp.table;
-  ht->table_size_p = temp.table_size_p;
-  ht->table_size   = temp.table_size;
-  ht->table_mask   = temp.table_mask;
+  return hashtable_link(ht, NULL, keylen, iov, iovcnt, hash, data, 
+                        NULL, NULL, NULL);
+}
 
-  if (old_size != 0)
+int hashtable_set(struct hashtable *ht, const void *key, size_t keylen,
+                  void *data)
+{
+  ht_hash_t hash;
+  uint64_t start;
+  int r;
+
+  if (ht->table_settings.multimap)
   {
-    for (slot = 0; slot < old_size; slot++)
-    {
-      j = (ht->table)[slot];
+    return HASHTABLE_INVALID_ARG;
+  }
 
-      while (j != NULL)
-      {
+  start = hashtable_latency_begin(ht);
+  hash = hashtable_hash(ht, key, keylen);
+
+  if (hashtable_find(ht, key, keylen, hash) != NULL)
+  {
+    r = HASHTABLE_DUPLICATE;
+  }
+  else
+  {
+    r = hashtable_link(ht, key, keylen, NULL, 0, hash, data, 
+                       NULL, NULL, NULL);
+  }
+
+  hashtable_latency_end(ht, HASHTABLE_LATENCY_SET, start);
+
+  return r;
+}
+
+int hashtable_get_or_insert(struct hashtable *ht, const void *key, 
+                            size_t keylen, struct hashtableitem **item,
+                            int *inserted)
+{
+  return hashtable_get_or_insert_with(ht, key, keylen, NULL, NULL, 
+                                      item, inserted);
+}
+
+int hashtable_get_or_insert_with(struct hashtable *ht, const void *key,
+                                 size_t keylen, construct_function construct,
+                                 void *context, struct hashtableitem **item,
+                                 int *inserted)
+{
+  int r;
+  ht_hash_t hash;
+  struct hashtableitem *j;
+
+  if (inserted != NULL)
+  {
+    *inserted = 0;
+  }
+
+  if (ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hash = hashtable_hash(ht, key, keylen);
+  r = hashtable_cow_prepare(ht, hash);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  j = hashtable_find(ht, key, keylen, hash);
+
+  if (j != NULL)
+  {
+    if (item != NULL)
+    {
+      *item = j;
+    }
+
+    return HASHTABLE_SUCCESS;
+  }
+
+  r = hashtable_link(ht, key, keylen, NULL, 0, hash, NULL, 
+                     construct, context, item);
+
+  if (inserted != NULL && (r == HASHTABLE_SUCCESS || 
+                           r == HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY))
+  {
+    *inserted = 1;
+  }
+
+  return r;
+}
+
+int hashtable_upsert(struct hashtable *ht, const void *key, size_t keylen,
+                     void *data)
+{
+  int r;
+  ht_hash_t hash;
+  struct hashtableitem *j;
+
+  if (ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hash = hashtable_hash(ht, key, keylen);
+  r = hashtable_cow_prepare(ht, hash);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  j = hashtable_find(ht, key, keylen, hash);
+
+  if (j != NULL)
+  {
+    return hashtable_update_item(ht, j, data);
+  }
+
+  return hashtable_link(ht, key, keylen, NULL, 0, hash, data, 
+                        NULL, NULL, NULL);
+}
+
+int hashtable_multi_add(struct hashtable *ht, const void *key, 
+                        size_t keylen, void *value)
+{
+  int r;
+  ht_hash_t hash;
+  struct hashtableitem *j;
+  struct hashtablegroup *group;
+
+  if (!ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hash = hashtable_hash(ht, key, keylen);
+  j = hashtable_find(ht, key, keylen, hash);
+
+  if (j == NULL)
+  {
+    group = hashtable_malloc(ht, HASHTABLE_MEMORY_VALUES, 
+                             hashtable_group_bytes(1));
+
+    if (group == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    group->count     = 1;
+    group->size      = 1;
+    group->values[0] = value;
+
+    r = hashtable_link(ht, key, keylen, NULL, 0, hash, group, 
+                       NULL, NULL, NULL);
+
+    if (r == HASHTABLE_OUT_OF_MEMORY)
+    {
+      hashtable_free(ht, HASHTABLE_MEMORY_VALUES, group, 
+                     hashtable_group_bytes(1));
+    }
+
+    return r;
+  }
+
+  group = j->data;
+
+  if (group->count == group->size)
+  {
+    group = hashtable_realloc(ht, HASHTABLE_MEMORY_VALUES, group, 
+                              hashtable_group_bytes(group->size),
+                              hashtable_group_bytes(group->size * 2));
+
+    if (group == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    group->size *= 2;
+    j->data = group;
+  }
+
+  group->values[group->count] = value;
+  group->count++;
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_multi_get(struct hashtable *ht, const void *key, 
+                        size_t keylen, void *const **values, size_t *count)
+{
+  struct hashtableitem *j;
+  struct hashtablegroup *group;
+
+  if (!ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  j = hashtable_find(ht, key, keylen, hashtable_hash(ht, key, keylen));
+
+  if (j == NULL)
+  {
+    if (values != NULL)
+    {
+      *values = NULL;
+    }
+
+    if (count != NULL)
+    {
+      *count = 0;
+    }
+
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  group = j->data;
+
+  if (values != NULL)
+  {
+    *values = group->values;
+  }
+
+  if (count != NULL)
+  {
+    *count = group->count;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_multi_remove(struct hashtable *ht, const void *key, 
+                           size_t keylen, void *value)
+{
+  struct hashtableitem *j;
+  struct hashtablegroup *group;
+  size_t i;
+
+  if (!ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  j = hashtable_find(ht, key, keylen, hashtable_hash(ht, key, keylen));
+
+  if (j == NULL)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  group = j->data;
+
+  for (i = 0; i < group->count; i++)
+  {
+    if (group->values[i] == value)
+    {
+      break;
+    }
+  }
+
+  if (i == group->count)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  if (group->count == 1)
+  {
+    return hashtable_unset_item(ht, j);
+  }
+
+  /* The remaining values keep their order */
+  group->count--;
+  memmove(&group->values[i], &group->values[i + 1], 
+          (group->count - i) * sizeof(void *));
+
+  return HASHTABLE_SUCCESS;
+}
+
+static inline void hashtable_group_free(struct hashtable *ht, 
+                                        struct hashtablegroup *group)
+{
+  hashtable_free(ht, HASHTABLE_MEMORY_VALUES, group, 
+                 hashtable_group_bytes(group->size));
+}
+
+static int hashtable_group_free_item(void *context, 
+                                     struct hashtableitem *item)
+{
+  hashtable_group_free(context, item->data);
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_aggregate(struct hashtable *ht, 
+                        const struct hashtablerecord *records, size_t n,
+                        int op)
+{
+  ht_hash_t hashes[HASHTABLE_AGGREGATE_BATCH];
+  const void *keys[HASHTABLE_AGGREGATE_BATCH];
+  size_t base, count, i;
+  int r, result;
+
+  if (op < HASHTABLE_AGGREGATE_SUM || op > HASHTABLE_AGGREGATE_MAX ||
+      ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  result = HASHTABLE_SUCCESS;
+
+  for (base = 0; base < n; base += count)
+  {
+    count = n - base;
+
+    if (count > HASHTABLE_AGGREGATE_BATCH)
+    {
+      count = HASHTABLE_AGGREGATE_BATCH;
+    }
+
+    for (i = 1; i < count; i++)
+    {
+      if (records[base + i].keylen != records[base].keylen)
+      {
+        break;
+      }
+    }
+
+    /* Keys that are all the same length can be hashed side by side */
+    if (i == count && ht->table_settings.hashfunction == lookup_hash)
+    {
+      for (i = 0; i < count; i++)
+      {
+        keys[i] = records[base + i].key;
+      }
+
+      lookup_hash_many_seeded(keys, records[base].keylen, ht->table_seed,
+                              hashes, count);
+    }
+    else
+    {
+      for (i = 0; i < count; i++)
+      {
+        hashes[i] = hashtable_hash(ht, records[base + i].key, 
+                                   records[base + i].keylen);
+      }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+      hashtable_prefetch(ht, hashes[i]);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+      r = hashtable_accumulate(ht, records[base + i].key, 
+                               records[base + i].keylen, hashes[i], 
+                               records[base + i].value, op);
+
+      if (r == HASHTABLE_OUT_OF_MEMORY)
+      {
+        return r;
+      }
+      else if (r != HASHTABLE_SUCCESS)
+      {
+        result = r;
+      }
+    }
+  }
+
+  return result;
+}
+
+int hashtable_aggregate_merge(struct hashtable *dst, struct hashtable *src,
+                              int op)
+{
+  struct hashtablemerge merge;
+  int r;
+
+  if (op < HASHTABLE_AGGREGATE_SUM || op > HASHTABLE_AGGREGATE_MAX ||
+      dst == src || dst->table_settings.multimap || 
+      src->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  /* Partial counts are summed */
+  if (op == HASHTABLE_AGGREGATE_COUNT)
+  {
+    op = HASHTABLE_AGGREGATE_SUM;
+  }
+
+  merge.dst    = dst;
+  merge.src    = src;
+  merge.op     = op;
+  merge.result = HASHTABLE_SUCCESS;
+
+  r = hashtable_walk(src, hashtable_merge_item, &merge);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return merge.result;
+}
+
+static int hashtable_merge_item(void *context, struct hashtableitem *item)
+{
+  struct hashtablemerge *merge;
+  ht_hash_t hash;
+  int r;
+
+  merge = context;
+  hash  = item->key_hash;
+
+  /* The hash can be reused if both tables use the same function */
+  if (merge->dst->table_settings.hashfunction != 
+      merge->src->table_settings.hashfunction || 
+      merge->dst->table_seed != merge->src->table_seed)
+  {
+    hash = hashtable_hash(merge->dst, item->key, item->keylen);
+  }
+
+  r = hashtable_accumulate(merge->dst, item->key, item->keylen, hash, 
+                           (intptr_t) item->data, merge->op);
+
+  if (r == HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY)
+  {
+    merge->result = r;
+    r = HASHTABLE_SUCCESS;
+  }
+
+  return r;
+}
+
+/* Items can only be moved between tables that agree on the hash of every 
+ * key and on how items are allocated and freed */
+static inline int hashtable_merge_check(struct hashtable *dst, 
+                                        struct hashtable *src)
+{
+  if (dst == src ||
+      dst->table_settings.engine != HASHTABLE_ENGINE_CHAINED || 
+      src->table_settings.engine != HASHTABLE_ENGINE_CHAINED ||
+      dst->table_seqlock != NULL || src->table_seqlock != NULL ||
+      dst->table_settings.multimap || src->table_settings.multimap ||
+      src->table_snapshot != NULL || src->table_pool != NULL ||
+      dst->table_settings.hashfunction != src->table_settings.hashfunction ||
+      dst->table_seed != src->table_seed ||
+      dst->table_settings.mallocfunction != 
+      src->table_settings.mallocfunction ||
+      dst->table_settings.freefunction != src->table_settings.freefunction ||
+      dst->table_settings.alloc_context != src->table_settings.alloc_context ||
+      dst->table_settings.arena != src->table_settings.arena)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_merge(struct hashtable *dst, struct hashtable *src,
+                    merge_function conflict, void *context)
+{
+  int r, i;
+
+  i = hashtable_merge_prepare(dst, src);
+
+  if (i != HASHTABLE_SUCCESS && i != HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY)
+  {
+    return i;
+  }
+
+  r = hashtable_merge_range(dst, src, 0, src->table_size, conflict, context);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return i;
+}
+
+/* Gets dst ready for any number of hashtable_merge_range calls: it is 
+ * grown up front, since it can't be while they run, and is left with no 
+ * indexes or snapshot copying for them to keep up to date */
+int hashtable_merge_prepare(struct hashtable *dst, struct hashtable *src)
+{
+  ht_size_p_t extend, extend_trigger;
+  size_t itemcount;
+  int r;
+
+  r = hashtable_merge_check(dst, src);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  if (dst->table_cow != NULL && 
+      hashtable_cow_copy_all(dst) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  hashtable_index_drop_all(dst);
+  hashtable_index_drop_all(src);
+
+  /* Enough room for both, and at least as many slots as src so that each 
+   * of its slots feeds different slots of dst */
+  itemcount = (size_t) dst->table_itemcount + src->table_itemcount;
+
+  for (;;)
+  {
+    extend         = dst->table_size_p + dst->table_settings.size_extend;
+    extend_trigger = dst->table_size_p + 
+                     dst->table_settings.size_extend_trigger;
+
+    if (extend > dst->table_settings.size_maximum || 
+        extend > ht_size_lim_p || extend_trigger > ht_size_lim_p ||
+        (itemcount < ((size_t) 1 << extend_trigger) && 
+         dst->table_size_p >= src->table_size_p))
+    {
+      return HASHTABLE_SUCCESS;
+    }
+
+    if (hashtable_resize(dst, extend) != HASHTABLE_SUCCESS)
+    {
+      return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+    }
+  }
+}
+
+/* Moves the items of src's slots first to first + count - 1 into dst. 
+ * Everything shared between ranges (counters and the bloom filter) is 
+ * updated atomically, so disjoint ranges may be merged at once. */
+int hashtable_merge_range(struct hashtable *dst, struct hashtable *src,
+                          ht_size_t first, ht_size_t count,
+                          merge_function conflict, void *context)
+{
+  struct hashtableitem *i, *j, *k, *tail;
+  ht_size_t slot, dst_slot, moved, dropped;
+  size_t moved_keys, dropped_keys, dropped_bytes;
+  int r;
+
+  r = hashtable_merge_check(dst, src);
+  if (r != HASHTABLE_SUCCESS || dst->table_cow != NULL || 
+      dst->table_index != NULL || src->table_index != NULL ||
+      first > src->table_size || count > src->table_size - first)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  moved         = 0;
+  dropped       = 0;
+  moved_keys    = 0;
+  dropped_keys  = 0;
+  dropped_bytes = 0;
+
+  for (slot = first; slot < first + count && r == HASHTABLE_SUCCESS; slot++)
+  {
+    for (j = (src->table)[slot]; j != NULL; j = i)
+    {
+      i = j->next;
+      dst_slot = j->key_hash & dst->table_mask;
+
+      /* The duplicate search also finds the end of the chain */
+      tail = NULL;
+
+      for (k = (dst->table)[dst_slot]; k != NULL; k = k->next)
+      {
+        if (k->key_hash == j->key_hash && k->keylen == j->keylen &&
+            memcmp(k->key, j->key, j->keylen) == 0)
+        {
+          break;
+        }
+
+        tail = k;
+      }
+
+      if (k != NULL && conflict != NULL)
+      {
+        r = conflict(context, k, j);
+
+        if (r != HASHTABLE_SUCCESS)
+        {
+          /* The rest of the chain stays in src */
+          (src->table)[slot] = j;
+          j->prev = NULL;
+          break;
+        }
+      }
+
+      hashtable_checkpoint_mark_shared(dst, j->key_hash);
+      hashtable_checkpoint_mark_shared(src, j->key_hash);
+
+      if (k != NULL)
+      {
+        dropped++;
+        dropped_keys  += hashtable_item_key_bytes(j);
+        dropped_bytes += hashtable_item_bytes(j);
+
+        if (!src->table_settings.arena)
+        {
+          (src->table_settings.freefunction)
+                (src->table_settings.alloc_context, j, 
+                 hashtable_item_bytes(j));
+        }
+
+        continue;
+      }
+
+      j->next = NULL;
+      j->prev = tail;
+
+      if (tail == NULL)
+      {
+        (dst->table)[dst_slot] = j;
+      }
+      else
+      {
+        tail->next = j;
+      }
+
+      (dst->table_tags)[dst_slot] |= hashtable_tag(j->key_hash);
+
+      if (dst->table_bloom != NULL)
+      {
+        hashtable_bloom_add_shared(dst->table_bloom, dst->table_bloom_blocks,
+                                   j->key_hash);
+      }
+
+      moved++;
+      moved_keys += hashtable_item_key_bytes(j);
+    }
+
+    if (r == HASHTABLE_SUCCESS)
+    {
+      (src->table)[slot]      = NULL;
+      (src->table_tags)[slot] = 0;
+    }
+  }
+
+  /* Moved items keep their bytes; they are just someone else's now */
+  __atomic_add_fetch(&dst->table_itemcount, moved, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&src->table_itemcount, moved + dropped, 
+                     __ATOMIC_RELAXED);
+
+  hashtable_account_shared(dst, HASHTABLE_MEMORY_ITEMS, 
+                           moved * sizeof(struct hashtableitem), 0);
+  hashtable_account_shared(dst, HASHTABLE_MEMORY_KEYS, moved_keys, 0);
+  hashtable_account_shared(src, HASHTABLE_MEMORY_ITEMS, 0, 
+                           moved * sizeof(struct hashtableitem) + 
+                           dropped_bytes - dropped_keys);
+  hashtable_account_shared(src, HASHTABLE_MEMORY_KEYS, 0, 
+                           moved_keys + dropped_keys);
+
+  return r;
+}
+
+static inline void hashtable_account_shared(struct hashtable *ht, 
+                                            int category, size_t allocated,
+                                            size_t freed)
+{
+  __atomic_add_fetch(&ht->table_memory[category], allocated - freed, 
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&ht->table_memory_total, allocated - freed, 
+                     __ATOMIC_RELAXED);
+}
+
+/* Starts loading the memory a lookup of hash will read first */
+static inline void hashtable_prefetch(struct hashtable *ht, ht_hash_t hash)
+{
+  ht_size_t slot;
+
+  slot = hash & ht->table_mask;
+
+  switch (ht->table_settings.engine)
+  {
+    case HASHTABLE_ENGINE_CUCKOO:
+      if (ht->slots != NULL)
+      {
+        __builtin_prefetch(&ht->slots[slot * CUCKOO_WAYS]);
+        __builtin_prefetch(&ht->table_tags[slot * CUCKOO_WAYS]);
+      }
+      break;
+
+    case HASHTABLE_ENGINE_ROBINHOOD:
+      if (ht->slots != NULL)
+      {
+        __builtin_prefetch(&ht->slots[slot]);
+        __builtin_prefetch(&ht->table_tags[slot]);
+      }
+      break;
+
+    default:
+      if (ht->table != NULL)
+      {
+        __builtin_prefetch(&ht->table[slot]);
+        __builtin_prefetch(&ht->table_tags[slot]);
+      }
+      break;
+  }
+}
+
+/* Folds value into the accumulator stored in key's data, inserting it if
+ * the key is absent. The arithmetic is done unsigned so that sums wrap 
+ * rather than overflow. */
+static inline int hashtable_accumulate(struct hashtable *ht, 
+                                       const void *key, size_t keylen,
+                                       ht_hash_t hash, intptr_t value, 
+                                       int op)
+{
+  struct hashtableitem *j;
+  intptr_t acc;
+  int r;
+
+  r = hashtable_cow_prepare(ht, hash);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  if (op == HASHTABLE_AGGREGATE_COUNT)
+  {
+    value = 1;
+  }
+
+  j = hashtable_find(ht, key, keylen, hash);
+
+  if (j == NULL)
+  {
+    return hashtable_link(ht, key, keylen, NULL, 0, hash, (void *) value, 
+                          NULL, NULL, NULL);
+  }
+
+  acc = (intptr_t) j->data;
+
+  switch (op)
+  {
+    case HASHTABLE_AGGREGATE_MIN:
+      if (value < acc)
+      {
+        acc = value;
+      }
+      break;
+
+    case HASHTABLE_AGGREGATE_MAX:
+      if (value > acc)
+      {
+        acc = value;
+      }
+      break;
+
+    default:  /* SUM, COUNT */
+      acc = (intptr_t) ((uintptr_t) acc + (uintptr_t) value);
+      break;
+  }
+
+  j->data = (void *) acc;
+  hashtable_checkpoint_mark(ht, hash);
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Calls fn on every item in the table, whatever the engine, stopping at 
+ * the first return value that isn't HASHTABLE_SUCCESS and passing it on. 
+ * fn must not modify the table. */
+static int hashtable_walk(struct hashtable *ht, 
+                          int (*fn)(void *context, struct hashtableitem *item),
+                          void *context)
+{
+  struct hashtableitem *j;
+  ht_size_t slot, slots;
+  int r;
+
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED)
+  {
+    if (ht->slots == NULL)
+    {
+      return HASHTABLE_SUCCESS;
+    }
+
+    slots = ht->table_size;
+
+    if (ht->table_settings.engine == HASHTABLE_ENGINE_CUCKOO)
+    {
+      slots *= CUCKOO_WAYS;
+    }
+
+    /* Both engines mark empty slots with a zero byte */
+    for (slot = 0; slot < slots; slot++)
+    {
+      if ((ht->table_tags)[slot] != 0)
+      {
+        r = fn(context, (struct hashtableitem *) &ht->slots[slot]);
+
+        if (r != HASHTABLE_SUCCESS)
+        {
+          return r;
+        }
+      }
+    }
+
+    return HASHTABLE_SUCCESS;
+  }
+
+  if (ht->table == NULL)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  for (slot = 0; slot < ht->table_size; slot++)
+  {
+    if (ht->table_cow != NULL && !hashtable_cow_copied(ht, slot))
+    {
+      j = (ht->table_snapshot->table)[slot];
+    }
+    else
+    {
+      j = (ht->table)[slot];
+    }
+
+    for (; j != NULL; j = j->next)
+    {
+      r = fn(context, j);
+
+      if (r != HASHTABLE_SUCCESS)
+      {
+        return r;
+      }
+    }
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Allocates a new item for key (which must not already be in the table),
+ * growing the table first if the settings say so. If construct is not NULL 
+ * it is called to produce the item's data once the item has been allocated; 
+ * if it fails, nothing is inserted and its return value is passed on. */
+static inline int hashtable_link(struct hashtable *ht, 
+                                 const void *key, size_t keylen,
+                                 const struct iovec *keyv, int keyc,
+                                 ht_hash_t hash, void *data,
+                                 construct_function construct, void *context,
+                                 struct hashtableitem **item)
+{
+  int i, r, piece;
+  ht_size_p_t extend_trigger, extend;
+  struct hashtableitem *new_item;
+  uint32_t *seq;
+  size_t offset;
+  ht_size_t chain;
+
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED)
+  {
+    return hashtable_link_slot(ht, key, keylen, hash, data, 
+                               construct, context, item);
+  }
+
+  extend         = ht->table_size_p + ht->table_settings.size_extend;
+  extend_trigger = ht->table_size_p + ht->table_settings.size_extend_trigger;
+
+  if (extend <= ht->table_settings.size_maximum && 
+      extend <= ht_size_lim_p && extend_trigger <= ht_size_lim_p && 
+      ht->table_itemcount == (1 << extend_trigger))
+  {
+    i = hashtable_resize(ht, extend);
+  }
+  else
+  {
+    i = HASHTABLE_SUCCESS;
+  }
+
+  r = hashtable_cow_prepare(ht, hash);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    if (item != NULL)
+    {
+      *item = NULL;
+    }
+
+    return r;
+  }
+
+  new_item = hashtable_item_alloc(ht, keyv != NULL ? keylen : 0);
+
+  if (new_item == NULL)
+  {
+    if (item != NULL)
+    {
+      *item = NULL;
+    }
+
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  if (keyv != NULL)
+  {
+    /* The pieces of the key are gathered into the end of the item */
+    key = new_item + 1;
+
+    for (offset = 0, piece = 0; piece < keyc; piece++)
+    {
+      memcpy((char *) key + offset, keyv[piece].iov_base, 
+             keyv[piece].iov_len);
+      offset += keyv[piece].iov_len;
+    }
+  }
+
+  if (construct != NULL)
+  {
+    r = construct(context, key, keylen, &data);
+
+    if (r != HASHTABLE_SUCCESS)
+    {
+      hashtable_item_free(ht, new_item, keyv != NULL ? keylen : 0);
+
+      if (item != NULL)
+      {
+        *item = NULL;
+      }
+
+      return r;
+    }
+  }
+
+  new_item->key      = key;
+  new_item->keylen   = keylen;
+  new_item->key_hash = hash;
+  new_item->data     = data;
+
+  if (ht->table_seqlock != NULL)
+  {
+    seq = hashtable_seqlock_stripe(ht, hash & ht->table_mask);
+    hashtable_seq_begin(seq);
+    chain = hashtable_insert(ht, new_item);
+    hashtable_seq_end(seq);
+  }
+  else
+  {
+    chain = hashtable_insert(ht, new_item);
+  }
+
+  hashtable_index_insert(ht, hash & ht->table_mask, new_item, chain);
+  hashtable_checkpoint_mark(ht, hash);
+
+  if (ht->table_bloom != NULL)
+  {
+    hashtable_bloom_add(ht->table_bloom, ht->table_bloom_blocks, hash);
+  }
+
+  (ht->table_itemcount)++;
+
+  hashtable_flood_check(ht, chain);
+
+  if (item != NULL)
+  {
+    *item = new_item;
+  }
+
+  if (i == HASHTABLE_OUT_OF_MEMORY)
+  {
+    return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+  }
+  else
+  {
+    return HASHTABLE_SUCCESS;
+  }
+}
+
+/* hashtable_link for the open addressing engines, which find (and make, 
+ * growing the table if need be) room for the item before constructing it */
+static inline int hashtable_link_slot(struct hashtable *ht, 
+                                      const void *key, size_t keylen,
+                                      ht_hash_t hash, void *data,
+                                      construct_function construct, 
+                                      void *context,
+                                      struct hashtableitem **item)
+{
+  int i, r;
+  struct hashtableslot *slot;
+
+  if (ht->table_settings.engine == HASHTABLE_ENGINE_CUCKOO)
+  {
+    i = hashtable_cuckoo_reserve(ht, hash, &slot);
+  }
+  else
+  {
+    i = hashtable_robinhood_reserve(ht, hash, &slot);
+  }
+
+  if (i == HASHTABLE_OUT_OF_MEMORY)
+  {
+    if (item != NULL)
+    {
+      *item = NULL;
+    }
+
+    return i;
+  }
+
+  if (construct != NULL)
+  {
+    r = construct(context, key, keylen, &data);
+
+    if (r != HASHTABLE_SUCCESS)
+    {
+      hashtable_slot_remove(ht, slot);
+
+      if (item != NULL)
+      {
+        *item = NULL;
+      }
+
+      return r;
+    }
+  }
+
+  slot->key    = key;
+  slot->keylen = keylen;
+  slot->data   = data;
+
+  (ht->table_itemcount)++;
+
+  if (item != NULL)
+  {
+    *item = (struct hashtableitem *) slot;
+  }
+
+  return i;
+}
+
+static inline void hashtable_slot_remove(struct hashtable *ht,
+                                         struct hashtableslot *slot)
+{
+  if (ht->table_settings.engine == HASHTABLE_ENGINE_CUCKOO)
+  {
+    hashtable_cuckoo_remove(ht, slot);
+  }
+  else
+  {
+    hashtable_robinhood_remove(ht, slot);
+  }
+}
+
+int hashtable_update(struct hashtable *ht, const void *key, size_t keylen, 
+                     void *data)
+{
+  int i;
+  struct hashtableitem *item;
+
+  if (ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  i = hashtable_get_item(ht, key, keylen, &item);
+
+  if (i != HASHTABLE_SUCCESS)
+  {
+    return i;
+  }
+
+  return hashtable_update_item(ht, item, data);
+}
+
+int hashtable_unset_item(struct hashtable *ht, struct hashtableitem *item)
+{
+  ht_size_t slot;
+  struct hashtableitem *j;
+  uint8_t tag;
+  uint32_t *seq;
+
+  if (ht->table_settings.multimap)
+  {
+    hashtable_group_free(ht, item->data);
+  }
+
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED)
+  {
+    hashtable_slot_remove(ht, (struct hashtableslot *) item);
+    ht->table_itemcount--;
+
+    return HASHTABLE_SUCCESS;
+  }
+
+  seq  = NULL;
+  slot = (item->key_hash & ht->table_mask);
+
+  if (ht->table_seqlock != NULL)
+  {
+    if (hashtable_retire_reserve(ht, 1) != HASHTABLE_SUCCESS)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    seq = hashtable_seqlock_stripe(ht, slot);
+    hashtable_seq_begin(seq);
+  }
+
+  hashtable_index_remove(ht, slot, item);
+
+  /* item came from hashtable_get_item, so its slot has been copied */
+  if (item->prev == NULL)
+  {
+    (ht->table)[slot] = item->next;
+  }
+  else
+  {
+    item->prev->next = item->next;
+  }
+
+  if (item->next != NULL)
+  {
+    item->next->prev = item->prev;
+  }
+
+  /* Rebuild the slot's tag from what remains in the chain */
+  tag = 0;
+
+  for (j = (ht->table)[slot]; j != NULL; j = j->next)
+  {
+    tag |= hashtable_tag(j->key_hash);
+  }
+
+  (ht->table_tags)[slot] = tag;
+  hashtable_checkpoint_mark(ht, item->key_hash);
+
+  ht->table_itemcount--;
+
+  if (seq != NULL)
+  {
+    /* item->next is left alone for the benefit of any reader on it */
+    hashtable_seq_end(seq);
+    hashtable_account_move(ht, HASHTABLE_MEMORY_KEYS, HASHTABLE_MEMORY_ITEMS,
+                           hashtable_item_key_bytes(item));
+    hashtable_retire(ht, HASHTABLE_MEMORY_ITEMS, item, 
+                     hashtable_item_bytes(item));
+  }
+  else
+  {
+    hashtable_item_free(ht, item, hashtable_item_key_bytes(item));
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_unset(struct hashtable *ht, const void *key, size_t keylen)
+{
+  int i;
+  struct hashtableitem *item;
+  uint64_t start;
+
+  start = hashtable_latency_begin(ht);
+  i = hashtable_get_item(ht, key, keylen, &item);
+
+  if (i == HASHTABLE_SUCCESS)
+  {
+    i = hashtable_unset_item(ht, item);
+  }
+
+  hashtable_latency_end(ht, HASHTABLE_LATENCY_UNSET, start);
+
+  return i;
+}
+
+/* Bulk removal moves whole chains around, so it is only for chained 
+ * tables without concurrent readers or per key groups */
+static inline int hashtable_remove_check(struct hashtable *ht)
+{
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED ||
+      ht->table_seqlock != NULL || ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_remove_if(struct hashtable *ht, predicate_function predicate,
+                        void *context)
+{
+  int r;
+
+  r = hashtable_remove_prepare(ht);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  r = hashtable_remove_range(ht, 0, ht->table_size, predicate, context);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  return hashtable_shrink(ht);
+}
+
+/* Gets ht ready for any number of hashtable_remove_range calls, leaving it
+ * with no indexes or snapshot copying for them to keep up to date */
+int hashtable_remove_prepare(struct hashtable *ht)
+{
+  int r;
+
+  r = hashtable_remove_check(ht);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  if (ht->table_cow != NULL && 
+      hashtable_cow_copy_all(ht) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  hashtable_index_drop_all(ht);
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Removes the items in slots first to first + count - 1 for which 
+ * predicate returns non zero. Each slot's tag is rebuilt once, after its 
+ * whole chain has been swept, and everything shared between ranges (the 
+ * counters and the checkpoint bitmap) is updated atomically, once per 
+ * call, so disjoint ranges may be swept at once. */
+int hashtable_remove_range(struct hashtable *ht, ht_size_t first, 
+                           ht_size_t count, predicate_function predicate,
+                           void *context)
+{
+  struct hashtableitem *i, *j;
+  ht_size_t slot, removed;
+  size_t item_bytes, key_bytes, pooled_bytes;
+  uint8_t tag;
+  int r;
+
+  r = hashtable_remove_check(ht);
+  if (r != HASHTABLE_SUCCESS || predicate == NULL || 
+      ht->table_cow != NULL || ht->table_index != NULL ||
+      first > ht->table_size || count > ht->table_size - first)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  removed      = 0;
+  item_bytes   = 0;
+  key_bytes    = 0;
+  pooled_bytes = 0;
+
+  for (slot = first; slot < first + count; slot++)
+  {
+    tag = 0;
+
+    for (j = (ht->table)[slot]; j != NULL; j = i)
+    {
+      i = j->next;
+
+      if (!predicate(context, j))
+      {
+        tag |= hashtable_tag(j->key_hash);
+        continue;
+      }
+
+      if (j->prev == NULL)
+      {
+        (ht->table)[slot] = i;
+      }
+      else
+      {
+        j->prev->next = i;
+      }
+
+      if (i != NULL)
+      {
+        i->prev = j->prev;
+      }
+
+      hashtable_checkpoint_mark_shared(ht, j->key_hash);
+
+      removed++;
+      item_bytes += hashtable_item_bytes(j);
+      key_bytes  += hashtable_item_key_bytes(j);
+
+      /* Pooled items go back to the pool's bytes, as in 
+       * hashtable_item_free */
+      if (hashtable_item_pooled(ht, j))
+      {
+        pooled_bytes += hashtable_item_bytes(j);
+      }
+      else if (!ht->table_settings.arena)
+      {
+        (ht->table_settings.freefunction)
+              (ht->table_settings.alloc_context, j, hashtable_item_bytes(j));
+      }
+    }
+
+    (ht->table_tags)[slot] = tag;
+  }
+
+  __atomic_sub_fetch(&ht->table_itemcount, removed, __ATOMIC_RELAXED);
+
+  hashtable_account_shared(ht, HASHTABLE_MEMORY_ITEMS, 0, 
+                           item_bytes - key_bytes);
+  hashtable_account_shared(ht, HASHTABLE_MEMORY_KEYS, 0, key_bytes);
+  hashtable_account_shared(ht, HASHTABLE_MEMORY_OTHER, pooled_bytes, 0);
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Makes the table smaller, by size_extend at a time but not below 
+ * size_initial, for as long as it would then be no more than half way to 
+ * its next extend_trigger, so that it doesn't have to grow again straight
+ * away. If the smaller table can't be allocated the table is left as it 
+ * is, and HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY is returned. */
+int hashtable_shrink(struct hashtable *ht)
+{
+  const struct hashtablesettings *s;
+  ht_size_p_t size_p;
+  int r;
+
+  r = hashtable_remove_check(ht);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  s = &ht->table_settings;
+  size_p = ht->table_size_p;
+
+  while (size_p >= s->size_initial + s->size_extend &&
+         ht->table_itemcount <= 
+         ((size_t) 1 << (size_p - s->size_extend + s->size_extend_trigger))
+         / 2)
+  {
+    size_p -= s->size_extend;
+  }
+
+  if (size_p == ht->table_size_p)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  if (hashtable_probe_resize(ht, size_p, hashtable_chain_shrink) != 
+      HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+static inline uint64_t *hashtable_bloom_block(uint64_t *bloom, 
+                                              ht_size_t blocks,
+                                              ht_hash_t hash)
+{
+  /* fmix32 from MurmurHash3, so that the block doesn't depend on the same 
+   * bits as the slot */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+
+  return bloom + (((uint64_t) hash * blocks) >> 32) * 
+                 HASHTABLE_BLOOM_BLOCK_WORDS;
+}
+
+static inline void hashtable_bloom_add(uint64_t *bloom, ht_size_t blocks,
+                                       ht_hash_t hash)
+{
+  uint64_t *block, bits;
+  int i;
+
+  block = hashtable_bloom_block(bloom, blocks, hash);
+  bits  = (uint64_t) hash * 0x9e3779b97f4a7c15ULL;
+
+  for (i = 0; i < HASHTABLE_BLOOM_PROBES; i++)
+  {
+    bits >>= 9;
+    block[(bits >> 6) & 7] |= (uint64_t) 1 << (bits & 63);
+  }
+}
+
+/* As hashtable_bloom_add, for when other threads are adding to the same 
+ * filter */
+static inline void hashtable_bloom_add_shared(uint64_t *bloom, 
+                                              ht_size_t blocks,
+                                              ht_hash_t hash)
+{
+  uint64_t *block, bits;
+  int i;
+
+  block = hashtable_bloom_block(bloom, blocks, hash);
+  bits  = (uint64_t) hash * 0x9e3779b97f4a7c15ULL;
+
+  for (i = 0; i < HASHTABLE_BLOOM_PROBES; i++)
+  {
+    bits >>= 9;
+    __atomic_fetch_or(&block[(bits >> 6) & 7], (uint64_t) 1 << (bits & 63),
+                      __ATOMIC_RELAXED);
+  }
+}
+
+static inline int hashtable_bloom_check(uint64_t *bloom, ht_size_t blocks,
+                                        ht_hash_t hash)
+{
+  uint64_t *block, bits;
+  int i;
+
+  block = hashtable_bloom_block(bloom, blocks, hash);
+  bits  = (uint64_t) hash * 0x9e3779b97f4a7c15ULL;
+
+  for (i = 0; i < HASHTABLE_BLOOM_PROBES; i++)
+  {
+    bits >>= 9;
+
+    if ((block[(bits >> 6) & 7] & ((uint64_t) 1 << (bits & 63))) == 0)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int hashtable_bloom_rebuild(struct hashtable *ht)
+{
+  uint64_t *bloom;
+  ht_size_t blocks, slot;
+  size_t bits;
+  struct hashtableitem *j;
+
+  if (ht->table_settings.bloom_bits == 0)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  bits   = (size_t) ht->table_size * ht->table_settings.bloom_bits;
+  blocks = (bits + HASHTABLE_BLOOM_BLOCK_BITS - 1) / 
+           HASHTABLE_BLOOM_BLOCK_BITS;
+
+  if (blocks == 0)
+  {
+    blocks = 1;
+  }
+
+  bloom = hashtable_malloc(ht, HASHTABLE_MEMORY_BLOOM, 
+                           sizeof(uint64_t) * blocks * 
+                           HASHTABLE_BLOOM_BLOCK_WORDS);
+
+  if (bloom == NULL)
+  {
+    /* The old filter, if there is one, is still correct; just less useful */
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  memset(bloom, 0, sizeof(uint64_t) * blocks * HASHTABLE_BLOOM_BLOCK_WORDS);
+
+  for (slot = 0; slot < ht->table_size; slot++)
+  {
+    if (ht->table_cow != NULL && !hashtable_cow_copied(ht, slot))
+    {
+      j = (ht->table_snapshot->table)[slot];
+    }
+    else
+    {
+      j = (ht->table)[slot];
+    }
+
+    for (; j != NULL; j = j->next)
+    {
+      hashtable_bloom_add(bloom, blocks, j->key_hash);
+    }
+  }
+
+  if (ht->table_bloom != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_BLOOM, ht->table_bloom, 
+                   sizeof(uint64_t) * ht->table_bloom_blocks * 
+                   HASHTABLE_BLOOM_BLOCK_WORDS);
+  }
+
+  ht->table_bloom        = bloom;
+  ht->table_bloom_blocks = blocks;
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_clone(struct hashtable *dst, struct hashtable *src)
+{
+  struct hashtablesettings settings;
+  struct hashtableitem *head, *prev, *i, *j;
+  ht_size_t slot;
+  size_t bytes, key_bytes, padding;
+  char *pool;
+  int r;
+
+  if (src->table_settings.engine != HASHTABLE_ENGINE_CHAINED || 
+      src->table_seqlock != NULL || src->table_settings.multimap || 
+      dst == src)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  /* dst starts out the same size as src, and gets the same seed so that 
+   * the stored hashes can be kept */
+  settings = src->table_settings;
+  settings.size_initial = src->table_size_p;
+
+  r = hashtable_new_custom(dst, &settings);
+  if (r != HASHTABLE_SUCCESS)
+  {
+    return r;
+  }
+
+  dst->table_seed        = src->table_seed;
+  dst->table_reseed_wait = src->table_reseed_wait;
+
+  for (bytes = 0, slot = 0; slot < src->table_size; slot++)
+  {
+    for (j = hashtable_slot_items(src, slot); j != NULL; j = j->next)
+    {
+      bytes += hashtable_pool_bytes(j);
+    }
+  }
+
+  pool = NULL;
+
+  if (bytes != 0)
+  {
+    pool = hashtable_malloc(dst, HASHTABLE_MEMORY_ITEMS, bytes);
+
+    if (pool == NULL)
+    {
+      hashtable_delete(dst);
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+
+  dst->table_pool       = pool;
+  dst->table_pool_bytes = bytes;
+  key_bytes = 0;
+  padding   = 0;
+
+  /* Each chain is laid out in order, so walking it reads memory forwards */
+  for (slot = 0; slot < src->table_size; slot++)
+  {
+    head = NULL;
+    prev = NULL;
+
+    for (j = hashtable_slot_items(src, slot); j != NULL; j = j->next)
+    {
+      i = (struct hashtableitem *) pool;
+      pool += hashtable_pool_bytes(j);
+
+      *i = *j;
+
+      if (hashtable_item_owns_key(j))
+      {
+        memcpy(i + 1, j->key, j->keylen);
+        i->key = i + 1;
+      }
+
+      i->next = NULL;
+      i->prev = prev;
+
+      if (prev == NULL)
+      {
+        head = i;
+      }
+      else
+      {
+        prev->next = i;
+      }
+
+      prev = i;
+      key_bytes += hashtable_item_key_bytes(j);
+      padding   += hashtable_pool_bytes(j) - hashtable_item_bytes(j);
+    }
+
+    (dst->table)[slot] = head;
+
+    if (src->table_cow != NULL && !hashtable_cow_copied(src, slot))
+    {
+      (dst->table_tags)[slot] = (src->table_snapshot->table_tags)[slot];
+    }
+    else
+    {
+      (dst->table_tags)[slot] = (src->table_tags)[slot];
+    }
+  }
+
+  hashtable_account_move(dst, HASHTABLE_MEMORY_ITEMS, HASHTABLE_MEMORY_KEYS,
+                         key_bytes);
+  hashtable_account_move(dst, HASHTABLE_MEMORY_ITEMS, HASHTABLE_MEMORY_OTHER,
+                         padding);
+
+  dst->table_itemcount = src->table_itemcount;
+
+  /* The filters are the same size, since the tables are, unless one of 
+   * them couldn't be allocated */
+  if (dst->table_bloom != NULL && src->table_bloom != NULL &&
+      dst->table_bloom_blocks == src->table_bloom_blocks)
+  {
+    memcpy(dst->table_bloom, src->table_bloom, 
+           sizeof(uint64_t) * dst->table_bloom_blocks * 
+           HASHTABLE_BLOOM_BLOCK_WORDS);
+  }
+  else if (dst->table_bloom != NULL)
+  {
+    hashtable_bloom_rebuild(dst);
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_snapshot(struct hashtable *ht, struct hashtablesnapshot *snap)
+{
+  struct hashtableitem **table;
+  uint8_t *cow;
+
+  if (ht->table_settings.engine != HASHTABLE_ENGINE_CHAINED || 
+      ht->table_snapshot != NULL || ht->table_seqlock != NULL ||
+      ht->table_settings.multimap)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  table = hashtable_malloc(ht, HASHTABLE_MEMORY_TABLE,
+                           hashtable_table_bytes(ht->table_size));
+
+  if (table == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  cow = hashtable_malloc(ht, HASHTABLE_MEMORY_SNAPSHOT,
+                         hashtable_cow_bytes(ht->table_size));
+
+  if (cow == NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, table, 
+                   hashtable_table_bytes(ht->table_size));
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  memset(cow, 0, hashtable_cow_bytes(ht->table_size));
+
+  /* Slots not copied yet start out as the snapshot's chains, so that 
+   * walking ht->table still sees every item */
+  memcpy(table, ht->table, hashtable_table_bytes(ht->table_size));
+
+  /* The current table and items now belong to the snapshot, and are 
+   * counted against it as the table makes its own copies */
+  hashtable_account_move(ht, HASHTABLE_MEMORY_TABLE, HASHTABLE_MEMORY_SNAPSHOT,
+                         hashtable_table_bytes(ht->table_size));
+
+  snap->table           = ht->table;
+  snap->table_tags      = ht->table_tags;
+  snap->table_size_p    = ht->table_size_p;
+  snap->table_size      = ht->table_size;
+  snap->table_itemcount = ht->table_itemcount;
+  snap->table_mask      = ht->table_mask;
+  snap->table_seed      = ht->table_seed;
+  snap->owner           = ht;
+
+  ht->table          = table;
+  ht->table_tags     = (uint8_t *) (table + ht->table_size);
+  ht->table_snapshot = snap;
+  ht->table_cow      = cow;
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_snapshot_get(const struct hashtablesnapshot *snap, 
+                           const void *key, size_t keylen, void **data)
+{
+  ht_hash_t hash;
+  ht_size_t slot;
+  struct hashtableitem *j;
+
+  /* The owner may have been given a new seed since */
+  if (snap->owner->table_settings.hashfunction == lookup_hash)
+  {
+    hash = lookup_hash_seeded(key, keylen, snap->table_seed);
+  }
+  else
+  {
+    hash = (snap->owner->table_settings.hashfunction)(key, keylen);
+  }
+  slot = hash & snap->table_mask;
+
+  if (((snap->table_tags)[slot] & hashtable_tag(hash)) != 0)
+  {
+    for (j = (snap->table)[slot]; j != NULL; j = j->next)
+    {
+      if (j->key_hash == hash &&
+          j->keylen   == keylen &&
+          memcmp(j->key, key, keylen) == 0)
+      {
+        if (data != NULL)
+        {
+          *data = j->data;
+        }
+
+        return HASHTABLE_SUCCESS;
+      }
+    }
+  }
+
+  if (data != NULL)
+  {
+    *data = NULL;
+  }
+
+  return HASHTABLE_KEY_NOT_FOUND;
+}
+
+void hashtable_snapshot_release(struct hashtablesnapshot *snap)
+{
+  struct hashtable *ht;
+  ht_size_t slot;
+  struct hashtableitem *i, *j;
+
+  ht = snap->owner;
+
+  for (slot = 0; slot < snap->table_size; slot++)
+  {
+    if (ht->table_cow != NULL && !hashtable_cow_copied(ht, slot))
+    {
+      /* Still shared; hand the chain back to the table */
+      (ht->table)[slot]      = (snap->table)[slot];
+      (ht->table_tags)[slot] = (snap->table_tags)[slot];
+    }
+    else if (!ht->table_settings.arena)
+    {
+      for (j = (snap->table)[slot]; j != NULL; j = i)
+      {
+        i = j->next;
+
+        if (hashtable_item_pooled(ht, j))
+        {
+          hashtable_account_move(ht, HASHTABLE_MEMORY_SNAPSHOT, 
+                                 HASHTABLE_MEMORY_OTHER, 
+                                 hashtable_item_bytes(j));
+        }
+        else
+        {
+          hashtable_free(ht, HASHTABLE_MEMORY_SNAPSHOT, j, 
+                         hashtable_item_bytes(j));
+        }
+      }
+    }
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_SNAPSHOT, snap->table, 
+                 hashtable_table_bytes(snap->table_size));
+
+  if (ht->table_cow != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_SNAPSHOT, ht->table_cow, 
+                   hashtable_cow_bytes(ht->table_size));
+  }
+
+  /* Including any items that weren't walked above */
+  hashtable_account(ht, HASHTABLE_MEMORY_SNAPSHOT, 0, 
+                    ht->table_memory[HASHTABLE_MEMORY_SNAPSHOT]);
+
+  ht->table_snapshot = NULL;
+  ht->table_cow      = NULL;
+  snap->table        = NULL;
+  snap->table_tags   = NULL;
+}
+
+static inline int hashtable_cow_prepare(struct hashtable *ht, 
+                                        ht_hash_t hash)
+{
+  ht_size_t slot;
+
+  if (ht->table_cow == NULL)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  slot = hash & ht->table_mask;
+
+  if (hashtable_cow_copied(ht, slot))
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  return hashtable_cow_copy(ht, slot);
+}
+
+/* Gives the table its own copy of a slot's chain */
+static int hashtable_cow_copy(struct hashtable *ht, ht_size_t slot)
+{
+  struct hashtableitem *head, *prev, *i, *j;
+  size_t item_bytes, key_bytes;
+
+  head = NULL;
+  prev = NULL;
+  item_bytes = 0;
+  key_bytes  = 0;
+
+  for (j = (ht->table_snapshot->table)[slot]; j != NULL; j = j->next)
+  {
+    i = hashtable_item_alloc(ht, hashtable_item_key_bytes(j));
+
+    if (i == NULL)
+    {
+      for (j = head; j != NULL; j = i)
+      {
+        i = j->next;
+        hashtable_item_free(ht, j, hashtable_item_key_bytes(j));
+      }
+
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    *i = *j;
+
+    if (hashtable_item_owns_key(j))
+    {
+      memcpy(i + 1, j->key, j->keylen);
+      i->key = i + 1;
+    }
+
+    i->next = NULL;
+    i->prev = prev;
+
+    if (prev == NULL)
+    {
+      head = i;
+    }
+    else
+    {
+      prev->next = i;
+    }
+
+    prev = i;
+    item_bytes += sizeof(struct hashtableitem);
+    key_bytes  += hashtable_item_key_bytes(j);
+  }
+
+  (ht->table)[slot]      = head;
+  (ht->table_tags)[slot] = (ht->table_snapshot->table_tags)[slot];
+  ht->table_cow[slot >> 3] |= 1 << (slot & 7);
+
+  /* The originals are now only the snapshot's */
+  hashtable_account_move(ht, HASHTABLE_MEMORY_ITEMS, 
+                         HASHTABLE_MEMORY_SNAPSHOT, item_bytes);
+  hashtable_account_move(ht, HASHTABLE_MEMORY_KEYS, 
+                         HASHTABLE_MEMORY_SNAPSHOT, key_bytes);
+
+  /* Any index refers to the snapshot's items */
+  hashtable_index_drop(ht, slot);
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Copies every remaining slot, after which the table no longer shares 
+ * anything with the snapshot (and may be resized freely) */
+static int hashtable_cow_copy_all(struct hashtable *ht)
+{
+  ht_size_t slot;
+
+  for (slot = 0; slot < ht->table_size; slot++)
+  {
+    if (!hashtable_cow_copied(ht, slot) && 
+        hashtable_cow_copy(ht, slot) != HASHTABLE_SUCCESS)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_SNAPSHOT, ht->table_cow, 
+                 hashtable_cow_bytes(ht->table_size));
+  ht->table_cow = NULL;
+
+  return HASHTABLE_SUCCESS;
+}
+
+void hashtable_delete(struct hashtable *ht)
+{
+  ht_size_t slot;
+  struct hashtableitem *i, *j;
+
+  if (ht->table_snapshot != NULL)
+  {
+    hashtable_snapshot_release(ht->table_snapshot);
+  }
+
+  hashtable_index_drop_all(ht);
+  hashtable_checkpoint_stop(ht);
+  hashtable_latency_stop(ht);
+
+  if (ht->table_settings.multimap && !ht->table_settings.arena)
+  {
+    hashtable_walk(ht, hashtable_group_free_item, ht);
+  }
+
+  switch (ht->table_settings.engine)
+  {
+    case HASHTABLE_ENGINE_CUCKOO:
+      hashtable_cuckoo_delete(ht);
+      break;
+    case HASHTABLE_ENGINE_ROBINHOOD:
+      hashtable_robinhood_delete(ht);
+      break;
+  }
+
+  /* Nothing to walk if the allocator doesn't free individual blocks */
+  if (ht->table != NULL && !ht->table_settings.arena)
+  {
+    for (slot = 0; slot < ht->table_size; slot++)
+    {
+      j = (ht->table)[slot];
+
+      while (j != NULL)
+      {
+        i = j->next;
+        hashtable_item_free(ht, j, hashtable_item_key_bytes(j));
+        j = i;
+      }
+    }
+  }
+
+  if (ht->table_pool != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_OTHER, ht->table_pool, 
+                   ht->table_pool_bytes);
+    ht->table_pool       = NULL;
+    ht->table_pool_bytes = 0;
+  }
+
+  if (ht->table != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, ht->table, 
+                   hashtable_table_bytes(ht->table_size));
+    ht->table = NULL;
+    ht->table_tags = NULL;
+  }
+
+  if (ht->table_bloom != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_BLOOM, ht->table_bloom, 
+                   sizeof(uint64_t) * ht->table_bloom_blocks * 
+                   HASHTABLE_BLOOM_BLOCK_WORDS);
+    ht->table_bloom = NULL;
+    ht->table_bloom_blocks = 0;
+  }
+
+  if (ht->table_seqlock != NULL)
+  {
+    hashtable_seqlock_reclaim(ht);
+    hashtable_free(ht, HASHTABLE_MEMORY_OTHER, ht->table_seqlock, 
+                   sizeof(struct hashtableseqlock));
+    ht->table_seqlock = NULL;
+  }
+
+  ht->table_size_p    = 0;
+  ht->table_size      = 0;
+  ht->table_itemcount = 0;
+  ht->table_mask      = 0;
+
+  /* Blocks left for the allocator to release (arena) are not counted any
+   * more either */
+  ht->table_memory_total = 0;
+  memset(ht->table_memory, 0, sizeof(ht->table_memory));
+}
+
+int hashtable_memory_usage(const struct hashtable *ht, 
+                           struct hashtablememory *usage)
+{
+  memcpy(usage->bytes, ht->table_memory, sizeof(usage->bytes));
+  usage->total = ht->table_memory_total;
+
+  return HASHTABLE_SUCCESS;
+}
+
+static inline void hashtable_seq_begin(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void hashtable_seq_end(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* hashtable_chain_find for readers in seqlock mode. Everything the writer
+ * might be changing is read atomically, and the search is repeated until
+ * it runs without the writer touching the slot (or resizing) meanwhile. 
+ * data is read inside the loop too, so that it matches the item found. */
+static struct hashtableitem *hashtable_seqlock_find(struct hashtable *ht,
+                                                    const void *key, 
+                                                    size_t keylen,
+                                                    ht_hash_t hash,
+                                                    void **data)
+{
+  struct hashtableseqlock *seqlock;
+  struct hashtableitem **table, *j;
+  uint8_t *tags;
+  uint32_t resize, stripe, *seq;
+  ht_hash_t mask;
+  ht_size_t slot;
+
+  seqlock = ht->table_seqlock;
+
+  for (;;)
+  {
+    resize = __atomic_load_n(&seqlock->resize, __ATOMIC_ACQUIRE);
+
+    if (resize & 1)
+    {
+      continue;
+    }
+
+    table = __atomic_load_n(&ht->table, __ATOMIC_RELAXED);
+    tags  = __atomic_load_n(&ht->table_tags, __ATOMIC_RELAXED);
+    mask  = __atomic_load_n(&ht->table_mask, __ATOMIC_RELAXED);
+
+    /* table, tags and mask must belong together before they are used */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&seqlock->resize, __ATOMIC_RELAXED) != resize)
+    {
+      continue;
+    }
+
+    slot   = hash & mask;
+    seq    = hashtable_seqlock_stripe(ht, slot);
+    stripe = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+    if (stripe & 1)
+    {
+      continue;
+    }
+
+    j = NULL;
+
+    if ((__atomic_load_n(&tags[slot], __ATOMIC_RELAXED) & 
+         hashtable_tag(hash)) != 0)
+    {
+      j = __atomic_load_n(&table[slot], __ATOMIC_ACQUIRE);
+
+      while (j != NULL)
+      {
+        if (__atomic_load_n(&j->key_hash, __ATOMIC_RELAXED) == hash &&
+            __atomic_load_n(&j->keylen, __ATOMIC_RELAXED) == keylen &&
+            memcmp(__atomic_load_n(&j->key, __ATOMIC_RELAXED), 
+                   key, keylen) == 0)
+        {
+          *data = __atomic_load_n(&j->data, __ATOMIC_RELAXED);
+          break;
+        }
+
+        j = __atomic_load_n(&j->next, __ATOMIC_ACQUIRE);
+      }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == stripe &&
+        __atomic_load_n(&seqlock->resize, __ATOMIC_RELAXED) == resize)
+    {
+      return j;
+    }
+  }
+}
+
+/* Makes sure that n more blocks can be retired without allocating */
+static int hashtable_retire_reserve(struct hashtable *ht, size_t n)
+{
+  struct hashtableseqlock *seqlock;
+  struct hashtableretired *retired;
+  size_t size;
+
+  seqlock = ht->table_seqlock;
+
+  if (seqlock->retired_count + n <= seqlock->retired_size)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  size = seqlock->retired_size * 2;
+
+  if (size < seqlock->retired_count + n)
+  {
+    size = seqlock->retired_count + n + 16;
+  }
+
+  retired = hashtable_realloc(ht, HASHTABLE_MEMORY_OTHER, seqlock->retired, 
+                              seqlock->retired_size * sizeof(*retired), 
+                              size * sizeof(*retired));
+
+  if (retired == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  seqlock->retired      = retired;
+  seqlock->retired_size = size;
+
+  return HASHTABLE_SUCCESS;
+}
+
+static inline void hashtable_retire(struct hashtable *ht, int category,
+                                    void *ptr, size_t size)
+{
+  struct hashtableseqlock *seqlock;
+
+  hashtable_account_move(ht, category, HASHTABLE_MEMORY_OTHER, size);
+
+  seqlock = ht->table_seqlock;
+  seqlock->retired[seqlock->retired_count].ptr  = ptr;
+  seqlock->retired[seqlock->retired_count].size = size;
+  seqlock->retired_count++;
+}
+
+void hashtable_seqlock_reclaim(struct hashtable *ht)
+{
+  struct hashtableseqlock *seqlock;
+  size_t i;
+
+  seqlock = ht->table_seqlock;
+
+  if (seqlock == NULL)
+  {
+    return;
+  }
+
+  for (i = 0; i < seqlock->retired_count; i++)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_OTHER, seqlock->retired[i].ptr, 
+                   seqlock->retired[i].size);
+  }
+
+  if (seqlock->retired != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_OTHER, seqlock->retired, 
+                   seqlock->retired_size * sizeof(struct hashtableretired));
+  }
+
+  seqlock->retired       = NULL;
+  seqlock->retired_count = 0;
+  seqlock->retired_size  = 0;
+}
+
+static inline int hashtable_resize(struct hashtable *ht, 
+                                   ht_size_p_t new_size_p)
+{
+  int r;
+
+  switch (ht->table_settings.engine)
+  {
+    case HASHTABLE_ENGINE_CUCKOO:
+      return hashtable_probe_resize(ht, new_size_p, 
+                                    hashtable_cuckoo_resize);
+    case HASHTABLE_ENGINE_ROBINHOOD:
+      return hashtable_probe_resize(ht, new_size_p, 
+                                    hashtable_robinhood_resize);
+  }
+
+  if (ht->table_seqlock == NULL)
+  {
+    return hashtable_probe_resize(ht, new_size_p, hashtable_chain_resize);
+  }
+
+  /* The old slot array has to survive for readers still using it */
+  if (hashtable_retire_reserve(ht, 1) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  hashtable_seq_begin(&ht->table_seqlock->resize);
+  r = hashtable_probe_resize(ht, new_size_p, hashtable_chain_resize);
+  hashtable_seq_end(&ht->table_seqlock->resize);
+
+  return r;
+}
+
+static inline int hashtable_chain_resize(struct hashtable *ht, 
+                                         ht_size_p_t new_size_p)
+{
+  struct hashtable temp;
+  struct hashtableitem *i, *j;
+  ht_size_t slot, old_size;
+
+  /* Every slot is about to be modified */
+  if (ht->table_cow != NULL && 
+      hashtable_cow_copy_all(ht) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  temp.table_size_p = new_size_p;
+  temp.table_size = 1 << temp.table_size_p;
+  temp.table_mask = temp.table_size - 1;
+
+  if (ht->table_seqlock != NULL)
+  {
+    temp.table = hashtable_malloc(ht, HASHTABLE_MEMORY_TABLE,
+                                  hashtable_table_bytes(temp.table_size));
+
+    if (temp.table == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    if (ht->table != NULL)
+    {
+      memcpy(temp.table, ht->table, 
+             ht->table_size * sizeof(struct hashtableitem *));
+      hashtable_retire(ht, HASHTABLE_MEMORY_TABLE, ht->table, 
+                       hashtable_table_bytes(ht->table_size));
+    }
+  }
+  else
+  {
+    /* if realloc fails, it leaves the original memory area untouched */
+    temp.table = hashtable_realloc(ht, HASHTABLE_MEMORY_TABLE, ht->table,
+                                   hashtable_table_bytes(ht->table_size),
+                                   hashtable_table_bytes(temp.table_size));
+  }
+
+  if (temp.table == NULL)
+  {
+    /* therefore, we can still bail and keep the original table intact */
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  /* zero the new, uninitialised, area of memory */
+  memset(temp.table + ht->table_size, 0, 
+         (temp.table_size - ht->table_size) * sizeof(struct hashtableitem *));
+
+  /* The tags are rebuilt below, as items are redistributed */
+  temp.table_tags = (uint8_t *) (temp.table + temp.table_size);
+  memset(temp.table_tags, 0, temp.table_size * sizeof(uint8_t));
+
+  hashtable_index_drop_all(ht);
+
+  /* now update ht */
+  old_size         = ht->table_size;
+  ht->table        = temp.table;
+  ht->table_tags   = temp.table_tags;
+  ht->table_size_p = temp.table_size_p;
+  ht->table_size   = temp.table_size;
+  ht->table_mask   = temp.table_mask;
+
+  if (old_size != 0)
+  {
+    for (slot = 0; slot < old_size; slot++)
+    {
+      j = (ht->table)[slot];
+
+      while (j != NULL)
+      {
         if ((j->key_hash & ht->table_mask) != slot)
         {
           /* Save this before it's nulled. */
@@ -356,46 +3027,289 @@ static inline int hashtable_resize(struct hashtable *ht,
         }
         else
         {
+          (ht->table_tags)[slot] |= hashtable_tag(j->key_hash);
           j = j->next;
         }
       }
     }
   }
 
+  /* Resize the filter with the table, which also forgets deleted items.
+   * If it fails then the old filter is kept, which is still correct. */
+  hashtable_bloom_rebuild(ht);
+  hashtable_checkpoint_resize(ht, old_size);
+
   return HASHTABLE_SUCCESS;
 }
 
-static inline void hashtable_insert(struct hashtable *ht,
-                                    struct hashtableitem *item)
+/* Each old slot's chain lands whole in a single new slot, so chains are 
+ * spliced rather than rehashed item by item */
+static int hashtable_chain_shrink(struct hashtable *ht, 
+                                  ht_size_p_t new_size_p)
 {
-  ht_size_t slot;
+  struct hashtableitem **table, **old_table;
+  struct hashtableitem *head, *tail;
+  ht_size_t slot, new_slot, old_size, new_size;
+  uint8_t tag;
+
+  if (ht->table_cow != NULL && 
+      hashtable_cow_copy_all(ht) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  new_size = 1 << new_size_p;
+  table = hashtable_malloc(ht, HASHTABLE_MEMORY_TABLE,
+                           hashtable_table_bytes(new_size));
+
+  if (table == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  memset(table, 0, hashtable_table_bytes(new_size));
+  hashtable_index_drop_all(ht);
+
+  old_table        = ht->table;
+  old_size         = ht->table_size;
+  ht->table        = table;
+  ht->table_tags   = (uint8_t *) (table + new_size);
+  ht->table_size_p = new_size_p;
+  ht->table_size   = new_size;
+  ht->table_mask   = new_size - 1;
+
+  for (slot = 0; slot < old_size; slot++)
+  {
+    head = old_table[slot];
+
+    if (head == NULL)
+    {
+      continue;
+    }
+
+    tag = 0;
+
+    for (tail = head; ; tail = tail->next)
+    {
+      tag |= hashtable_tag(tail->key_hash);
+
+      if (tail->next == NULL)
+      {
+        break;
+      }
+    }
+
+    /* In front of whatever earlier slots put there */
+    new_slot = slot & ht->table_mask;
+    tail->next = (ht->table)[new_slot];
+
+    if (tail->next != NULL)
+    {
+      tail->next->prev = tail;
+    }
+
+    (ht->table)[new_slot] = head;
+    (ht->table_tags)[new_slot] |= tag;
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_TABLE, old_table, 
+                 hashtable_table_bytes(old_size));
+
+  hashtable_bloom_rebuild(ht);
+  hashtable_checkpoint_resize(ht, old_size);
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Returns the length of the chain that the item was added to */
+static inline ht_size_t hashtable_insert(struct hashtable *ht,
+                                         struct hashtableitem *item)
+{
+  ht_size_t slot, chain;
   struct hashtableitem *j;
 
   /* This item will become the last in the chain */
   item->next = NULL;
 
   slot = (item->key_hash & ht->table_mask);
+  (ht->table_tags)[slot] |= hashtable_tag(item->key_hash);
 
   /* If there are no items in the slot, then pop it in there. Otherwise,
    * add it to the end of the chain of items */
 
   j = (ht->table)[slot];
 
+  /* The item is published last, for the benefit of seqlock readers */
   if (j == NULL)
   {
-    (ht->table)[slot] = item;
     item->prev = NULL;
+    __atomic_store_n(&((ht->table)[slot]), item, __ATOMIC_RELEASE);
+
+    return 1;
   }
-  else
+
+  for (chain = 2; j->next != NULL; chain++)
+  {
+    j = j->next;
+  }
+
+  item->prev = j;
+  __atomic_store_n(&j->next, item, __ATOMIC_RELEASE);
+
+  return chain;
+}
+
+/* Items and the keys they own are counted separately */
+static inline struct hashtableitem *hashtable_item_alloc(struct hashtable *ht,
+                                                        size_t key_bytes)
+{
+  struct hashtableitem *item;
+
+  item = hashtable_malloc(ht, HASHTABLE_MEMORY_ITEMS, 
+                          sizeof(struct hashtableitem) + key_bytes);
+
+  if (item != NULL)
+  {
+    hashtable_account_move(ht, HASHTABLE_MEMORY_ITEMS, HASHTABLE_MEMORY_KEYS,
+                           key_bytes);
+  }
+
+  return item;
+}
+
+static inline void hashtable_item_free(struct hashtable *ht, 
+                                       struct hashtableitem *item,
+                                       size_t key_bytes)
+{
+  if (hashtable_item_pooled(ht, item))
+  {
+    hashtable_account_move(ht, HASHTABLE_MEMORY_ITEMS, HASHTABLE_MEMORY_OTHER,
+                           sizeof(struct hashtableitem));
+    hashtable_account_move(ht, HASHTABLE_MEMORY_KEYS, HASHTABLE_MEMORY_OTHER,
+                           key_bytes);
+    return;
+  }
+
+  hashtable_account_move(ht, HASHTABLE_MEMORY_KEYS, HASHTABLE_MEMORY_ITEMS,
+                         key_bytes);
+  hashtable_free(ht, HASHTABLE_MEMORY_ITEMS, item, 
+                 sizeof(struct hashtableitem) + key_bytes);
+}
+
+static inline ht_hash_t hashtable_hash(struct hashtable *ht, 
+                                       const void *key, size_t keylen)
+{
+  if (ht->table_settings.hashfunction == lookup_hash)
+  {
+    return lookup_hash_seeded(key, keylen, ht->table_seed);
+  }
+
+  return (ht->table_settings.hashfunction)(key, keylen);
+}
+
+/* salt only tells apart callers that get no random bytes at the same 
+ * moment; its address is all that is used */
+uint32_t hashtable_random_seed(const void *salt)
+{
+  uint32_t seed;
+  struct timespec t;
+
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+  {
+    return seed;
+  }
+
+  /* Early in boot, perhaps; this is better than nothing */
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return lookup_hash_seeded(&t, sizeof(t), (uint32_t) (uintptr_t) salt);
+}
+
+/* Called after an insert into a chain of the given length */
+static inline void hashtable_flood_check(struct hashtable *ht, 
+                                         ht_size_t chain)
+{
+  if (ht->table_reseed_wait != 0)
   {
-    while (j->next != NULL)
+    ht->table_reseed_wait--;
+    return;
+  }
+
+  if (chain > HASHTABLE_FLOOD_CHAIN + 
+              2 * (ht->table_itemcount >> ht->table_size_p) &&
+      ht->table_settings.hash_seed == 0 &&
+      ht->table_settings.hashfunction == lookup_hash)
+  {
+    /* If it fails, the table is still intact, just slow */
+    hashtable_reseed(ht);
+    ht->table_reseed_wait = ht->table_size;
+  }
+}
+
+/* Picks a new seed and rehashes every item into place. Nothing is 
+ * allocated (except to stop sharing items with a snapshot), so that the 
+ * table can't be left half rehashed. */
+static int hashtable_reseed(struct hashtable *ht)
+{
+  struct hashtableitem *list, *i, *j;
+  ht_size_t slot;
+
+  if (ht->table_cow != NULL && 
+      hashtable_cow_copy_all(ht) != HASHTABLE_SUCCESS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  if (ht->table_seqlock != NULL)
+  {
+    hashtable_seq_begin(&ht->table_seqlock->resize);
+  }
+
+  ht->table_seed = hashtable_random_seed(ht);
+  hashtable_index_drop_all(ht);
+  hashtable_checkpoint_mark_all(ht);
+
+  /* Gather all the items into one list, and then put them back */
+  list = NULL;
+
+  for (slot = 0; slot < ht->table_size; slot++)
+  {
+    for (j = (ht->table)[slot]; j != NULL; j = i)
     {
-      j = j->next;
+      i = j->next;
+      j->key_hash = hashtable_hash(ht, j->key, j->keylen);
+      j->next = list;
+      list = j;
     }
+  }
+
+  memset(ht->table, 0, ht->table_size * sizeof(struct hashtableitem *));
+  memset(ht->table_tags, 0, ht->table_size * sizeof(uint8_t));
+
+  for (j = list; j != NULL; j = i)
+  {
+    i = j->next;
+    hashtable_insert(ht, j);
+  }
+
+  if (ht->table_bloom != NULL && 
+      hashtable_bloom_rebuild(ht) != HASHTABLE_SUCCESS)
+  {
+    /* The old filter is no longer correct; do without until the next 
+     * resize */
+    hashtable_free(ht, HASHTABLE_MEMORY_BLOOM, ht->table_bloom, 
+                   sizeof(uint64_t) * ht->table_bloom_blocks * 
+                   HASHTABLE_BLOOM_BLOCK_WORDS);
+    ht->table_bloom        = NULL;
+    ht->table_bloom_blocks = 0;
+  }
 
-    j->next = item;
-    item->prev = j;
+  if (ht->table_seqlock != NULL)
+  {
+    hashtable_seq_end(&ht->table_seqlock->resize);
   }
+
+  return HASHTABLE_SUCCESS;
 }
 
 const char *hashtable_strerror(int hterror)
@@ -408,6 +3322,7 @@ const char *hashtable_strerror(int hterror)
     case HASHTABLE_KEY_NOT_FOUND:              return "Key not found";
     case HASHTABLE_INVALID_ARG:                return "Invalid argument";
     case HASHTABLE_DUPLICATE:                  return "Duplicate key";
+    case HASHTABLE_IO_ERROR:                   return "Input/output error";
     default:                                   return "Success";
   }
 }
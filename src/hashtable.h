@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 typedef uint32_t  ht_size_t;
 typedef uint8_t   ht_size_p_t;
@@ -29,6 +30,18 @@ typedef ht_size_t ht_hash_t;
 #define ht_size_lim_p  31
 
 typedef ht_hash_t (*hash_function)(const void *key, size_t length);
+typedef void *(*malloc_function)(void *context, size_t size);
+typedef void *(*realloc_function)(void *context, void *ptr, 
+                                  size_t old_size, size_t new_size);
+typedef void (*free_function)(void *context, void *ptr, size_t size);
+typedef int (*construct_function)(void *context, const void *key, 
+                                  size_t keylen, void **data);
+
+struct hashtableitem;
+typedef int (*merge_function)(void *context, struct hashtableitem *dst_item,
+                              struct hashtableitem *src_item);
+typedef int (*predicate_function)(void *context, 
+                                  const struct hashtableitem *item);
 
 struct hashtablesettings
 {
@@ -37,6 +50,19 @@ struct hashtablesettings
   ht_size_p_t size_extend;
   ht_size_p_t size_extend_trigger;
   hash_function hashfunction;
+  malloc_function mallocfunction;
+  realloc_function reallocfunction;
+  free_function freefunction;
+  void *alloc_context;
+  uint8_t bloom_bits;
+  uint8_t engine;
+  uint8_t seqlock;
+  uint32_t hash_seed;
+  uint8_t multimap;
+  size_t max_bytes;
+  uint8_t checkpoint;
+  uint32_t latency_sample;
+  uint8_t arena;
 };
 
 struct hashtableitem
@@ -49,18 +75,112 @@ struct hashtableitem
   struct hashtableitem *prev;
 };
 
+/* The open addressing engines store items directly in an array of slots.
+ * A slot has the same initial members as a hashtableitem, and pointers to 
+ * slots are handed out as struct hashtableitem *; just don't touch the
+ * next and prev members of those. */
+struct hashtableslot
+{
+  const void *key;
+  size_t keylen;
+  ht_hash_t key_hash;
+  void *data;
+};
+
+/* One input to hashtable_aggregate */
+struct hashtablerecord
+{
+  const void *key;
+  size_t keylen;
+  intptr_t value;
+};
+
+#define HASHTABLE_MEMORY_TABLE       0
+#define HASHTABLE_MEMORY_ITEMS       1
+#define HASHTABLE_MEMORY_KEYS        2
+#define HASHTABLE_MEMORY_VALUES      3
+#define HASHTABLE_MEMORY_BLOOM       4
+#define HASHTABLE_MEMORY_INDEX       5
+#define HASHTABLE_MEMORY_SNAPSHOT    6
+#define HASHTABLE_MEMORY_OTHER       7
+#define HASHTABLE_MEMORY_CATEGORIES  8
+
+/* Filled in by hashtable_memory_usage */
+struct hashtablememory
+{
+  size_t bytes[HASHTABLE_MEMORY_CATEGORIES];
+  size_t total;
+};
+
+#define HASHTABLE_LATENCY_GET      0
+#define HASHTABLE_LATENCY_SET      1
+#define HASHTABLE_LATENCY_UNSET    2
+#define HASHTABLE_LATENCY_RESIZE   3
+#define HASHTABLE_LATENCY_OPS      4
+#define HASHTABLE_LATENCY_BUCKETS  496
+
+/* Filled in by hashtable_latency_snapshot. counts are in ticks, bucketed
+ * as described in docs/usage; see hashtable_latency_bucket_ticks. */
+struct hashtablelatency
+{
+  uint64_t counts[HASHTABLE_LATENCY_OPS][HASHTABLE_LATENCY_BUCKETS];
+  uint64_t samples[HASHTABLE_LATENCY_OPS];
+  double ticks_per_ns;
+};
+
+struct hashtablesnapshot;
+struct hashtableseqlock;
+struct hashtablechainindex;
+struct hashtablecheckpoint;
+struct hashtablelatencylog;
+
 struct hashtable
 {
   struct hashtableitem **table;
+  struct hashtableslot *slots;
+  uint8_t *table_tags;
+  uint64_t *table_bloom;
+  ht_size_t table_bloom_blocks;
   ht_size_p_t table_size_p;
   ht_size_t table_size;
   ht_size_t table_itemcount;
   ht_hash_t table_mask;
   struct hashtablesettings table_settings;
+  struct hashtablesnapshot *table_snapshot;
+  uint8_t *table_cow;
+  struct hashtableseqlock *table_seqlock;
+  struct hashtablechainindex **table_index;
+  uint32_t table_seed;
+  ht_size_t table_reseed_wait;
+  size_t table_memory[HASHTABLE_MEMORY_CATEGORIES];
+  size_t table_memory_total;
+  void *table_pool;
+  size_t table_pool_bytes;
+  struct hashtablecheckpoint *table_checkpoint;
+  struct hashtablelatencylog *table_latency;
+};
+
+/* A read only view of a chained table as it was when the snapshot was 
+ * taken. table, table_size etc. may be walked just like a hashtable's. */
+struct hashtablesnapshot
+{
+  struct hashtableitem **table;
+  uint8_t *table_tags;
+  ht_size_p_t table_size_p;
+  ht_size_t table_size;
+  ht_size_t table_itemcount;
+  ht_hash_t table_mask;
+  uint32_t table_seed;
+  struct hashtable *owner;
 };
 
 extern const struct hashtablesettings hashtable_defaults;
 
+void *hashtable_std_malloc(void *context, size_t size);
+void *hashtable_std_realloc(void *context, void *ptr, 
+                            size_t old_size, size_t new_size);
+void hashtable_std_free(void *context, void *ptr, size_t size);
+
 int hashtable_new_custom(struct hashtable *ht, 
                          const struct hashtablesettings *s);
 int hashtable_new(struct hashtable *ht);
@@ -70,34 +190,110 @@ int hashtable_get(struct hashtable *ht, const void *key, size_t keylen,
                   void **data);
 int hashtable_set(struct hashtable *ht, const void *key, size_t keylen, 
                   void *data);
+int hashtable_getv(struct hashtable *ht, const struct iovec *iov, 
+                   int iovcnt, void **data);
+int hashtable_setv(struct hashtable *ht, const struct iovec *iov, 
+                   int iovcnt, void *data);
 int hashtable_update(struct hashtable *ht, const void *key, size_t keylen, 
                      void *data);
+int hashtable_get_or_insert(struct hashtable *ht, const void *key, 
+                            size_t keylen, struct hashtableitem **item,
+                            int *inserted);
+int hashtable_get_or_insert_with(struct hashtable *ht, const void *key,
+                                 size_t keylen, construct_function construct,
+                                 void *context, struct hashtableitem **item,
+                                 int *inserted);
+int hashtable_upsert(struct hashtable *ht, const void *key, size_t keylen,
+                     void *data);
+int hashtable_multi_add(struct hashtable *ht, const void *key, 
+                        size_t keylen, void *value);
+int hashtable_multi_get(struct hashtable *ht, const void *key, 
+                        size_t keylen, void *const **values, size_t *count);
+int hashtable_multi_remove(struct hashtable *ht, const void *key, 
+                           size_t keylen, void *value);
+int hashtable_aggregate(struct hashtable *ht, 
+                        const struct hashtablerecord *records, size_t n,
+                        int op);
+int hashtable_aggregate_merge(struct hashtable *dst, struct hashtable *src,
+                              int op);
+int hashtable_clone(struct hashtable *dst, struct hashtable *src);
+int hashtable_merge(struct hashtable *dst, struct hashtable *src,
+                    merge_function conflict, void *context);
+int hashtable_merge_prepare(struct hashtable *dst, struct hashtable *src);
+int hashtable_merge_range(struct hashtable *dst, struct hashtable *src,
+                          ht_size_t first, ht_size_t count,
+                          merge_function conflict, void *context);
+int hashtable_bloom_rebuild(struct hashtable *ht);
+int hashtable_snapshot(struct hashtable *ht, struct hashtablesnapshot *snap);
+int hashtable_snapshot_get(const struct hashtablesnapshot *snap, 
+                           const void *key, size_t keylen, void **data);
+void hashtable_snapshot_release(struct hashtablesnapshot *snap);
+void hashtable_seqlock_reclaim(struct hashtable *ht);
+int hashtable_memory_usage(const struct hashtable *ht, 
+                           struct hashtablememory *usage);
+int hashtable_checkpoint(struct hashtable *ht, int fd, int *compact);
+int hashtable_checkpoint_compact(struct hashtable *ht, int fd);
+int hashtable_checkpoint_load(struct hashtable *ht, int fd);
+int hashtable_checkpoint_touch(struct hashtable *ht, 
+                               struct hashtableitem *item);
+int hashtable_latency_snapshot(struct hashtable *ht, 
+                               struct hashtablelatency *latency);
+uint64_t hashtable_latency_bucket_ticks(int bucket);
+double hashtable_latency_percentile(const struct hashtablelatency *latency,
+                                    int op, double percentile);
 int hashtable_unset_item(struct hashtable *ht, struct hashtableitem *item);
 int hashtable_unset(struct hashtable *ht, const void *key, size_t keylen);
+int hashtable_remove_if(struct hashtable *ht, predicate_function predicate,
+                        void *context);
+int hashtable_remove_prepare(struct hashtable *ht);
+int hashtable_remove_range(struct hashtable *ht, ht_size_t first, 
+                           ht_size_t count, predicate_function predicate,
+                           void *context);
+int hashtable_shrink(struct hashtable *ht);
 void hashtable_delete(struct hashtable *ht);
 
+#define HASHTABLE_ENGINE_CHAINED    0
+#define HASHTABLE_ENGINE_CUCKOO     1
+#define HASHTABLE_ENGINE_ROBINHOOD  2
+
+#define HASHTABLE_AGGREGATE_SUM    0
+#define HASHTABLE_AGGREGATE_COUNT  1
+#define HASHTABLE_AGGREGATE_MIN    2
+#define HASHTABLE_AGGREGATE_MAX    3
+
 #define HASHTABLE_SUCCESS                    0
 #define HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY  1
 #define HASHTABLE_OUT_OF_MEMORY              2
 #define HASHTABLE_KEY_NOT_FOUND              3
 #define HASHTABLE_INVALID_ARG                4
 #define HASHTABLE_DUPLICATE                  5
+#define HASHTABLE_IO_ERROR                   6
 
-/* These functions are so simple that they should be macros. 
+/* This function is so simple that it should be a macro. 
  *
  *  int hashtable_get_item_data(struct hashtable *ht,
  *                              struct hashtableitem *item,
  *                              void **data);
  *
- *  int hashtable_update_item(struct hashtable *ht, struct hashtableitem *item, 
- *                            void **data);
- *
- * The ", HASHTABLE_SUCCESS" part makes them behave as if they were a 
+ * The ", HASHTABLE_SUCCESS" part makes it behave as if it were a 
  * function that returned SUCCESS. */
 #define hashtable_get_item_data(ht, item, d)   \
-  (*d = item->data, HASHTABLE_SUCCESS)
-#define hashtable_update_item(ht, item, d)     \
-  (item->data = d, HASHTABLE_SUCCESS)
+  (*(d) = (item)->data, HASHTABLE_SUCCESS)
+
+/* A checkpointing table has to be told about the change, so this one is 
+ * a function, to evaluate its arguments once */
+static inline int hashtable_update_item(struct hashtable *ht, 
+                                        struct hashtableitem *item, void *d)
+{
+  item->data = d;
+
+  if (ht->table_checkpoint == NULL)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  return hashtable_checkpoint_touch(ht, item);
+}
 
 const char *hashtable_strerror(int hterror);
 
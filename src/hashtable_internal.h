@@ -0,0 +1,159 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Helpers shared between hashtable.c and the other table engines. 
+ * Not part of the public interface. */
+
+#ifndef HASHTABLE_INTERNAL_HEADER
+#define HASHTABLE_INTERNAL_HEADER
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+#include "probes.h"
+
+/* While a snapshot is alive, slots that the table hasn't copied yet are 
+ * read from the snapshot's array (see hashtable.c) */
+#define hashtable_cow_copied(ht, slot) \
+  ((ht)->table_cow[(slot) >> 3] & (1 << ((slot) & 7)))
+#define hashtable_slot_items(ht, slot) \
+  ((ht)->table_cow != NULL && !hashtable_cow_copied(ht, slot) ? \
+   ((ht)->table_snapshot->table)[slot] : ((ht)->table)[slot])
+
+uint32_t hashtable_random_seed(const void *salt);
+void hashtable_settings_fill(struct hashtablesettings *s);
+
+static inline void hashtable_account(struct hashtable *ht, int category,
+                                     size_t allocated, size_t freed);
+static inline void hashtable_account_move(struct hashtable *ht, int from,
+                                          int to, size_t bytes);
+static inline void *hashtable_malloc(struct hashtable *ht, int category, 
+                                     size_t size);
+static inline void *hashtable_realloc(struct hashtable *ht, int category,
+                                      void *ptr, size_t old_size, 
+                                      size_t new_size);
+static inline void hashtable_free(struct hashtable *ht, int category,
+                                  void *ptr, size_t size);
+
+/* Every block is counted against one of the HASHTABLE_MEMORY_* categories.
+ * Moving a block from one category to another is an allocation in one 
+ * and a free in the other. */
+static inline void hashtable_account(struct hashtable *ht, int category,
+                                     size_t allocated, size_t freed)
+{
+  ht->table_memory[category] += allocated;
+  ht->table_memory[category] -= freed;
+  ht->table_memory_total     += allocated;
+  ht->table_memory_total     -= freed;
+}
+
+static inline void hashtable_account_move(struct hashtable *ht, int from,
+                                          int to, size_t bytes)
+{
+  ht->table_memory[from] -= bytes;
+  ht->table_memory[to]   += bytes;
+}
+
+static inline void *hashtable_malloc(struct hashtable *ht, int category, 
+                                     size_t size)
+{
+  void *r;
+
+  /* A block that would take the table over budget is refused just as 
+   * if the allocator had failed */
+  if (ht->table_settings.max_bytes != 0 && 
+      size > ht->table_settings.max_bytes - ht->table_memory_total)
+  {
+    hashtable_probe_budget(ht, category, size);
+    return NULL;
+  }
+
+  r = (ht->table_settings.mallocfunction)
+                      (ht->table_settings.alloc_context, size);
+
+  if (r != NULL)
+  {
+    hashtable_account(ht, category, size, 0);
+  }
+  else
+  {
+    hashtable_probe_alloc_fail(ht, category, size);
+  }
+
+  return r;
+}
+
+static inline void *hashtable_realloc(struct hashtable *ht, int category,
+                                      void *ptr, size_t old_size, 
+                                      size_t new_size)
+{
+  void *r;
+
+  if (ht->table_settings.reallocfunction != NULL)
+  {
+    if (ht->table_settings.max_bytes != 0 && new_size > old_size &&
+        new_size - old_size > 
+        ht->table_settings.max_bytes - ht->table_memory_total)
+    {
+      hashtable_probe_budget(ht, category, new_size);
+      return NULL;
+    }
+
+    r = (ht->table_settings.reallocfunction)
+                      (ht->table_settings.alloc_context, 
+                       ptr, old_size, new_size);
+
+    if (r != NULL)
+    {
+      hashtable_account(ht, category, new_size, old_size);
+    }
+    else
+    {
+      hashtable_probe_alloc_fail(ht, category, new_size);
+    }
+
+    return r;
+  }
+
+  /* Emulate realloc: on failure, the original is left untouched */
+  r = hashtable_malloc(ht, category, new_size);
+
+  if (r != NULL && ptr != NULL)
+  {
+    memcpy(r, ptr, old_size < new_size ? old_size : new_size);
+    hashtable_free(ht, category, ptr, old_size);
+  }
+
+  return r;
+}
+
+static inline void hashtable_free(struct hashtable *ht, int category,
+                                  void *ptr, size_t size)
+{
+  /* An arena releases everything at once, when its owner is done with it */
+  if (!ht->table_settings.arena)
+  {
+    (ht->table_settings.freefunction)
+                      (ht->table_settings.alloc_context, ptr, size);
+  }
+
+  hashtable_account(ht, category, 0, size);
+}
+
+#endif  /* HASHTABLE_INTERNAL_HEADER */
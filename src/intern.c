@@ -0,0 +1,445 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "intern.h"
+#include "lookup_hash.h"
+
+/* Strings are copied, NUL terminated, into large chunks, so that they 
+ * cost no allocation of their own and don't move once interned. 
+ * strings[id] says where each one is, which makes looking an ID up a 
+ * single array access.
+ *
+ * The index is an open addressed table of IDs (plus one, so that zero 
+ * means empty) and their hashes, probed linearly. It never holds more 
+ * than three quarters as many IDs as it has slots, and since the hashes 
+ * are kept in it, growing it does not hash any strings again. At 8 bytes
+ * per slot plus 16 per string in strings, a short string costs around 
+ * 30 bytes in all, rather than the 48 of a hashtableitem alone. */
+#define INTERN_CHUNK_MIN     4096
+#define INTERN_CHUNK_MAX     (1 << 22)
+#define INTERN_STRINGS_MIN   16
+#define INTERN_MAX_STRINGS   (UINT32_MAX - 1)
+
+struct internchunk
+{
+  struct internchunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct internslot
+{
+  uint32_t id;
+  ht_hash_t hash;
+};
+
+static inline void *internpool_malloc(struct internpool *pool, size_t size);
+static inline void *internpool_realloc(struct internpool *pool, void *ptr,
+                                       size_t old_size, size_t new_size);
+static inline void internpool_free(struct internpool *pool, void *ptr, 
+                                   size_t size);
+static inline ht_hash_t internpool_hash(struct internpool *pool, 
+                                        const void *string, size_t length);
+static inline ht_size_t internpool_probe(struct internpool *pool, 
+                                         const void *string, size_t length,
+                                         ht_hash_t hash);
+static const char *internpool_copy(struct internpool *pool, 
+                                   const void *string, size_t length);
+static int internpool_resize(struct internpool *pool, 
+                             ht_size_p_t new_size_p);
+
+int internpool_new_custom(struct internpool *pool, 
+                          const struct hashtablesettings *s)
+{
+  if (s->size_initial > ht_size_lim_p || s->size_maximum > ht_size_lim_p)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  pool->strings       = NULL;
+  pool->strings_count = 0;
+  pool->strings_size  = 0;
+  pool->index         = NULL;
+  pool->index_size_p  = 0;
+  pool->index_size    = 0;
+  pool->index_mask    = 0;
+  pool->chunks        = NULL;
+  pool->settings      = *s;
+  hashtable_settings_fill(&pool->settings);
+
+  if (s->hash_seed != 0)
+  {
+    pool->seed = s->hash_seed;
+  }
+  else
+  {
+    pool->seed = hashtable_random_seed(pool);
+  }
+
+  /* The index needs at least one slot free at all times */
+  return internpool_resize(pool, s->size_initial > 1 ? s->size_initial : 1);
+}
+
+/* The index holds the strings themselves rather than chains of them, so
+ * its size_maximum limits how many strings fit at all */
+int internpool_new(struct internpool *pool)
+{
+  struct hashtablesettings s;
+
+  s = hashtable_defaults;
+  s.size_maximum = ht_size_lim_p;
+
+  return internpool_new_custom(pool, &s);
+}
+
+int internpool_add(struct internpool *pool, const void *string, 
+                   size_t length, uint32_t *id)
+{
+  int i;
+  ht_hash_t hash;
+  ht_size_t slot;
+  const char *copy;
+  struct internstring *strings;
+  uint32_t size;
+
+  if (length > UINT32_MAX)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hash = internpool_hash(pool, string, length);
+  slot = internpool_probe(pool, string, length, hash);
+
+  if (pool->index[slot].id != 0)
+  {
+    *id = pool->index[slot].id - 1;
+    return HASHTABLE_SUCCESS;
+  }
+
+  if (pool->strings_count == INTERN_MAX_STRINGS)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  if (pool->strings_count == pool->strings_size)
+  {
+    size = pool->strings_size == 0 ? INTERN_STRINGS_MIN : 
+           pool->strings_size > INTERN_MAX_STRINGS / 2 ? INTERN_MAX_STRINGS :
+           pool->strings_size * 2;
+    strings = internpool_realloc(pool, pool->strings, 
+                       (size_t) pool->strings_size * sizeof(*strings),
+                       (size_t) size * sizeof(*strings));
+
+    if (strings == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    pool->strings      = strings;
+    pool->strings_size = size;
+  }
+
+  i = HASHTABLE_SUCCESS;
+
+  if (((uint64_t) pool->strings_count + 1) * 4 > 
+      (uint64_t) pool->index_size * 3)
+  {
+    if (pool->index_size_p < pool->settings.size_maximum &&
+        pool->index_size_p < ht_size_lim_p &&
+        internpool_resize(pool, pool->index_size_p + 1) == HASHTABLE_SUCCESS)
+    {
+      slot = internpool_probe(pool, string, length, hash);
+    }
+    else
+    {
+      i = HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    /* Past three quarters full probes get long, but it still works until
+     * the last slot */
+    if (i == HASHTABLE_OUT_OF_MEMORY && 
+        pool->strings_count + 1 >= pool->index_size)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+
+  copy = internpool_copy(pool, string, length);
+
+  if (copy == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  *id = pool->strings_count;
+  pool->strings[*id].string = copy;
+  pool->strings[*id].length = length;
+  pool->index[slot].id      = *id + 1;
+  pool->index[slot].hash    = hash;
+  (pool->strings_count)++;
+
+  if (i == HASHTABLE_OUT_OF_MEMORY)
+  {
+    return HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+int internpool_find(struct internpool *pool, const void *string, 
+                    size_t length, uint32_t *id)
+{
+  ht_size_t slot;
+
+  if (length > UINT32_MAX)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  slot = internpool_probe(pool, string, length, 
+                          internpool_hash(pool, string, length));
+
+  if (pool->index[slot].id == 0)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  *id = pool->index[slot].id - 1;
+  return HASHTABLE_SUCCESS;
+}
+
+int internpool_string(const struct internpool *pool, uint32_t id,
+                      const char **string, size_t *length)
+{
+  if (id >= pool->strings_count)
+  {
+    return HASHTABLE_KEY_NOT_FOUND;
+  }
+
+  if (string != NULL)
+  {
+    *string = pool->strings[id].string;
+  }
+
+  if (length != NULL)
+  {
+    *length = pool->strings[id].length;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+void internpool_delete(struct internpool *pool)
+{
+  struct internchunk *chunk, *next;
+
+  if (!pool->settings.arena)
+  {
+    for (chunk = pool->chunks; chunk != NULL; chunk = next)
+    {
+      next = chunk->next;
+      internpool_free(pool, chunk, sizeof(struct internchunk) + chunk->size);
+    }
+
+    if (pool->strings != NULL)
+    {
+      internpool_free(pool, pool->strings, 
+                      (size_t) pool->strings_size * sizeof(*pool->strings));
+    }
+
+    internpool_free(pool, pool->index, 
+                    (size_t) pool->index_size * sizeof(struct internslot));
+  }
+
+  pool->strings       = NULL;
+  pool->strings_count = 0;
+  pool->strings_size  = 0;
+  pool->index         = NULL;
+  pool->index_size    = 0;
+  pool->chunks        = NULL;
+}
+
+static inline void *internpool_malloc(struct internpool *pool, size_t size)
+{
+  return (pool->settings.mallocfunction)(pool->settings.alloc_context, size);
+}
+
+static inline void *internpool_realloc(struct internpool *pool, void *ptr,
+                                       size_t old_size, size_t new_size)
+{
+  void *r;
+
+  if (pool->settings.reallocfunction != NULL)
+  {
+    return (pool->settings.reallocfunction)
+                      (pool->settings.alloc_context, ptr, old_size, new_size);
+  }
+
+  r = internpool_malloc(pool, new_size);
+
+  if (r != NULL && ptr != NULL)
+  {
+    memcpy(r, ptr, old_size < new_size ? old_size : new_size);
+    internpool_free(pool, ptr, old_size);
+  }
+
+  return r;
+}
+
+static inline void internpool_free(struct internpool *pool, void *ptr, 
+                                   size_t size)
+{
+  if (!pool->settings.arena)
+  {
+    (pool->settings.freefunction)(pool->settings.alloc_context, ptr, size);
+  }
+}
+
+static inline ht_hash_t internpool_hash(struct internpool *pool, 
+                                        const void *string, size_t length)
+{
+  if (pool->settings.hashfunction == lookup_hash)
+  {
+    return lookup_hash_seeded(string, length, pool->seed);
+  }
+
+  return (pool->settings.hashfunction)(string, length);
+}
+
+/* Returns the slot holding string, or the empty slot where it belongs */
+static inline ht_size_t internpool_probe(struct internpool *pool, 
+                                         const void *string, size_t length,
+                                         ht_hash_t hash)
+{
+  struct internslot *slot;
+  struct internstring *s;
+  ht_size_t i;
+
+  for (i = hash & pool->index_mask; ; i = (i + 1) & pool->index_mask)
+  {
+    slot = &(pool->index[i]);
+
+    if (slot->id == 0)
+    {
+      return i;
+    }
+
+    if (slot->hash == hash)
+    {
+      s = &(pool->strings[slot->id - 1]);
+
+      if (s->length == length && memcmp(s->string, string, length) == 0)
+      {
+        return i;
+      }
+    }
+  }
+}
+
+static const char *internpool_copy(struct internpool *pool, 
+                                   const void *string, size_t length)
+{
+  struct internchunk *chunk;
+  size_t size;
+  char *copy;
+
+  chunk = pool->chunks;
+
+  if (chunk == NULL || chunk->size - chunk->used < length + 1)
+  {
+    /* Chunks double in size up to INTERN_CHUNK_MAX; whatever is left at 
+     * the end of the old one is wasted */
+    size = chunk == NULL ? INTERN_CHUNK_MIN : 
+           chunk->size >= INTERN_CHUNK_MAX ? INTERN_CHUNK_MAX : 
+           chunk->size * 2;
+
+    if (size < length + 1)
+    {
+      size = length + 1;
+    }
+
+    chunk = internpool_malloc(pool, sizeof(struct internchunk) + size);
+
+    if (chunk == NULL)
+    {
+      return NULL;
+    }
+
+    chunk->next  = pool->chunks;
+    chunk->size  = size;
+    chunk->used  = 0;
+    pool->chunks = chunk;
+  }
+
+  copy = chunk->data + chunk->used;
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  chunk->used += length + 1;
+
+  return copy;
+}
+
+static int internpool_resize(struct internpool *pool, 
+                             ht_size_p_t new_size_p)
+{
+  struct internslot *index;
+  ht_size_t i, j, new_size;
+  ht_hash_t new_mask;
+
+  new_size = 1 << new_size_p;
+  new_mask = new_size - 1;
+  index = internpool_malloc(pool, new_size * sizeof(struct internslot));
+
+  if (index == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  memset(index, 0, new_size * sizeof(struct internslot));
+
+  for (i = 0; i < pool->index_size; i++)
+  {
+    if (pool->index[i].id != 0)
+    {
+      for (j = pool->index[i].hash & new_mask; index[j].id != 0; 
+           j = (j + 1) & new_mask);
+
+      index[j] = pool->index[i];
+    }
+  }
+
+  if (pool->index != NULL)
+  {
+    internpool_free(pool, pool->index, 
+                    pool->index_size * sizeof(struct internslot));
+  }
+
+  pool->index        = index;
+  pool->index_size_p = new_size_p;
+  pool->index_size   = new_size;
+  pool->index_mask   = new_mask;
+
+  return HASHTABLE_SUCCESS;
+}
@@ -0,0 +1,63 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Pools of interned strings: each distinct string is copied into the pool
+ * once and given a small integer ID. */
+
+#ifndef INTERN_HEADER
+#define INTERN_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+struct internchunk;
+struct internslot;
+
+struct internstring
+{
+  const char *string;
+  uint32_t length;
+};
+
+struct internpool
+{
+  struct internstring *strings;
+  uint32_t strings_count;
+  uint32_t strings_size;
+  struct internslot *index;
+  ht_size_p_t index_size_p;
+  ht_size_t index_size;
+  ht_hash_t index_mask;
+  uint32_t seed;
+  struct internchunk *chunks;
+  struct hashtablesettings settings;
+};
+
+int internpool_new_custom(struct internpool *pool, 
+                          const struct hashtablesettings *s);
+int internpool_new(struct internpool *pool);
+int internpool_add(struct internpool *pool, const void *string, 
+                   size_t length, uint32_t *id);
+int internpool_find(struct internpool *pool, const void *string, 
+                    size_t length, uint32_t *id);
+int internpool_string(const struct internpool *pool, uint32_t id,
+                      const char **string, size_t *length);
+void internpool_delete(struct internpool *pool);
+
+#endif  /* INTERN_HEADER */
@@ -0,0 +1,171 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "latency.h"
+
+uint64_t hashtable_latency_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int hashtable_latency_start(struct hashtable *ht)
+{
+#ifdef HASHTABLE_LATENCY
+  struct hashtablelatencylog *log;
+
+  log = hashtable_malloc(ht, HASHTABLE_MEMORY_OTHER,
+                         sizeof(struct hashtablelatencylog));
+
+  if (log == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  memset(log->counts, 0, sizeof(log->counts));
+  log->sample      = ht->table_settings.latency_sample;
+  log->countdown   = log->sample;
+  log->start_ns    = hashtable_latency_ns();
+  log->start_ticks = hashtable_latency_ticks();
+
+  ht->table_latency = log;
+#endif
+
+  return HASHTABLE_SUCCESS;
+}
+
+void hashtable_latency_stop(struct hashtable *ht)
+{
+  if (ht->table_latency == NULL)
+  {
+    return;
+  }
+
+  hashtable_free(ht, HASHTABLE_MEMORY_OTHER, ht->table_latency,
+                 sizeof(struct hashtablelatencylog));
+  ht->table_latency = NULL;
+}
+
+int hashtable_latency_snapshot(struct hashtable *ht,
+                               struct hashtablelatency *latency)
+{
+  struct hashtablelatencylog *log;
+  uint64_t ticks, ns;
+  int op, bucket;
+
+  log = ht->table_latency;
+
+  if (log == NULL)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  for (op = 0; op < HASHTABLE_LATENCY_OPS; op++)
+  {
+    latency->samples[op] = 0;
+
+    for (bucket = 0; bucket < HASHTABLE_LATENCY_BUCKETS; bucket++)
+    {
+      latency->counts[op][bucket] =
+        __atomic_load_n(&log->counts[op][bucket], __ATOMIC_RELAXED);
+      latency->samples[op] += latency->counts[op][bucket];
+    }
+  }
+
+  /* The TSC's rate is found by comparing it with the clock over the
+   * table's whole life so far */
+#if defined(HASHTABLE_LATENCY) && HASHTABLE_LATENCY_TSC
+  ticks = hashtable_latency_ticks() - log->start_ticks;
+  ns    = hashtable_latency_ns() - log->start_ns;
+#else
+  ticks = ns = 1;
+#endif
+
+  latency->ticks_per_ns = ns == 0 ? 0 : (double) ticks / ns;
+
+  return HASHTABLE_SUCCESS;
+}
+
+uint64_t hashtable_latency_bucket_ticks(int bucket)
+{
+  int e;
+
+  if (bucket < HASHTABLE_LATENCY_SUB)
+  {
+    return bucket;
+  }
+
+  e = bucket / HASHTABLE_LATENCY_SUB + HASHTABLE_LATENCY_SUB_BITS - 1;
+
+  return (uint64_t) (HASHTABLE_LATENCY_SUB +
+                     bucket % HASHTABLE_LATENCY_SUB) <<
+         (e - HASHTABLE_LATENCY_SUB_BITS);
+}
+
+double hashtable_latency_percentile(const struct hashtablelatency *latency,
+                                    int op, double percentile)
+{
+  uint64_t rank, seen, low, high;
+  int bucket;
+
+  if (latency->samples[op] == 0)
+  {
+    return 0;
+  }
+
+  rank = (uint64_t) (percentile / 100 * latency->samples[op] + 0.5);
+
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+
+  seen = 0;
+
+  for (bucket = 0; bucket < HASHTABLE_LATENCY_BUCKETS - 1; bucket++)
+  {
+    seen += latency->counts[op][bucket];
+
+    if (seen >= rank)
+    {
+      break;
+    }
+  }
+
+  /* The middle of the bucket */
+  low  = hashtable_latency_bucket_ticks(bucket);
+  high = bucket == HASHTABLE_LATENCY_BUCKETS - 1 ? low :
+         hashtable_latency_bucket_ticks(bucket + 1) - 1;
+
+  if (latency->ticks_per_ns <= 0)
+  {
+    return low + (high - low) / 2;
+  }
+
+  return (low + (high - low) / 2) / latency->ticks_per_ns;
+}
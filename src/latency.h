@@ -0,0 +1,165 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sampled latency histograms. They are only compiled in with
+ * -DHASHTABLE_LATENCY (make LATENCY=1); otherwise these compile to
+ * nothing, and latency_sample is ignored. Not part of the public
+ * interface; see hashtable_latency_snapshot. */
+
+#ifndef LATENCY_HEADER
+#define LATENCY_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+/* Each power of two is split into 1 << HASHTABLE_LATENCY_SUB_BITS linear
+ * buckets, so a bucket is never more than 12.5% wide. Values below 8 get
+ * a bucket each. */
+#define HASHTABLE_LATENCY_SUB_BITS  3
+#define HASHTABLE_LATENCY_SUB       (1 << HASHTABLE_LATENCY_SUB_BITS)
+
+/* countdown is decremented by every get, set and unset; the one that takes
+ * it to zero is timed, and puts it back to sample. Concurrent seqlock
+ * readers may lose the odd decrement, which only shifts the sampling. */
+struct hashtablelatencylog
+{
+  uint32_t sample;
+  uint32_t countdown;
+  uint64_t start_ticks;
+  uint64_t start_ns;
+  uint64_t counts[HASHTABLE_LATENCY_OPS][HASHTABLE_LATENCY_BUCKETS];
+};
+
+uint64_t hashtable_latency_ns(void);
+int hashtable_latency_start(struct hashtable *ht);
+void hashtable_latency_stop(struct hashtable *ht);
+
+#ifdef HASHTABLE_LATENCY
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HASHTABLE_LATENCY_TSC  1
+#define hashtable_latency_ticks()  ((uint64_t) __rdtsc())
+#else
+#define HASHTABLE_LATENCY_TSC  0
+#define hashtable_latency_ticks()  hashtable_latency_ns()
+#endif
+
+static inline unsigned int hashtable_latency_bucket_of(uint64_t ticks);
+static inline void hashtable_latency_record(struct hashtable *ht, int op,
+                                            uint64_t start);
+static inline uint64_t hashtable_latency_begin(struct hashtable *ht);
+static inline int hashtable_latency_resize(struct hashtable *ht,
+                    ht_size_p_t new_size_p,
+                    int (*resize)(struct hashtable *ht, ht_size_p_t size_p));
+
+static inline unsigned int hashtable_latency_bucket_of(uint64_t ticks)
+{
+  unsigned int e;
+
+  if (ticks < HASHTABLE_LATENCY_SUB)
+  {
+    return ticks;
+  }
+
+  e = 63 - __builtin_clzll(ticks);
+
+  return (e - HASHTABLE_LATENCY_SUB_BITS + 1) * HASHTABLE_LATENCY_SUB +
+         ((ticks >> (e - HASHTABLE_LATENCY_SUB_BITS)) &
+          (HASHTABLE_LATENCY_SUB - 1));
+}
+
+static inline void hashtable_latency_record(struct hashtable *ht, int op,
+                                            uint64_t start)
+{
+  uint64_t *count;
+
+  count = &ht->table_latency->counts[op]
+              [hashtable_latency_bucket_of(hashtable_latency_ticks() -
+                                           start)];
+  __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+}
+
+/* Returns the time to pass to hashtable_latency_end, or 0 if this call
+ * isn't one of the sampled ones */
+static inline uint64_t hashtable_latency_begin(struct hashtable *ht)
+{
+  struct hashtablelatencylog *log;
+  uint32_t countdown;
+
+  log = ht->table_latency;
+
+  if (log == NULL)
+  {
+    return 0;
+  }
+
+  countdown = __atomic_load_n(&log->countdown, __ATOMIC_RELAXED);
+
+  if (countdown > 1)
+  {
+    __atomic_store_n(&log->countdown, countdown - 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  __atomic_store_n(&log->countdown, log->sample, __ATOMIC_RELAXED);
+  return hashtable_latency_ticks();
+}
+
+#define hashtable_latency_end(ht, op, start)                             \
+  do                                                                     \
+  {                                                                      \
+    if ((start) != 0)                                                    \
+    {                                                                    \
+      hashtable_latency_record(ht, op, start);                           \
+    }                                                                    \
+  }                                                                      \
+  while (0)
+
+/* Resizes are rare and slow, so every one is timed rather than 1 in
+ * latency_sample */
+static inline int hashtable_latency_resize(struct hashtable *ht,
+                    ht_size_p_t new_size_p,
+                    int (*resize)(struct hashtable *ht, ht_size_p_t size_p))
+{
+  uint64_t start;
+  int r;
+
+  if (ht->table_latency == NULL)
+  {
+    return resize(ht, new_size_p);
+  }
+
+  start = hashtable_latency_ticks();
+  r = resize(ht, new_size_p);
+  hashtable_latency_record(ht, HASHTABLE_LATENCY_RESIZE, start);
+
+  return r;
+}
+
+#else
+
+#define hashtable_latency_begin(ht)           ((uint64_t) 0)
+#define hashtable_latency_end(ht, op, start)  ((void) (start))
+#define hashtable_latency_resize(ht, new_size_p, resize) \
+  resize(ht, new_size_p)
+
+#endif  /* HASHTABLE_LATENCY */
+
+#endif  /* LATENCY_HEADER */
@@ -0,0 +1,564 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "lfhashtable.h"
+
+/* The table is an open addressed array of (key, value) slots, probed 
+ * linearly. A slot's key is only ever changed once, by a compare and swap
+ * from empty, so a key never moves within an array and two threads 
+ * inserting the same key always meet at the same slot. Values are then 
+ * changed with compare and swap too.
+ *
+ * Growing the table allocates a new array and links it to the old one 
+ * with next. Every thread that modifies the table while that link exists
+ * first helps copy a chunk of LF_MIGRATE_CHUNK slots across. Each slot 
+ * is closed as it is copied: an empty slot's key becomes LF_KEY_MOVED, 
+ * and a full slot's value becomes LF_VALUE_MOVED once it has been copied.
+ * The copy is retried if the value changes in between, so no update is 
+ * lost. Anyone who finds their key closed, or finds LF_KEY_MOVED where 
+ * their key would have been, carries on in the next array. Once every 
+ * chunk has been copied, table moves on to the next array.
+ *
+ * The new array holds back enough room (reserve) for everything in the 
+ * old one, so that copying never finds it full. Old arrays are not freed
+ * until lfhashtable_delete, since another thread may still be reading 
+ * them; as each array is at least twice the size of the one before, they
+ * add up to no more than the current one. */
+#define LF_KEY_EMPTY      0
+#define LF_KEY_MOVED      UINT64_MAX
+#define LF_VALUE_EMPTY    0
+#define LF_VALUE_MOVED    UINTPTR_MAX
+#define LF_MIGRATE_CHUNK  1024
+
+#define LF_INSERT  0
+#define LF_UPDATE  1
+#define LF_UPSERT  2
+#define LF_COPY    3
+
+/* Returned by lfhashtable_put_array alongside the HASHTABLE_* values */
+#define LF_NEXT   -1
+#define LF_FULL   -2
+
+#define lfhashtable_array_bytes(size) \
+  (sizeof(struct lfhashtablearray) + \
+   (size_t) (size) * sizeof(struct lfhashtableslot))
+
+struct lfhashtableslot
+{
+  uint64_t key;
+  uintptr_t value;
+};
+
+struct lfhashtablearray
+{
+  struct lfhashtablearray *next;
+  ht_size_p_t size_p;
+  ht_size_t size;
+  ht_hash_t mask;
+  ht_size_t used;
+  ht_size_t reserve;
+  ht_size_t migrate_next;
+  ht_size_t migrate_done;
+  struct lfhashtableslot slots[];
+};
+
+static inline ht_hash_t lfhashtable_hash(uint64_t key);
+static struct lfhashtablearray *lfhashtable_array_new(struct lfhashtable *lf,
+                                                      ht_size_p_t size_p,
+                                                      ht_size_t reserve);
+static int lfhashtable_put(struct lfhashtable *lf, uint64_t key, 
+                           void *value, int mode);
+static int lfhashtable_put_array(struct lfhashtable *lf, 
+                                 struct lfhashtablearray *a, uint64_t key,
+                                 ht_hash_t hash, uintptr_t value, int mode);
+static inline int lfhashtable_put_value(struct lfhashtableslot *s, 
+                                        uintptr_t value, int mode);
+static int lfhashtable_grow(struct lfhashtable *lf, 
+                            struct lfhashtablearray *a);
+static void lfhashtable_help(struct lfhashtable *lf, 
+                             struct lfhashtablearray *a);
+static void lfhashtable_migrate(struct lfhashtable *lf, 
+                                struct lfhashtablearray *a, 
+                                struct lfhashtableslot *s);
+static void lfhashtable_advance(struct lfhashtable *lf);
+
+int lfhashtable_new_custom(struct lfhashtable *lf, 
+                           const struct hashtablesettings *s)
+{
+  if (s->size_initial > ht_size_lim_p || s->size_maximum > ht_size_lim_p ||
+      s->size_extend == 0 || s->size_extend > ht_size_lim_p)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  lf->table_settings = *s;
+  hashtable_settings_fill(&lf->table_settings);
+  lf->table = lfhashtable_array_new(lf, s->size_initial, 0);
+  lf->table_first = lf->table;
+
+  if (lf->table == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Keys live in the array itself, so size_maximum limits how many fit */
+int lfhashtable_new(struct lfhashtable *lf)
+{
+  struct hashtablesettings s;
+
+  s = hashtable_defaults;
+  s.size_maximum = ht_size_lim_p;
+
+  return lfhashtable_new_custom(lf, &s);
+}
+
+int lfhashtable_get(struct lfhashtable *lf, uint64_t key, void **value)
+{
+  struct lfhashtablearray *a;
+  struct lfhashtableslot *s;
+  ht_hash_t hash;
+  ht_size_t h, probes;
+  uint64_t k;
+  uintptr_t v;
+
+  *value = NULL;
+  s = NULL;
+  k = LF_KEY_EMPTY;
+
+  if (key == LF_KEY_EMPTY || key == LF_KEY_MOVED)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hash = lfhashtable_hash(key);
+  a = __atomic_load_n(&lf->table, __ATOMIC_ACQUIRE);
+
+  while (a != NULL)
+  {
+    for (probes = 0, h = hash & a->mask; probes < a->size; 
+         probes++, h = (h + 1) & a->mask)
+    {
+      s = &(a->slots[h]);
+      k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+      if (k == LF_KEY_EMPTY)
+      {
+        return HASHTABLE_KEY_NOT_FOUND;
+      }
+
+      if (k == key || k == LF_KEY_MOVED)
+      {
+        break;
+      }
+    }
+
+    if (probes < a->size && k == key)
+    {
+      v = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+
+      if (v == LF_VALUE_EMPTY)
+      {
+        return HASHTABLE_KEY_NOT_FOUND;
+      }
+
+      if (v != LF_VALUE_MOVED)
+      {
+        *value = (void *) v;
+        return HASHTABLE_SUCCESS;
+      }
+    }
+
+    a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE);
+  }
+
+  return HASHTABLE_KEY_NOT_FOUND;
+}
+
+int lfhashtable_set(struct lfhashtable *lf, uint64_t key, void *value)
+{
+  return lfhashtable_put(lf, key, value, LF_INSERT);
+}
+
+int lfhashtable_update(struct lfhashtable *lf, uint64_t key, void *value)
+{
+  return lfhashtable_put(lf, key, value, LF_UPDATE);
+}
+
+int lfhashtable_upsert(struct lfhashtable *lf, uint64_t key, void *value)
+{
+  return lfhashtable_put(lf, key, value, LF_UPSERT);
+}
+
+void lfhashtable_delete(struct lfhashtable *lf)
+{
+  struct lfhashtablearray *a, *next;
+
+  if (!lf->table_settings.arena)
+  {
+    for (a = lf->table_first; a != NULL; a = next)
+    {
+      next = a->next;
+      (lf->table_settings.freefunction)(lf->table_settings.alloc_context, 
+                                        a, lfhashtable_array_bytes(a->size));
+    }
+  }
+
+  lf->table = NULL;
+  lf->table_first = NULL;
+}
+
+static inline ht_hash_t lfhashtable_hash(uint64_t key)
+{
+  /* fmix64 from MurmurHash3 */
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+
+  return (ht_hash_t) key;
+}
+
+static struct lfhashtablearray *lfhashtable_array_new(struct lfhashtable *lf,
+                                                      ht_size_p_t size_p,
+                                                      ht_size_t reserve)
+{
+  struct lfhashtablearray *a;
+  ht_size_t size;
+
+  size = 1 << size_p;
+  a = (lf->table_settings.mallocfunction)(lf->table_settings.alloc_context, 
+                                          lfhashtable_array_bytes(size));
+
+  if (a == NULL)
+  {
+    return NULL;
+  }
+
+  memset(a, 0, lfhashtable_array_bytes(size));
+  a->size_p  = size_p;
+  a->size    = size;
+  a->mask    = size - 1;
+  a->reserve = reserve;
+
+  return a;
+}
+
+static int lfhashtable_put(struct lfhashtable *lf, uint64_t key, 
+                           void *value, int mode)
+{
+  struct lfhashtablearray *a;
+  ht_hash_t hash;
+  int r;
+
+  if (key == LF_KEY_EMPTY || key == LF_KEY_MOVED || 
+      (uintptr_t) value == LF_VALUE_EMPTY || 
+      (uintptr_t) value == LF_VALUE_MOVED)
+  {
+    return HASHTABLE_INVALID_ARG;
+  }
+
+  hash = lfhashtable_hash(key);
+  a = __atomic_load_n(&lf->table, __ATOMIC_ACQUIRE);
+
+  for (;;)
+  {
+    if (__atomic_load_n(&a->next, __ATOMIC_ACQUIRE) != NULL)
+    {
+      lfhashtable_help(lf, a);
+    }
+
+    r = lfhashtable_put_array(lf, a, key, hash, (uintptr_t) value, mode);
+
+    if (r == LF_FULL)
+    {
+      /* The key can't simply go in the next array, since readers would
+       * stop at the empty slots still left in this one. Instead, help 
+       * copy this array (or, if its room is being held for a copy into 
+       * it, that one) and start again once the copy is done. */
+      if (__atomic_load_n(&a->reserve, __ATOMIC_ACQUIRE) == 0 &&
+          lfhashtable_grow(lf, a) != HASHTABLE_SUCCESS)
+      {
+        return HASHTABLE_OUT_OF_MEMORY;
+      }
+
+      a = __atomic_load_n(&lf->table, __ATOMIC_ACQUIRE);
+
+      /* Nothing left to help with: wait for whoever is copying the last
+       * chunks, who may well be waiting for this CPU */
+      if (__atomic_load_n(&a->migrate_next, __ATOMIC_ACQUIRE) >= a->size &&
+          __atomic_load_n(&a->migrate_done, __ATOMIC_ACQUIRE) < a->size)
+      {
+        sched_yield();
+      }
+
+      continue;
+    }
+    else if (r != LF_NEXT)
+    {
+      return r;
+    }
+
+    a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE);
+
+    if (a == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+}
+
+static int lfhashtable_put_array(struct lfhashtable *lf, 
+                                 struct lfhashtablearray *a, uint64_t key,
+                                 ht_hash_t hash, uintptr_t value, int mode)
+{
+  struct lfhashtableslot *s;
+  ht_size_t h, probes, used;
+  uint64_t k;
+
+  for (probes = 0, h = hash & a->mask; probes < a->size; 
+       probes++, h = (h + 1) & a->mask)
+  {
+    s = &(a->slots[h]);
+    k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+    if (k == LF_KEY_EMPTY)
+    {
+      if (mode == LF_UPDATE)
+      {
+        return HASHTABLE_KEY_NOT_FOUND;
+      }
+
+      /* Room is claimed before the slot, so that used never overshoots */
+      used = __atomic_add_fetch(&a->used, 1, __ATOMIC_ACQ_REL);
+
+      if (mode != LF_COPY && 
+          used + __atomic_load_n(&a->reserve, __ATOMIC_ACQUIRE) >= a->size)
+      {
+        __atomic_sub_fetch(&a->used, 1, __ATOMIC_ACQ_REL);
+        return LF_FULL;
+      }
+
+      if (__atomic_compare_exchange_n(&s->key, &k, key, 0, 
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        k = key;
+
+        if (mode != LF_COPY && used > a->size - a->size / 4)
+        {
+          lfhashtable_grow(lf, a);
+        }
+      }
+      else
+      {
+        /* Somebody else took the slot; k is now their key */
+        __atomic_sub_fetch(&a->used, 1, __ATOMIC_ACQ_REL);
+      }
+    }
+
+    if (k == LF_KEY_MOVED)
+    {
+      return LF_NEXT;
+    }
+
+    if (k == key)
+    {
+      return lfhashtable_put_value(s, value, mode);
+    }
+  }
+
+  return LF_FULL;
+}
+
+static inline int lfhashtable_put_value(struct lfhashtableslot *s, 
+                                        uintptr_t value, int mode)
+{
+  uintptr_t v;
+
+  v = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+
+  for (;;)
+  {
+    if (v == LF_VALUE_MOVED)
+    {
+      return LF_NEXT;
+    }
+
+    /* A key whose value is still empty is being inserted, and is treated
+     * as not there yet; two threads inserting it race for the value */
+    if (v == LF_VALUE_EMPTY && mode == LF_UPDATE)
+    {
+      return HASHTABLE_KEY_NOT_FOUND;
+    }
+
+    if (v != LF_VALUE_EMPTY && mode == LF_INSERT)
+    {
+      return HASHTABLE_DUPLICATE;
+    }
+
+    if (__atomic_compare_exchange_n(&s->value, &v, value, 0, 
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      return HASHTABLE_SUCCESS;
+    }
+  }
+}
+
+static int lfhashtable_grow(struct lfhashtable *lf, 
+                            struct lfhashtablearray *a)
+{
+  struct lfhashtablearray *b, *expected;
+  ht_size_p_t size_p;
+
+  if (__atomic_load_n(&a->next, __ATOMIC_ACQUIRE) != NULL)
+  {
+    return HASHTABLE_SUCCESS;
+  }
+
+  size_p = a->size_p + lf->table_settings.size_extend;
+
+  if (size_p > lf->table_settings.size_maximum || size_p > ht_size_lim_p)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  b = lfhashtable_array_new(lf, size_p, a->size);
+
+  if (b == NULL)
+  {
+    return HASHTABLE_OUT_OF_MEMORY;
+  }
+
+  expected = NULL;
+
+  if (!__atomic_compare_exchange_n(&a->next, &expected, b, 0, 
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    /* Another thread got there first */
+    if (!lf->table_settings.arena)
+    {
+      (lf->table_settings.freefunction)(lf->table_settings.alloc_context, 
+                                        b, lfhashtable_array_bytes(b->size));
+    }
+  }
+
+  return HASHTABLE_SUCCESS;
+}
+
+/* Copies the next unclaimed chunk of a into a->next, if there is one */
+static void lfhashtable_help(struct lfhashtable *lf, 
+                             struct lfhashtablearray *a)
+{
+  ht_size_t start, end, i;
+
+  /* Checked first so that migrate_next can't wrap around */
+  if (__atomic_load_n(&a->migrate_next, __ATOMIC_ACQUIRE) >= a->size)
+  {
+    lfhashtable_advance(lf);
+    return;
+  }
+
+  start = __atomic_fetch_add(&a->migrate_next, LF_MIGRATE_CHUNK, 
+                             __ATOMIC_ACQ_REL);
+
+  if (start >= a->size)
+  {
+    return;
+  }
+
+  end = a->size - start < LF_MIGRATE_CHUNK ? a->size : 
+        start + LF_MIGRATE_CHUNK;
+
+  for (i = start; i < end; i++)
+  {
+    lfhashtable_migrate(lf, a, &(a->slots[i]));
+  }
+
+  if (__atomic_add_fetch(&a->migrate_done, end - start, __ATOMIC_ACQ_REL) ==
+      a->size)
+  {
+    __atomic_store_n(&a->next->reserve, 0, __ATOMIC_RELEASE);
+    lfhashtable_advance(lf);
+  }
+}
+
+static void lfhashtable_migrate(struct lfhashtable *lf, 
+                                struct lfhashtablearray *a, 
+                                struct lfhashtableslot *s)
+{
+  struct lfhashtablearray *b;
+  uint64_t k;
+  uintptr_t v;
+  ht_hash_t hash;
+
+  k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+  while (k == LF_KEY_EMPTY)
+  {
+    if (__atomic_compare_exchange_n(&s->key, &k, LF_KEY_MOVED, 0, 
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      return;
+    }
+  }
+
+  hash = lfhashtable_hash(k);
+  v = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+
+  /* Until the value is closed, nobody writes this key anywhere but here,
+   * so the copy can't overwrite anything newer */
+  do
+  {
+    if (v != LF_VALUE_EMPTY)
+    {
+      for (b = a->next; 
+           lfhashtable_put_array(lf, b, k, hash, v, LF_COPY) == LF_NEXT;
+           b = __atomic_load_n(&b->next, __ATOMIC_ACQUIRE));
+    }
+  }
+  while (!__atomic_compare_exchange_n(&s->value, &v, LF_VALUE_MOVED, 0, 
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/* Moves table past every array that has been copied in full */
+static void lfhashtable_advance(struct lfhashtable *lf)
+{
+  struct lfhashtablearray *a, *next;
+
+  a = __atomic_load_n(&lf->table, __ATOMIC_ACQUIRE);
+
+  while ((next = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE)) != NULL &&
+         __atomic_load_n(&a->migrate_done, __ATOMIC_ACQUIRE) == a->size)
+  {
+    if (__atomic_compare_exchange_n(&lf->table, &a, next, 0, 
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      a = next;
+    }
+  }
+}
@@ -0,0 +1,47 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* A table of 64 bit keys and pointer values that any number of threads
+ * may read and modify at once, without locks. */
+
+#ifndef LFHASHTABLE_HEADER
+#define LFHASHTABLE_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+struct lfhashtablearray;
+
+struct lfhashtable
+{
+  struct lfhashtablearray *table;
+  struct lfhashtablearray *table_first;
+  struct hashtablesettings table_settings;
+};
+
+int lfhashtable_new_custom(struct lfhashtable *lf, 
+                           const struct hashtablesettings *s);
+int lfhashtable_new(struct lfhashtable *lf);
+int lfhashtable_get(struct lfhashtable *lf, uint64_t key, void **value);
+int lfhashtable_set(struct lfhashtable *lf, uint64_t key, void *value);
+int lfhashtable_update(struct lfhashtable *lf, uint64_t key, void *value);
+int lfhashtable_upsert(struct lfhashtable *lf, uint64_t key, void *value);
+void lfhashtable_delete(struct lfhashtable *lf);
+
+#endif  /* LFHASHTABLE_HEADER */
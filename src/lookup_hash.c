@@ -11,6 +11,7 @@
 #include <string.h>
 
 #include "config.h"
+#include "lookup_hash.h"
 
 #ifdef ENDIAN_LITTLE
   #define HASH_ENDIAN_LITTLE 1
@@ -45,13 +46,48 @@
   c ^= b; c -= rot(b,24); \
 }
 
+/* lookup_hash_many hashes this many keys at once, one per vector lane. On
+ * x86-64 it is compiled three times, and the widest version the CPU can
+ * run is picked when the program is loaded: sixteen lanes fill an AVX-512
+ * register, or two AVX2 ones. Other compilers and machines just get the
+ * generic version, which gcc still vectorises with whatever it has. */
+#define LOOKUP_LANES  16
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 && \
+    defined(__x86_64__) && defined(__linux__)
+  #define LOOKUP_CLONES \
+    __attribute__ ((target_clones("avx512f", "avx2", "default")))
+#else
+  #define LOOKUP_CLONES
+#endif
+
+typedef uint32_t lookup_vec __attribute__ ((vector_size (LOOKUP_LANES * 4)));
+
+static inline uint32_t lookup_word(const uint8_t *k, size_t length);
+static void lookup_hash_lanes(const void *const *keys, size_t length,
+                              uint32_t seed, uint32_t *hashes) LOOKUP_CLONES;
+static inline uint32_t lookup_hash_body(const void *key, size_t length,
+                                        uint32_t seed);
+
 uint32_t lookup_hash(const void *key, size_t length)
+{
+  return lookup_hash_body(key, length, 0);
+}
+
+/* The seed is lookup3's initval; seeding with 0 gives lookup_hash */
+uint32_t lookup_hash_seeded(const void *key, size_t length, uint32_t seed)
+{
+  return lookup_hash_body(key, length, seed);
+}
+
+static inline uint32_t lookup_hash_body(const void *key, size_t length,
+                                        uint32_t seed)
 {
   uint32_t a,b,c;                                          /* internal state */
   union { const void *ptr; size_t i; } u;     /* needed for Mac Powerbook G4 */
 
   /* Set up the internal state */
-  a = b = c = 0xdeadbeef + ((uint32_t)length);
+  a = b = c = 0xdeadbeef + ((uint32_t)length) + seed;
 
   u.ptr = key;
   if (HASH_ENDIAN_LITTLE && ((u.i & 0x3) == 0)) {
@@ -216,3 +252,176 @@ uint32_t lookup_hash(const void *key, size_t length)
   final(a,b,c);
   return c;
 }
+
+/* Reads up to four bytes as a little endian word, as the scalar code does
+ * (whichever way it reads the key), padding with zeroes. */
+static inline uint32_t lookup_word(const uint8_t *k, size_t length)
+{
+  uint32_t w;
+
+  if (length >= 4)
+  {
+    memcpy(&w, k, sizeof(w));
+
+#if !HASH_ENDIAN_LITTLE
+    w = __builtin_bswap32(w);
+#endif
+
+    return w;
+  }
+
+  w = 0;
+
+  switch (length)
+  {
+  case 3 : w += ((uint32_t)k[2])<<16;  /* fall through */
+  case 2 : w += ((uint32_t)k[1])<<8;   /* fall through */
+  case 1 : w += k[0];                  /* fall through */
+  case 0 : break;
+  }
+
+  return w;
+}
+
+/* lookup_hash, for LOOKUP_LANES keys of the same length side by side. The
+ * words of each block are gathered into plain arrays a lane at a time, and
+ * then all of the mixing is done with vector code. */
+static void lookup_hash_lanes(const void *const *keys, size_t length,
+                              uint32_t seed, uint32_t *hashes)
+{
+  lookup_vec a, b, c, k[3];
+  uint32_t words[3][LOOKUP_LANES];
+  size_t offset, rest;
+  int l;
+
+  a = b = c = (lookup_vec) {0} + (0xdeadbeef + (uint32_t) length + seed);
+
+  if (length == 0)
+  {
+    memcpy(hashes, &c, sizeof(c));
+    return;
+  }
+
+  for (offset = 0; length - offset > 12; offset += 12)
+  {
+    for (l = 0; l < LOOKUP_LANES; l++)
+    {
+      words[0][l] = lookup_word((const uint8_t *) keys[l] + offset,     4);
+      words[1][l] = lookup_word((const uint8_t *) keys[l] + offset + 4, 4);
+      words[2][l] = lookup_word((const uint8_t *) keys[l] + offset + 8, 4);
+    }
+
+    memcpy(k, words, sizeof(k));
+    a += k[0];
+    b += k[1];
+    c += k[2];
+    mix(a,b,c);
+  }
+
+  /* The last block has between 1 and 12 bytes */
+  rest = length - offset;
+
+  for (l = 0; l < LOOKUP_LANES; l++)
+  {
+    const uint8_t *key = (const uint8_t *) keys[l] + offset;
+
+    words[0][l] = lookup_word(key,     rest);
+    words[1][l] = lookup_word(key + 4, rest > 4 ? rest - 4 : 0);
+    words[2][l] = lookup_word(key + 8, rest > 8 ? rest - 8 : 0);
+  }
+
+  memcpy(k, words, sizeof(k));
+  a += k[0];
+  b += k[1];
+  c += k[2];
+  final(a,b,c);
+
+  memcpy(hashes, &c, sizeof(c));
+}
+
+/* The incremental version processes the key a byte at a time, just like the
+ * last branch of lookup_hash. Bytes are collected into a twelve byte block,
+ * which is only mixed when it is known not to be the last. */
+void lookup_hash_init(struct lookup_hash_state *state, size_t length)
+{
+  lookup_hash_init_seeded(state, length, 0);
+}
+
+void lookup_hash_init_seeded(struct lookup_hash_state *state, size_t length,
+                             uint32_t seed)
+{
+  state->a = state->b = state->c = 0xdeadbeef + ((uint32_t)length) + seed;
+  state->used = 0;
+}
+
+void lookup_hash_update(struct lookup_hash_state *state, const void *data,
+                        size_t length)
+{
+  const uint8_t *k = (const uint8_t *)data;
+  size_t n;
+
+  while (length > 0)
+  {
+    if (state->used == 12)
+    {
+      state->a += lookup_word(state->block,     4);
+      state->b += lookup_word(state->block + 4, 4);
+      state->c += lookup_word(state->block + 8, 4);
+      mix(state->a, state->b, state->c);
+      state->used = 0;
+    }
+
+    n = 12 - state->used;
+
+    if (n > length)
+    {
+      n = length;
+    }
+
+    memcpy(state->block + state->used, k, n);
+    state->used += n;
+    k += n;
+    length -= n;
+  }
+}
+
+uint32_t lookup_hash_final(struct lookup_hash_state *state)
+{
+  size_t used = state->used;
+
+  if (used == 0)
+  {
+    return state->c;                /* zero length keys require no mixing */
+  }
+
+  state->a += lookup_word(state->block,     used);
+  state->b += lookup_word(state->block + 4, used > 4 ? used - 4 : 0);
+  state->c += lookup_word(state->block + 8, used > 8 ? used - 8 : 0);
+  final(state->a, state->b, state->c);
+
+  return state->c;
+}
+
+/* Hashes n keys, all of the same length, giving the same results as 
+ * calling lookup_hash on each of them. */
+void lookup_hash_many(const void *const *keys, size_t length, 
+                      uint32_t *hashes, size_t n)
+{
+  lookup_hash_many_seeded(keys, length, 0, hashes, n);
+}
+
+void lookup_hash_many_seeded(const void *const *keys, size_t length, 
+                             uint32_t seed, uint32_t *hashes, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i + LOOKUP_LANES <= n; i += LOOKUP_LANES)
+  {
+    lookup_hash_lanes(keys + i, length, seed, hashes + i);
+  }
+
+  for (; i < n; i++)
+  {
+    hashes[i] = lookup_hash_body(keys[i], length, seed);
+  }
+}
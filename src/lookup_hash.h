@@ -21,7 +21,27 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/* Lets a key held in several pieces be hashed without copying it together.
+ * The total length must be known in advance. */
+struct lookup_hash_state
+{
+  uint32_t a, b, c;
+  size_t used;
+  uint8_t block[12];
+};
+
 uint32_t lookup_hash(const void *key, size_t length);
+uint32_t lookup_hash_seeded(const void *key, size_t length, uint32_t seed);
+void lookup_hash_init(struct lookup_hash_state *state, size_t length);
+void lookup_hash_init_seeded(struct lookup_hash_state *state, size_t length,
+                             uint32_t seed);
+void lookup_hash_update(struct lookup_hash_state *state, const void *data,
+                        size_t length);
+uint32_t lookup_hash_final(struct lookup_hash_state *state);
+void lookup_hash_many(const void *const *keys, size_t length, 
+                      uint32_t *hashes, size_t n);
+void lookup_hash_many_seeded(const void *const *keys, size_t length, 
+                             uint32_t seed, uint32_t *hashes, size_t n);
 
 #endif  /* LOOKUP_HASH_HEADER */
 
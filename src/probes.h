@@ -0,0 +1,97 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* Static tracepoints (USDT), for perf, bpftrace, SystemTap and the like. 
+ * They are only compiled in with -DHASHTABLE_USDT (make USDT=1), which 
+ * needs <sys/sdt.h>; otherwise they compile to nothing. Each is a nop 
+ * instruction until a tracer attaches to it. Not part of the public 
+ * interface. The probes are listed in docs/usage. */
+
+#ifndef PROBES_HEADER
+#define PROBES_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+#include "latency.h"
+
+/* A lookup that compares against more than this many items is reported */
+#ifndef HASHTABLE_PROBE_LONG
+#define HASHTABLE_PROBE_LONG  8
+#endif
+
+#ifdef HASHTABLE_USDT
+
+#include <time.h>
+#include <sys/sdt.h>
+
+static inline int hashtable_probe_resize(struct hashtable *ht, 
+                    ht_size_p_t new_size_p,
+                    int (*resize)(struct hashtable *ht, ht_size_p_t size_p));
+
+/* Times a resize of any engine */
+static inline int hashtable_probe_resize(struct hashtable *ht, 
+                    ht_size_p_t new_size_p,
+                    int (*resize)(struct hashtable *ht, ht_size_p_t size_p))
+{
+  struct timespec start, end;
+  ht_size_p_t old_size_p;
+  int64_t ns;
+  int r;
+
+  old_size_p = ht->table_size_p;
+  DTRACE_PROBE4(lighashtable, resize__start, ht, old_size_p, new_size_p,
+                ht->table_itemcount);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  r = hashtable_latency_resize(ht, new_size_p, resize);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  ns = (int64_t) (end.tv_sec - start.tv_sec) * 1000000000 + 
+       (end.tv_nsec - start.tv_nsec);
+  DTRACE_PROBE6(lighashtable, resize__done, ht, old_size_p, 
+                ht->table_size_p, ht->table_itemcount, ns, r);
+
+  return r;
+}
+
+#define hashtable_probe_long(ht, hash, probes)                           \
+  do                                                                     \
+  {                                                                      \
+    if ((probes) > HASHTABLE_PROBE_LONG)                                 \
+    {                                                                    \
+      DTRACE_PROBE3(lighashtable, long__probe, ht, hash, probes);        \
+    }                                                                    \
+  }                                                                      \
+  while (0)
+#define hashtable_probe_alloc_fail(ht, category, size)                   \
+  DTRACE_PROBE3(lighashtable, alloc__fail, ht, category, size)
+#define hashtable_probe_budget(ht, category, size)                       \
+  DTRACE_PROBE3(lighashtable, budget__refuse, ht, category, size)
+
+#else
+
+#define hashtable_probe_resize(ht, new_size_p, resize) \
+  hashtable_latency_resize(ht, new_size_p, resize)
+#define hashtable_probe_long(ht, hash, probes)          ((void) (probes))
+#define hashtable_probe_alloc_fail(ht, category, size)  ((void) 0)
+#define hashtable_probe_budget(ht, category, size)      ((void) 0)
+
+#endif  /* HASHTABLE_USDT */
+
+#endif  /* PROBES_HEADER */
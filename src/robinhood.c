@@ -0,0 +1,277 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "hashtable_internal.h"
+#include "robinhood.h"
+
+/* Items live directly in an array of 2^table_size_p slots. An item whose
+ * hash picks slot i is stored in the first free slot from i onwards, 
+ * except that it may take the place of an item that is closer to its own
+ * home slot (which moves along one). This keeps the distances of all the 
+ * items from their home slots short and even, and lets a lookup stop as 
+ * soon as it passes where its key would have been put. 
+ *
+ * Each slot has a byte giving one more than the distance of its item from
+ * its home slot, or zero if the slot is empty. The bytes live after the 
+ * slots, in the same allocation. Removing an item moves the following 
+ * items back one place, so there are no tombstones. */
+#define ROBINHOOD_MAX_DISTANCE  UINT8_MAX
+
+#define robinhood_table_bytes(size) \
+  ((size_t) (size) * (sizeof(struct hashtableslot) + sizeof(uint8_t)))
+
+/* The table grows once it is 15/16ths full */
+#define robinhood_limit(size)  ((size) - ((size) >> 4))
+
+static int robinhood_place(struct hashtableslot *slots, uint8_t *dists,
+                           ht_hash_t mask, ht_hash_t hash, ht_size_t *index);
+
+/* Makes room for an item with the given hash, shifting the items after 
+ * its proper position along by one. Fails, without changing anything, if 
+ * that would push an item further than ROBINHOOD_MAX_DISTANCE from home; 
+ * there must be at least one empty slot. On success the new slot's 
+ * key_hash is set. */
+static int robinhood_place(struct hashtableslot *slots, uint8_t *dists,
+                           ht_hash_t mask, ht_hash_t hash, ht_size_t *index)
+{
+  ht_size_t pos, end;
+  unsigned int dist;
+
+  pos  = hash & mask;
+  dist = 1;
+
+  /* Skip the items that are at least as far from home as we would be */
+  while (dists[pos] >= dist)
+  {
+    if (dist == ROBINHOOD_MAX_DISTANCE)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    pos = (pos + 1) & mask;
+    dist++;
+  }
+
+  /* ...then find the end of the run that will have to move */
+  for (end = pos; dists[end] != 0; end = (end + 1) & mask)
+  {
+    if (dists[end] == ROBINHOOD_MAX_DISTANCE)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+
+  while (end != pos)
+  {
+    slots[end] = slots[(end - 1) & mask];
+    dists[end] = dists[(end - 1) & mask] + 1;
+    end = (end - 1) & mask;
+  }
+
+  slots[pos].key_hash = hash;
+  dists[pos] = dist;
+  *index = pos;
+
+  return HASHTABLE_SUCCESS;
+}
+
+int hashtable_robinhood_resize(struct hashtable *ht, ht_size_p_t new_size_p)
+{
+  struct hashtableslot *slots;
+  uint8_t *dists;
+  ht_size_t size, mask, i, index;
+
+  for (;;)
+  {
+    size = 1 << new_size_p;
+    mask = size - 1;
+
+    slots = hashtable_malloc(ht, HASHTABLE_MEMORY_TABLE, 
+                             robinhood_table_bytes(size));
+
+    if (slots == NULL)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    dists = (uint8_t *) (slots + size);
+    memset(dists, 0, size * sizeof(uint8_t));
+
+    for (i = 0; i < ht->table_size; i++)
+    {
+      if ((ht->table_tags)[i] != 0)
+      {
+        if (robinhood_place(slots, dists, mask, (ht->slots)[i].key_hash, 
+                            &index) != HASHTABLE_SUCCESS)
+        {
+          break;
+        }
+
+        slots[index] = (ht->slots)[i];
+      }
+    }
+
+    if (i == ht->table_size)
+    {
+      break;
+    }
+
+    /* The old table is still intact, so try a bigger one */
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, slots, 
+                   robinhood_table_bytes(size));
+
+    new_size_p += ht->table_settings.size_extend;
+
+    if (new_size_p > ht->table_settings.size_maximum || 
+        new_size_p > ht_size_lim_p)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+  }
+
+  if (ht->slots != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, ht->slots, 
+                   robinhood_table_bytes(ht->table_size));
+  }
+
+  ht->slots        = slots;
+  ht->table_tags   = dists;
+  ht->table_size_p = new_size_p;
+  ht->table_size   = size;
+  ht->table_mask   = mask;
+
+  return HASHTABLE_SUCCESS;
+}
+
+struct hashtableitem *hashtable_robinhood_find(struct hashtable *ht, 
+                                               const void *key, 
+                                               size_t keylen,
+                                               ht_hash_t hash)
+{
+  ht_size_t pos;
+  unsigned int dist;
+  struct hashtableslot *j;
+
+  pos  = hash & ht->table_mask;
+  dist = 1;
+
+  while ((ht->table_tags)[pos] >= dist)
+  {
+    j = &((ht->slots)[pos]);
+
+    if (j->key_hash == hash &&
+        j->keylen   == keylen &&
+        memcmp(j->key, key, keylen) == 0)
+    {
+      hashtable_probe_long(ht, hash, dist);
+      return (struct hashtableitem *) j;
+    }
+
+    pos = (pos + 1) & ht->table_mask;
+    dist++;
+  }
+
+  hashtable_probe_long(ht, hash, dist - 1);
+
+  return NULL;
+}
+
+int hashtable_robinhood_reserve(struct hashtable *ht, ht_hash_t hash,
+                                struct hashtableslot **slot)
+{
+  int i, r;
+  ht_size_t index;
+  ht_size_p_t extend;
+
+  i = HASHTABLE_SUCCESS;
+  extend = ht->table_size_p + ht->table_settings.size_extend;
+
+  /* Grow when due; if that isn't possible, carry on filling the table */
+  if (ht->table_itemcount >= robinhood_limit(ht->table_size) &&
+      extend <= ht->table_settings.size_maximum && extend <= ht_size_lim_p)
+  {
+    if (hashtable_probe_resize(ht, extend, hashtable_robinhood_resize) != 
+        HASHTABLE_SUCCESS)
+    {
+      i = HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY;
+    }
+  }
+
+  while (ht->table_itemcount == ht->table_size ||
+         robinhood_place(ht->slots, ht->table_tags, ht->table_mask, 
+                         hash, &index) != HASHTABLE_SUCCESS)
+  {
+    /* The table is full, or a run is too long: it has to grow now */
+    extend = ht->table_size_p + ht->table_settings.size_extend;
+
+    if (extend > ht->table_settings.size_maximum || extend > ht_size_lim_p)
+    {
+      return HASHTABLE_OUT_OF_MEMORY;
+    }
+
+    r = hashtable_probe_resize(ht, extend, hashtable_robinhood_resize);
+
+    if (r != HASHTABLE_SUCCESS)
+    {
+      return r;
+    }
+  }
+
+  *slot = &((ht->slots)[index]);
+
+  return i;
+}
+
+void hashtable_robinhood_remove(struct hashtable *ht, 
+                                struct hashtableslot *slot)
+{
+  ht_size_t pos, next;
+
+  pos  = slot - ht->slots;
+  next = (pos + 1) & ht->table_mask;
+
+  /* Backward shift: pull the following items (which are not in their home
+   * slots) back one place, until an empty slot or an item at home */
+  while ((ht->table_tags)[next] > 1)
+  {
+    (ht->slots)[pos] = (ht->slots)[next];
+    (ht->table_tags)[pos] = (ht->table_tags)[next] - 1;
+
+    pos  = next;
+    next = (next + 1) & ht->table_mask;
+  }
+
+  (ht->table_tags)[pos] = 0;
+}
+
+void hashtable_robinhood_delete(struct hashtable *ht)
+{
+  if (ht->slots != NULL)
+  {
+    hashtable_free(ht, HASHTABLE_MEMORY_TABLE, ht->slots, 
+                   robinhood_table_bytes(ht->table_size));
+    ht->slots = NULL;
+    ht->table_tags = NULL;
+  }
+}
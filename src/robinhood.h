@@ -0,0 +1,40 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published 
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License, 
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* The Robin Hood linear probing engine (HASHTABLE_ENGINE_ROBINHOOD). These 
+ * are called by hashtable.c; they are not part of the public interface. */
+
+#ifndef ROBINHOOD_HEADER
+#define ROBINHOOD_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+int hashtable_robinhood_resize(struct hashtable *ht, ht_size_p_t new_size_p);
+struct hashtableitem *hashtable_robinhood_find(struct hashtable *ht, 
+                                               const void *key, 
+                                               size_t keylen,
+                                               ht_hash_t hash);
+int hashtable_robinhood_reserve(struct hashtable *ht, ht_hash_t hash,
+                                struct hashtableslot **slot);
+void hashtable_robinhood_remove(struct hashtable *ht, 
+                                struct hashtableslot *slot);
+void hashtable_robinhood_delete(struct hashtable *ht);
+
+#endif  /* ROBINHOOD_HEADER */
@@ -20,6 +20,9 @@
 #include <stdarg.h>
 
 #include "hashtable.h"
+#include "hashset.h"
+#include "intern.h"
+#include "lfhashtable.h"
 
 void *malloc_f(size_t size)
 {
@@ -164,6 +167,104 @@ void hashtable_update_f(struct hashtable *ht, char *key, size_t keylen,
   }
 }
 
+void hashtable_get_or_insert_f(struct hashtable *ht, char *key, size_t keylen,
+                               struct hashtableitem **item, int *inserted)
+{
+  int r;
+  r = hashtable_get_or_insert(ht, key, keylen, item, inserted);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while finding or inserting a key in a hashtable: "
+                    "%s\n", hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashtable_upsert_f(struct hashtable *ht, char *key, size_t keylen,
+                        void *data)
+{
+  int r;
+  r = hashtable_upsert(ht, key, keylen, data);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while upserting a key in a hashtable: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashtable_aggregate_f(struct hashtable *ht, 
+                           const struct hashtablerecord *records, size_t n,
+                           int op)
+{
+  int r;
+  r = hashtable_aggregate(ht, records, n, op);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while aggregating records in a hashtable: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashtable_aggregate_merge_f(struct hashtable *dst, struct hashtable *src,
+                                 int op)
+{
+  int r;
+  r = hashtable_aggregate_merge(dst, src, op);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while merging hashtables: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashtable_clone_f(struct hashtable *dst, struct hashtable *src)
+{
+  int r;
+  r = hashtable_clone(dst, src);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while cloning a hashtable: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashtable_multi_add_f(struct hashtable *ht, char *key, size_t keylen,
+                           void *value)
+{
+  int r;
+  r = hashtable_multi_add(ht, key, keylen, value);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while adding a value to a hashtable: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashtable_multi_remove_f(struct hashtable *ht, char *key, size_t keylen,
+                              void *value)
+{
+  int r;
+  r = hashtable_multi_remove(ht, key, keylen, value);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while removing a value from a hashtable: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
 void hashtable_unset_item_f(struct hashtable *ht, struct hashtableitem *item)
 {
   int r;
@@ -190,3 +291,188 @@ void hashtable_unset_f(struct hashtable *ht, char *key, size_t keylen)
   }
 }
 
+void hashset_new_custom_f(struct hashset *hs,
+                          const struct hashtablesettings *s)
+{
+  int r;
+  r = hashset_new_custom(hs, s);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error creating hashset: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashset_new_like_f(struct hashset *hs, struct hashset *like)
+{
+  int r;
+  r = hashset_new_like(hs, like);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error creating hashset: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashset_add_f(struct hashset *hs, char *key, size_t keylen)
+{
+  int r;
+  r = hashset_add(hs, key, keylen);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while adding a key to a hashset: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashset_remove_f(struct hashset *hs, char *key, size_t keylen)
+{
+  int r;
+  r = hashset_remove(hs, key, keylen);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while removing a key from a hashset: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashset_union_f(struct hashset *dst, struct hashset *src)
+{
+  int r;
+  r = hashset_union(dst, src);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while taking the union of hashsets: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashset_intersect_f(struct hashset *dst, struct hashset *src)
+{
+  int r;
+  r = hashset_intersect(dst, src);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while intersecting hashsets: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hashset_difference_f(struct hashset *dst, struct hashset *src)
+{
+  int r;
+  r = hashset_difference(dst, src);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while taking the difference of hashsets: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void internpool_new_custom_f(struct internpool *pool, 
+                             const struct hashtablesettings *s)
+{
+  int r;
+  r = internpool_new_custom(pool, s);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error creating intern pool: %s\n", 
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void internpool_new_f(struct internpool *pool)
+{
+  int r;
+  r = internpool_new(pool);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error creating intern pool: %s\n", 
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void internpool_add_f(struct internpool *pool, char *string, size_t length,
+                      uint32_t *id)
+{
+  int r;
+  r = internpool_add(pool, string, length, id);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while interning a string: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void lfhashtable_new_custom_f(struct lfhashtable *lf, 
+                              const struct hashtablesettings *s)
+{
+  int r;
+  r = lfhashtable_new_custom(lf, s);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error creating lock free table: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void lfhashtable_set_f(struct lfhashtable *lf, uint64_t key, void *value)
+{
+  int r;
+  r = lfhashtable_set(lf, key, value);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while setting a key in a lock free table: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void lfhashtable_update_f(struct lfhashtable *lf, uint64_t key, void *value)
+{
+  int r;
+  r = lfhashtable_update(lf, key, value);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while updating a key in a lock free table: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
+
+void lfhashtable_upsert_f(struct lfhashtable *lf, uint64_t key, void *value)
+{
+  int r;
+  r = lfhashtable_upsert(lf, key, value);
+
+  if (r != HASHTABLE_SUCCESS)
+  {
+    fprintf(stderr, "Error while upserting a key in a lock free table: %s\n",
+                    hashtable_strerror(r));
+    exit(EXIT_FAILURE);
+  }
+}
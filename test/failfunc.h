@@ -22,6 +22,9 @@
 #include <stdlib.h>
 
 #include "hashtable.h"
+#include "hashset.h"
+#include "intern.h"
+#include "lfhashtable.h"
 
 void *malloc_f(size_t size);
 
@@ -43,8 +46,40 @@ void hashtable_update_item_f(struct hashtable *ht, struct hashtableitem *item,
                              void *data);
 void hashtable_update_f(struct hashtable *ht, char *key, size_t keylen,
                         void *data);
+void hashtable_get_or_insert_f(struct hashtable *ht, char *key, size_t keylen,
+                               struct hashtableitem **item, int *inserted);
+void hashtable_upsert_f(struct hashtable *ht, char *key, size_t keylen,
+                        void *data);
+void hashtable_aggregate_f(struct hashtable *ht, 
+                           const struct hashtablerecord *records, size_t n,
+                           int op);
+void hashtable_aggregate_merge_f(struct hashtable *dst, struct hashtable *src,
+                                 int op);
+void hashtable_clone_f(struct hashtable *dst, struct hashtable *src);
+void hashtable_multi_add_f(struct hashtable *ht, char *key, size_t keylen,
+                           void *value);
+void hashtable_multi_remove_f(struct hashtable *ht, char *key, size_t keylen,
+                              void *value);
 void hashtable_unset_item_f(struct hashtable *ht, struct hashtableitem *item);
 void hashtable_unset_f(struct hashtable *ht, char *key, size_t keylen);
+void hashset_new_custom_f(struct hashset *hs,
+                          const struct hashtablesettings *s);
+void hashset_new_like_f(struct hashset *hs, struct hashset *like);
+void hashset_add_f(struct hashset *hs, char *key, size_t keylen);
+void hashset_remove_f(struct hashset *hs, char *key, size_t keylen);
+void hashset_union_f(struct hashset *dst, struct hashset *src);
+void hashset_intersect_f(struct hashset *dst, struct hashset *src);
+void hashset_difference_f(struct hashset *dst, struct hashset *src);
+void internpool_new_custom_f(struct internpool *pool, 
+                             const struct hashtablesettings *s);
+void internpool_new_f(struct internpool *pool);
+void internpool_add_f(struct internpool *pool, char *string, size_t length,
+                      uint32_t *id);
+void lfhashtable_new_custom_f(struct lfhashtable *lf, 
+                              const struct hashtablesettings *s);
+void lfhashtable_set_f(struct lfhashtable *lf, uint64_t key, void *value);
+void lfhashtable_update_f(struct lfhashtable *lf, uint64_t key, void *value);
+void lfhashtable_upsert_f(struct lfhashtable *lf, uint64_t key, void *value);
 
 #define hashtable_delete_f hashtable_delete
 
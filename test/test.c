@@ -18,6 +18,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #ifdef BENCHMARK
   #ifndef NDEBUG
@@ -38,6 +40,13 @@
 
 #include "failfunc.h"
 #include "lookup_hash.h"
+#include "hashset.h"
+#include "intern.h"
+#include "lfhashtable.h"
+
+/* Room for a one letter prefix and any int, so that make_keys never has 
+ * to truncate */
+#define TEST_KEY_SIZE  16
 
 static inline void debug_printf(const char *format, ...);
 static inline void debug_ht(struct hashtable *ht);
@@ -45,6 +54,76 @@ static inline void report_gettest(char *a, char *i);
 static inline void check_size_(size_t real_size, size_t intended_size,
                                const char *name);
 static inline void sanity_check();
+static void make_keys(char keys[][TEST_KEY_SIZE], int n, const char *prefix);
+static void counting_settings(struct hashtablesettings *s);
+static void test_get_or_insert(int *testkey_lens);
+static void test_allocators(int *testkey_lens);
+static void test_tags();
+static void test_bloom();
+static void test_engine(int engine, const char *name);
+static void test_snapshot();
+static void test_seqlock();
+static void *seqlock_reader(void *arg);
+static void *seqlock_writer(void *arg);
+static void *lf_thread(void *arg);
+static void test_aggregate();
+static void test_hash_many();
+static void test_iovec();
+static void test_flood();
+static void test_chain_index();
+static void test_multimap();
+static void test_hashset();
+static void test_intern();
+static void test_lfhashtable();
+static void test_memory();
+static void test_clone();
+static void test_merge();
+static void test_checkpoint();
+static void test_latency();
+static void test_remove_if();
+static int remove_multiple(void *context, const struct hashtableitem *item);
+static void check_removed(struct hashtable *ht, 
+                          char keys[][TEST_KEY_SIZE], int n, 
+                          int step_a, int step_b, int step_c, 
+                          const char *when);
+static void check_same(struct hashtable *a, struct hashtable *b, 
+                       const char *when);
+static ht_hash_t fnv_hash(const void *key, size_t length);
+static int merge_sum(void *context, struct hashtableitem *dst_item,
+                     struct hashtableitem *src_item);
+static void check_memory(struct hashtable *ht, const char *when);
+static void check_set(struct hashset *hs, char keys[][TEST_KEY_SIZE], 
+                      int n, int step_a, int step_b, int op, 
+                      const char *name);
+
+/* The seqlock test: keys below SEQLOCK_STABLE are present throughout,
+ * and each batch adds SEQLOCK_BATCH more, keeping every other one */
+#define SEQLOCK_READERS  4
+#define SEQLOCK_BATCHES  16
+#define SEQLOCK_STABLE   1000
+#define SEQLOCK_BATCH    4000
+#define SEQLOCK_KEYS     (SEQLOCK_STABLE + SEQLOCK_BATCHES * SEQLOCK_BATCH)
+
+struct seqlock_test
+{
+  struct hashtable ht;
+  char keys[SEQLOCK_KEYS][TEST_KEY_SIZE];
+  pthread_barrier_t barrier;
+  int done;
+};
+
+/* The threaded lock free test: every thread works on all LF_KEYS keys, 
+ * half of which are set first and the rest added by upsert */
+#define LF_THREADS  32
+#define LF_KEYS     20000
+
+struct lf_test
+{
+  struct lfhashtable lf;
+  pthread_barrier_t barrier;
+  int next_id;
+  int inserted;
+};
 
 #define print_size(type) \
   debug_printf("sizeof(" #type ") is %zi\n", sizeof(type))
@@ -197,166 +276,3003 @@ static inline void sanity_check()
   }
 }
 
-int main(int argc, char **argv)
+static int construct_function_calls = 0;
+
+static int test_construct(void *context, const void *key, size_t keylen,
+                          void **data)
 {
-  #ifdef BENCHMARK
-  int x, j;
-  char *c;
-  #else
-  char *a, *b, *c;
-  void *t;
-  #endif
+  construct_function_calls++;
+  *data = context;
+  return HASHTABLE_SUCCESS;
+}
 
+static int test_construct_fail(void *context, const void *key, 
+                               size_t keylen, void **data)
+{
+  return HASHTABLE_OUT_OF_MEMORY;
+}
+
+static void test_get_or_insert(int *testkey_lens)
+{
   struct hashtable ht;
-  struct hashtablesettings s;
-  int i, k;
-  struct hashtableitem *l;
-  char d[10];
-  int testkey_lens[testkey_count];
+  struct hashtableitem *l, *m;
+  int i, inserted;
+  char d[2];
+  void *a;
 
-  debug_printf("Sanity check: \n");
-  sanity_check();
-  debug_printf("Done\n");
+  debug_printf("Get-or-insert: ");
 
-  debug_printf("Have %i testkeys\n", testkey_count);
+  hashtable_new_f(&ht);
 
-  for (k = 0; k < testkey_count; k++)
+  for (i = 0; i < testkey_count; i++)
   {
-    testkey_lens[k] = strlen(testkeys[k]);
-  }
+    hashtable_get_or_insert_f(&ht, testkeys[i], testkey_lens[i], 
+                              &l, &inserted);
 
-  #ifdef BENCHMARK
-  for (x = 0; x < BENCHMARK; x++) {
-  #endif
+    if (!inserted || l == NULL || l->data != NULL)
+    {
+      debug_printf("Error: key %i was not inserted\n", i);
+      exit(EXIT_FAILURE);
+    }
 
-  s.size_initial = 0;
-  s.size_maximum = 3;
-  s.size_extend = 1;
-  s.size_extend_trigger = 0;
-  s.hashfunction = lookup_hash;
+    hashtable_update_item_f(&ht, l, &(d[0]));
+  }
 
-  debug_printf("Creating new hashtable size 2^3 = 8: ");
-  hashtable_new_custom_f(&ht, &s);
-  debug_printf("Done\n");
-  debug_ht(&ht);
+  hashtable_get_or_insert_f(&ht, getkey, testkey_lens[4], &m, &inserted);
+  hashtable_get_item_f(&ht, testkeys[4], testkey_lens[4], &l);
 
-  s.size_initial = 255;
+  if (inserted || m != l || ht.table_itemcount != testkey_count)
+  {
+    debug_printf("Error: existing item was not returned\n");
+    exit(EXIT_FAILURE);
+  }
 
-  debug_printf("Adding 7 items: ");
-  #ifdef VERBOSE
-    debug_printf("\n");
-  #endif
-  for (i = 0; i < 7; i++)
+  if (hashtable_get_or_insert_with(&ht, testkeys[2], testkey_lens[2],
+                                   test_construct, &(d[1]), &l, &inserted)
+      != HASHTABLE_SUCCESS || inserted || construct_function_calls != 0)
   {
-    hashtable_set_f(&ht, testkeys[i], testkey_lens[i], &(d[i]));
-    #ifdef VERBOSE
-      debug_printf("  [%10u] = '%s'\n", i, testkeys[i]);
-    #endif
-    debug_ht(&ht);
+    debug_printf("Error: constructor called for an existing key\n");
+    exit(EXIT_FAILURE);
   }
-  debug_printf("Done\n");
 
-  debug_printf("Adding the 8th item: ");
-  hashtable_set_f(&ht, testkeys[7], testkey_lens[7], &(d[7]));
-  debug_printf("Done\n");
-  debug_ht(&ht);
+  hashtable_unset_f(&ht, testkeys[2], testkey_lens[2]);
 
-  debug_printf("Adding the 9th item: ");
-  hashtable_set_f(&ht, testkeys[8], testkey_lens[8], &(d[8]));
-  debug_printf("Done\n");
-  debug_ht(&ht);
+  if (hashtable_get_or_insert_with(&ht, testkeys[2], testkey_lens[2],
+                                   test_construct, &(d[1]), &l, &inserted)
+      != HASHTABLE_SUCCESS || !inserted || construct_function_calls != 1 ||
+      l->data != &(d[1]))
+  {
+    debug_printf("Error: constructor not called for a new key\n");
+    exit(EXIT_FAILURE);
+  }
 
-  debug_printf("Attempting to get a pointer to the 8th item: ");
-  hashtable_get_item_f(&ht, testkeys[7], testkey_lens[7], &l);
+  hashtable_unset_f(&ht, testkeys[2], testkey_lens[2]);
 
-  if (l == NULL)
+  if (hashtable_get_or_insert_with(&ht, testkeys[2], testkey_lens[2],
+                                   test_construct_fail, NULL, &l, &inserted)
+      != HASHTABLE_OUT_OF_MEMORY || inserted ||
+      hashtable_get(&ht, testkeys[2], testkey_lens[2], NULL) != 
+      HASHTABLE_KEY_NOT_FOUND)
   {
-    debug_printf("Failed\n");
+    debug_printf("Error: failed constructor reported as inserted\n");
     exit(EXIT_FAILURE);
   }
-  else
+
+  hashtable_upsert_f(&ht, testkeys[3], testkey_lens[3], &(d[1]));
+  hashtable_get_f(&ht, testkeys[3], testkey_lens[3], &a);
+  report_gettest(a, &(d[1]));
+
+  debug_printf("Upsert of a new key: ");
+  hashtable_unset_f(&ht, testkeys[3], testkey_lens[3]);
+  hashtable_upsert_f(&ht, testkeys[3], testkey_lens[3], &(d[0]));
+  hashtable_get_f(&ht, testkeys[3], testkey_lens[3], &a);
+  report_gettest(a, &(d[0]));
+
+  hashtable_delete(&ht);
+}
+
+struct test_arena
+{
+  char buf[4096];
+  size_t used;
+};
+
+static size_t counted_bytes = 0;
+
+static void *counting_malloc(void *context, size_t size)
+{
+  counted_bytes += size;
+  return malloc_f(size);
+}
+
+static void counting_free(void *context, void *ptr, size_t size)
+{
+  counted_bytes -= size;
+  free(ptr);
+}
+
+/* The defaults, allocating through counting_malloc so that leaks show up
+ * in counted_bytes */
+static void counting_settings(struct hashtablesettings *s)
+{
+  *s = hashtable_defaults;
+  s->mallocfunction  = counting_malloc;
+  s->reallocfunction = NULL;
+  s->freefunction    = counting_free;
+}
+
+/* keys[i] is prefix followed by i */
+static void make_keys(char keys[][TEST_KEY_SIZE], int n, const char *prefix)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
   {
-    debug_printf("Success\n");
+    snprintf(keys[i], TEST_KEY_SIZE, "%s%i", prefix, i);
   }
+}
 
-  debug_printf("Updating the 8th item via pointer: ");
-  hashtable_update_item_f(&ht, l, &(d[2]));
-  debug_printf("Done\n");
-  debug_ht(&ht);
+static void *arena_malloc(void *context, size_t size)
+{
+  struct test_arena *arena;
+  void *r;
 
-  #ifndef BENCHMARK
-  t = l->data;
-  #endif
+  arena = context;
+  size = (size + 15) & ~((size_t) 15);
 
-  debug_printf("Updating the 5th item: ");
-  hashtable_update_f(&ht, getkey, testkey_lens[4], &(d[3]));
-  debug_printf("Done\n");
-  debug_ht(&ht);
+  if (arena->used + size > sizeof(arena->buf))
+  {
+    return NULL;
+  }
 
-  debug_printf("Unsetting the 8th item via pointer: ");
-  hashtable_unset_item_f(&ht, l);
-  debug_printf("Done\n");
-  debug_ht(&ht);
+  r = arena->buf + arena->used;
+  arena->used += size;
 
-  debug_printf("Unsetting the 1st item: ");
-  hashtable_unset_f(&ht, testkeys[0], testkey_lens[0]);
-  debug_printf("Done\n");
-  debug_ht(&ht);
+  return r;
+}
 
-  #ifndef BENCHMARK
-  debug_printf("Tests: ");
+static void test_allocators(int *testkey_lens)
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct test_arena arena;
+  int i;
+  void *a;
 
-  if (t != &(d[2]))
+  debug_printf("Counting allocator: ");
+
+  counting_settings(&s);
+  s.size_maximum = 6;
+
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < testkey_count; i++)
   {
-    debug_printf("Error: Update to the 8th item failed.\n");
+    hashtable_set_f(&ht, testkeys[i], testkey_lens[i], testkeys[i]);
+  }
+
+  hashtable_unset_f(&ht, testkeys[5], testkey_lens[5]);
+  hashtable_get_f(&ht, testkeys[9], testkey_lens[9], &a);
+
+  if (a != testkeys[9] || counted_bytes == 0)
+  {
+    debug_printf("Error: table contents incorrect\n");
     exit(EXIT_FAILURE);
   }
 
-  if (ht.table_itemcount != 7)
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
   {
-    debug_printf("Error: table_itemcount incorrect\n");
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
     exit(EXIT_FAILURE);
   }
 
-  if (hashtable_get(&ht, testkeys[0], testkey_lens[0], NULL) != 
-                                               HASHTABLE_KEY_NOT_FOUND)
+  debug_printf("Ok\n");
+
+  debug_printf("Allocator left NULL: ");
+
+  /* As filled in field by field by a caller that predates the hooks */
+  memset(&s, 0, sizeof(s));
+  s.size_initial = 3;
+  s.size_maximum = 4;
+  s.size_extend  = 1;
+  s.hashfunction = lookup_hash;
+
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < testkey_count; i++)
   {
-    debug_printf("Error: 1st item still exists\n");
+    hashtable_set_f(&ht, testkeys[i], testkey_lens[i], testkeys[i]);
+  }
+
+  hashtable_get_f(&ht, getkey, testkey_lens[4], &a);
+
+  if (a != testkeys[4] || 
+      ht.table_settings.mallocfunction != hashtable_std_malloc ||
+      ht.table_settings.reallocfunction != hashtable_std_realloc ||
+      ht.table_settings.freefunction != hashtable_std_free)
+  {
+    debug_printf("Error: NULL allocator not replaced by the std one\n");
     exit(EXIT_FAILURE);
   }
 
+  hashtable_delete(&ht);
+
   debug_printf("Ok\n");
 
-  debug_printf("Attempting to get:\n");
+  debug_printf("Arena allocator: ");
 
-  debug_printf(" The fifth item: ");
-  hashtable_get_f(&ht, getkey, testkey_lens[4], (void **) &a);
-  report_gettest(a, &(d[3]));
+  arena.used = 0;
 
-  debug_printf(" The ninth item: ");
-  hashtable_get_f(&ht, getkey + testkey_lens[4], testkey_lens[8], 
-                  (void **) &b);
-  report_gettest(b, &(d[8]));
+  counting_settings(&s);
+  s.size_maximum   = 6;
+  s.mallocfunction = arena_malloc;
+  s.freefunction   = NULL;
+  s.alloc_context  = &arena;
+  s.arena          = 1;
 
-  debug_printf(" A nonexistant item (8th): ");
-  hashtable_get_f(&ht, testkeys[7], testkey_lens[7], (void **) &c);
-  report_gettest(c, NULL);
+  hashtable_new_custom_f(&ht, &s);
 
-  debug_ht(&ht);
-  #else
-  for (j = 0; j < 7; j++)
+  for (i = 0; i < testkey_count; i++)
   {
-    hashtable_get_f(&ht, testkeys[j], testkey_lens[j], (void **) &c);
+    hashtable_set_f(&ht, testkeys[i], testkey_lens[i], testkeys[i]);
   }
-  #endif
 
-  debug_printf("Destroying the table: ");
+  hashtable_get_f(&ht, getkey, testkey_lens[4], &a);
   hashtable_delete(&ht);
-  debug_printf("Done\n");
-  debug_ht(&ht);
 
-  #ifdef BENCHMARK
+  report_gettest(a, testkeys[4]);
+}
+
+static void check_tags(struct hashtable *ht)
+{
+  ht_size_t i;
+  struct hashtableitem *j;
+  uint8_t tag;
+
+  for (i = 0; i < ht->table_size; i++)
+  {
+    tag = 0;
+
+    for (j = ht->table[i]; j != NULL; j = j->next)
+    {
+      tag |= 1 << (j->key_hash >> 29);
+    }
+
+    if (ht->table_tags[i] != tag)
+    {
+      debug_printf("Error: slot %u has tag 0x%02x; expected 0x%02x\n",
+                   i, ht->table_tags[i], tag);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void test_tags()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  char keys[1000][TEST_KEY_SIZE];
+  int i;
+  void *a;
+
+  debug_printf("Slot tags: ");
+
+  s = hashtable_defaults;
+  s.size_maximum = 6;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 1000, "k");
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+  }
+
+  check_tags(&ht);
+
+  for (i = 0; i < 1000; i += 2)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  check_tags(&ht);
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_get_f(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i % 2 ? keys[i] : NULL))
+    {
+      debug_printf("Error: lookup of key %i incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_delete(&ht);
+
+  debug_printf("Ok\n");
+}
+
+static void test_bloom()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  char keys[1000][TEST_KEY_SIZE];
+  int i, round;
+  void *a;
+
+  debug_printf("Bloom filter: ");
+
+  s = hashtable_defaults;
+  s.size_maximum = 8;
+  s.bloom_bits   = 10;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 1000, "b");
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+  }
+
+  for (i = 0; i < 1000; i += 3)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  for (round = 0; round < 2; round++)
+  {
+    if (ht.table_bloom == NULL)
+    {
+      debug_printf("Error: no filter\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < 1000; i++)
+    {
+      hashtable_get_f(&ht, keys[i], strlen(keys[i]), &a);
+
+      if (a != (i % 3 ? keys[i] : NULL))
+      {
+        debug_printf("Error: lookup of key %i incorrect\n", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (hashtable_bloom_rebuild(&ht) != HASHTABLE_SUCCESS)
+    {
+      debug_printf("Error: rebuild failed\n");
+      exit(EXIT_FAILURE);
+    }
   }
+
+  hashtable_delete(&ht);
+
+  debug_printf("Ok\n");
+}
+
+static void test_engine(int engine, const char *name)
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct hashtableitem *l;
+  static char keys[20000][TEST_KEY_SIZE];
+  int i, inserted;
+  void *a;
+
+  debug_printf("%s engine: ", name);
+
+  counting_settings(&s);
+  s.size_initial = 2;
+  s.size_maximum = 16;
+  s.engine       = engine;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 20000, "e");
+
+  for (i = 0; i < 20000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+  }
+
+  if (hashtable_set(&ht, "e7", 2, NULL) != HASHTABLE_DUPLICATE)
+  {
+    debug_printf("Error: duplicate accepted\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 20000; i += 2)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  for (i = 0; i < 20000; i += 4)
+  {
+    hashtable_get_or_insert_f(&ht, keys[i], strlen(keys[i]), &l, &inserted);
+    hashtable_update_item_f(&ht, l, keys[i]);
+  }
+
+  for (i = 0; i < 20000; i++)
+  {
+    hashtable_get_f(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i % 2 == 0 && i % 4 != 0 ? NULL : keys[i]))
+    {
+      debug_printf("Error: lookup of key %i incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (ht.table_itemcount != 15000)
+  {
+    debug_printf("Error: table_itemcount incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_snapshot()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct hashtablesnapshot snap;
+  struct hashtableitem *l;
+  char keys[2000][TEST_KEY_SIZE];
+  ht_size_t i, n;
+  void *a;
+
+  debug_printf("Snapshots: ");
+
+  counting_settings(&s);
+  s.size_maximum = 11;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 2000, "s");
+
+  for (i = 0; i < 2000; i++)
+  {
+    if (i < 1000)
+    {
+      hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+    }
+  }
+
+  if (hashtable_snapshot(&ht, &snap) != HASHTABLE_SUCCESS ||
+      hashtable_snapshot(&ht, &snap) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: hashtable_snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Removals, updates and inserts (enough to resize the table) */
+  for (i = 0; i < 1000; i += 3)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  hashtable_get_item_f(&ht, keys[1], strlen(keys[1]), &l);
+  hashtable_update_item_f(&ht, l, keys[0]);
+  hashtable_update_f(&ht, keys[2], strlen(keys[2]), keys[0]);
+
+  for (i = 1000; i < 2000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+  }
+
+  for (n = 0, i = 0; i < snap.table_size; i++)
+  {
+    for (l = snap.table[i]; l != NULL; l = l->next)
+    {
+      n++;
+    }
+  }
+
+  if (n != 1000 || snap.table_itemcount != 1000 || 
+      snap.table_size == ht.table_size)
+  {
+    debug_printf("Error: snapshot has %u items\n", n);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 2000; i++)
+  {
+    hashtable_snapshot_get(&snap, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i < 1000 ? keys[i] : NULL))
+    {
+      debug_printf("Error: snapshot lookup of key %u incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_snapshot_release(&snap);
+
+  for (i = 0; i < 2000; i++)
+  {
+    hashtable_get_f(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i < 1000 && i % 3 == 0 ? NULL : 
+              i == 1 || i == 2 ? keys[0] : keys[i]))
+    {
+      debug_printf("Error: lookup of key %u incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Without a resize, so that some slots are never copied */
+  hashtable_snapshot(&ht, &snap);
+  hashtable_unset_f(&ht, keys[1], strlen(keys[1]));
+  hashtable_snapshot_get(&snap, keys[1], strlen(keys[1]), &a);
+  report_gettest(a, keys[0]);
+  hashtable_get_f(&ht, keys[1], strlen(keys[1]), &a);
+  report_gettest(a, NULL);
+
+  /* Walking the table sees the chains it still shares with the snapshot */
+  for (n = 0, i = 0; i < ht.table_size; i++)
+  {
+    for (l = ht.table[i]; l != NULL; l = l->next)
+    {
+      n++;
+    }
+  }
+
+  if (n != ht.table_itemcount)
+  {
+    debug_printf("Error: walked %u of %u items\n", n, ht.table_itemcount);
+    exit(EXIT_FAILURE);
+  }
+
+  /* hashtable_delete releases the snapshot */
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void test_seqlock()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct hashtablesnapshot snap;
+  struct seqlock_test *t;
+  pthread_t writer, readers[SEQLOCK_READERS];
+  char keys[2000][TEST_KEY_SIZE];
+  ht_size_t i;
+  size_t live;
+  void *a;
+  int r;
+
+  debug_printf("Seqlock mode: ");
+
+  counting_settings(&s);
+  s.seqlock    = 1;
+  s.bloom_bits = 10;
+
+  if (hashtable_new_custom(&ht, &s) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: seqlock with bloom_bits accepted\n");
+    exit(EXIT_FAILURE);
+  }
+
+  s.bloom_bits   = 0;
+  s.size_maximum = 11;
+  hashtable_new_custom_f(&ht, &s);
+
+  if (hashtable_snapshot(&ht, &snap) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: snapshot of a seqlock table\n");
+    exit(EXIT_FAILURE);
+  }
+
+  make_keys(keys, 2000, "q");
+
+  for (i = 0; i < 2000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+  }
+
+  for (i = 0; i < 2000; i += 3)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  /* Removed items and old tables are kept until they are reclaimed */
+  live = counted_bytes;
+  hashtable_seqlock_reclaim(&ht);
+
+  if (counted_bytes >= live)
+  {
+    debug_printf("Error: nothing reclaimed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 2000; i++)
+  {
+    hashtable_get_f(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i % 3 == 0 ? NULL : keys[i]))
+    {
+      debug_printf("Error: lookup of key %u incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_unset_f(&ht, keys[1], strlen(keys[1]));
+  hashtable_delete(&ht);
+
+  /* One writer growing and changing the table under several readers */
+  t = malloc_f(sizeof(struct seqlock_test));
+  s.size_initial = 2;
+  s.size_maximum = 16;
+  hashtable_new_custom_f(&t->ht, &s);
+  make_keys(t->keys, SEQLOCK_KEYS, "w");
+  t->done = 0;
+
+  for (i = 0; i < SEQLOCK_STABLE; i++)
+  {
+    hashtable_set_f(&t->ht, t->keys[i], strlen(t->keys[i]), t->keys[i]);
+  }
+
+  if (pthread_barrier_init(&t->barrier, NULL, SEQLOCK_READERS + 1) != 0 ||
+      pthread_create(&writer, NULL, seqlock_writer, t) != 0)
+  {
+    debug_printf("Error: can't start the writer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < SEQLOCK_READERS; i++)
+  {
+    if (pthread_create(&readers[i], NULL, seqlock_reader, t) != 0)
+    {
+      debug_printf("Error: can't start a reader\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_join(writer, NULL);
+
+  for (i = 0; i < SEQLOCK_READERS; i++)
+  {
+    pthread_join(readers[i], NULL);
+  }
+
+  pthread_barrier_destroy(&t->barrier);
+
+  for (i = 0; i < SEQLOCK_KEYS; i++)
+  {
+    r = hashtable_get(&t->ht, t->keys[i], strlen(t->keys[i]), &a);
+
+    if (i < SEQLOCK_STABLE ? a != t->keys[i] + 1 : 
+        (i % 2 == 0 ? r != HASHTABLE_KEY_NOT_FOUND : a != t->keys[i]))
+    {
+      debug_printf("Error: key %u incorrect after the writer\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_delete(&t->ht);
+  free(t);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+/* Looks keys up until the writer finishes each batch. Only the data it 
+ * was given may ever be seen, and stable keys must always be found. */
+static void *seqlock_reader(void *arg)
+{
+  struct seqlock_test *t;
+  unsigned int i, n;
+  int batch, r;
+  void *a;
+
+  t = arg;
+  n = 0;
+
+  for (batch = 0; batch < SEQLOCK_BATCHES; batch++)
+  {
+    pthread_barrier_wait(&t->barrier);
+
+    do
+    {
+      i = n++ % SEQLOCK_KEYS;
+      r = hashtable_get(&t->ht, t->keys[i], strlen(t->keys[i]), &a);
+
+      if (r == HASHTABLE_SUCCESS ? a != t->keys[i] && a != t->keys[i] + 1
+                                 : i < SEQLOCK_STABLE)
+      {
+        debug_printf("Error: reader saw key %u wrongly\n", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE));
+
+    pthread_barrier_wait(&t->barrier);
+  }
+
+  return NULL;
+}
+
+/* Each batch grows the table, updates the stable keys and removes half 
+ * of the new ones, and then reclaims once every reader is out of the 
+ * table */
+static void *seqlock_writer(void *arg)
+{
+  struct seqlock_test *t;
+  int batch, i, base;
+
+  t = arg;
+
+  for (batch = 0; batch < SEQLOCK_BATCHES; batch++)
+  {
+    pthread_barrier_wait(&t->barrier);
+
+    base = SEQLOCK_STABLE + batch * SEQLOCK_BATCH;
+
+    for (i = base; i < base + SEQLOCK_BATCH; i++)
+    {
+      hashtable_set_f(&t->ht, t->keys[i], strlen(t->keys[i]), t->keys[i]);
+    }
+
+    for (i = 0; i < SEQLOCK_STABLE; i++)
+    {
+      hashtable_update_f(&t->ht, t->keys[i], strlen(t->keys[i]), 
+                         t->keys[i] + batch % 2);
+    }
+
+    for (i = base; i < base + SEQLOCK_BATCH; i += 2)
+    {
+      hashtable_unset_f(&t->ht, t->keys[i], strlen(t->keys[i]));
+    }
+
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+    pthread_barrier_wait(&t->barrier);
+
+    hashtable_seqlock_reclaim(&t->ht);
+    t->done = 0;
+  }
+
+  return NULL;
+}
+
+static void test_aggregate()
+{
+  struct hashtable ht[3];
+  struct hashtablesettings s;
+  struct hashtablerecord records[1000];
+  char keys[10][TEST_KEY_SIZE];
+  ht_size_t i, t;
+  int ops[4] = { HASHTABLE_AGGREGATE_SUM, HASHTABLE_AGGREGATE_COUNT,
+                 HASHTABLE_AGGREGATE_MIN, HASHTABLE_AGGREGATE_MAX };
+  intptr_t expect[4], e;
+  void *a;
+
+  debug_printf("Aggregation: ");
+
+  make_keys(keys, 10, "g");
+
+  /* Key i % 10 gets the values i - 500 */
+  for (i = 0; i < 1000; i++)
+  {
+    records[i].key    = keys[i % 10];
+    records[i].keylen = strlen(keys[i % 10]);
+    records[i].value  = (intptr_t) i - 500;
+  }
+
+  if (hashtable_aggregate(&ht[0], records, 0, 4) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: hashtable_aggregate accepted a bad op\n");
+    exit(EXIT_FAILURE);
+  }
+
+  s = hashtable_defaults;
+
+  for (t = 0; t < 4; t++)
+  {
+    /* All at once, and in two halves in separate tables then merged */
+    for (i = 0; i < 3; i++)
+    {
+      s.engine = (i == 1 ? HASHTABLE_ENGINE_ROBINHOOD : 
+                           HASHTABLE_ENGINE_CHAINED);
+      s.size_maximum = (i == 1 ? 8 : 4);
+      hashtable_new_custom_f(&ht[i], &s);
+    }
+
+    hashtable_aggregate_f(&ht[0], records, 1000, ops[t]);
+    hashtable_aggregate_f(&ht[1], records, 500, ops[t]);
+    hashtable_aggregate_f(&ht[2], records + 500, 500, ops[t]);
+    hashtable_aggregate_merge_f(&ht[2], &ht[1], ops[t]);
+
+    for (i = 0; i < 10; i++)
+    {
+      expect[0] = 100 * ((intptr_t) i - 500) + 10 * 4950;
+      expect[1] = 100;
+      expect[2] = (intptr_t) i - 500;
+      expect[3] = (intptr_t) i + 990 - 500;
+      e = expect[t];
+
+      hashtable_get_f(&ht[0], keys[i], strlen(keys[i]), &a);
+
+      if ((intptr_t) a != e)
+      {
+        debug_printf("Error: op %u key %u is %li\n", t, i, (long) a);
+        exit(EXIT_FAILURE);
+      }
+
+      hashtable_get_f(&ht[2], keys[i], strlen(keys[i]), &a);
+
+      if ((intptr_t) a != e)
+      {
+        debug_printf("Error: merged op %u key %u is %li\n", t, i, (long) a);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+      hashtable_delete(&ht[i]);
+    }
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_hash_many()
+{
+  char buffer[64 * 41];
+  const void *keys[37];
+  uint32_t hashes[37];
+  size_t length, i;
+
+  debug_printf("Hashing many keys: ");
+
+  for (i = 0; i < sizeof(buffer); i++)
+  {
+    buffer[i] = (char) (i * 7 + (i >> 5));
+  }
+
+  /* Odd offsets, so that the scalar code takes all three of its paths */
+  for (length = 0; length <= 40; length++)
+  {
+    for (i = 0; i < 37; i++)
+    {
+      keys[i] = buffer + i * 64 + (i % 4);
+    }
+
+    lookup_hash_many(keys, length, hashes, 37);
+
+    for (i = 0; i < 37; i++)
+    {
+      if (hashes[i] != lookup_hash(keys[i], length))
+      {
+        debug_printf("Error: key %zu of length %zu hashed wrongly\n", 
+                     i, length);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_iovec()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct lookup_hash_state state;
+  struct iovec iov[3];
+  char key[40], *k;
+  size_t length, split;
+  void *a;
+
+  debug_printf("Keys in pieces: ");
+
+  for (length = 0; length < sizeof(key); length++)
+  {
+    key[length] = (char) (length * 11 + 3);
+  }
+
+  /* The incremental hash matches however the key is split up */
+  for (length = 0; length <= sizeof(key); length++)
+  {
+    for (split = 0; split <= length; split++)
+    {
+      lookup_hash_init(&state, length);
+      lookup_hash_update(&state, key, split);
+      lookup_hash_update(&state, key + split, (length - split) / 2);
+      lookup_hash_update(&state, key + split + (length - split) / 2, 
+                         length - split - (length - split) / 2);
+
+      if (lookup_hash_final(&state) != lookup_hash(key, length))
+      {
+        debug_printf("Error: incremental hash of %zu bytes split at %zu\n",
+                     length, split);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  counting_settings(&s);
+  s.size_maximum = 8;
+  hashtable_new_custom_f(&ht, &s);
+
+  iov[0].iov_base = "tenant";
+  iov[0].iov_len  = 6;
+  iov[1].iov_base = "/table/";
+  iov[1].iov_len  = 7;
+  iov[2].iov_base = "row";
+  iov[2].iov_len  = 3;
+
+  hashtable_set_f(&ht, "tenant/table/other", 18, key);
+
+  if (hashtable_setv(&ht, iov, 3, key + 1) != HASHTABLE_SUCCESS ||
+      hashtable_setv(&ht, iov, 3, key + 2) != HASHTABLE_DUPLICATE)
+  {
+    debug_printf("Error: hashtable_setv\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The table has its own copy of the key */
+  k = strdup("tenant/table/row");
+  hashtable_get_f(&ht, k, 16, &a);
+
+  if (a != key + 1)
+  {
+    debug_printf("Error: key inserted in pieces not found\n");
+    exit(EXIT_FAILURE);
+  }
+
+  iov[2].iov_base = "other";
+  iov[2].iov_len  = 5;
+  hashtable_getv(&ht, iov, 3, &a);
+
+  if (a != key)
+  {
+    debug_printf("Error: hashtable_getv of a whole key\n");
+    exit(EXIT_FAILURE);
+  }
+
+  iov[2].iov_len  = 4;
+
+  if (hashtable_getv(&ht, iov, 3, &a) != HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: hashtable_getv found a prefix\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_unset_f(&ht, k, 16);
+  free(k);
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_flood()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct hashtableitem *j;
+  char keys[100][12];
+  ht_size_t i, n, slot, longest;
+  uint32_t seed;
+  void *a;
+
+  debug_printf("Collision flood: ");
+
+  s = hashtable_defaults;
+  s.size_maximum = 8;
+  hashtable_new_custom_f(&ht, &s);
+  seed = ht.table_seed;
+
+  /* Keys that all land in slot 0 while the table keeps its first seed */
+  for (n = 0, i = 0; n < 100; i++)
+  {
+    snprintf(keys[n], sizeof(keys[n]), "f%u", i);
+
+    if ((lookup_hash_seeded(keys[n], strlen(keys[n]), seed) & 0xff) == 0)
+    {
+      hashtable_set_f(&ht, keys[n], strlen(keys[n]), keys[n]);
+      n++;
+    }
+  }
+
+  for (longest = 0, slot = 0; slot < ht.table_size; slot++)
+  {
+    for (n = 0, j = ht.table[slot]; j != NULL; j = j->next, n++);
+    longest = n > longest ? n : longest;
+  }
+
+  if (ht.table_seed == seed || longest > 40)
+  {
+    debug_printf("Error: longest chain is %u\n", longest);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 100; i++)
+  {
+    hashtable_get_f(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != keys[i])
+    {
+      debug_printf("Error: lookup of key %u incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_delete(&ht);
+
+  debug_printf("Ok\n");
+}
+
+static void test_chain_index()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  char keys[1000][TEST_KEY_SIZE];
+  ht_size_t i;
+  void *a;
+
+  debug_printf("Long chain indexes: ");
+
+  /* Eight slots, so every chain ends up long enough to be indexed */
+  counting_settings(&s);
+  s.size_maximum = 3;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 1000, "c");
+
+  for (i = 0; i < 1000; i++)
+  {
+    if (i % 2 == 0)
+    {
+      hashtable_set_f(&ht, keys[i], strlen(keys[i]), keys[i]);
+    }
+  }
+
+  if (ht.table_index == NULL)
+  {
+    debug_printf("Error: no chains were indexed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Removing most of the items drops the indexes again on the way */
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_get(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i % 2 == 0 ? keys[i] : NULL))
+    {
+      debug_printf("Error: lookup of key %u incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+    if (i % 2 == 0 && i >= 100)
+    {
+      hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+    }
+  }
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_get(&ht, keys[i], strlen(keys[i]), &a);
+
+    if (a != (i % 2 == 0 && i < 100 ? keys[i] : NULL))
+    {
+      debug_printf("Error: lookup of key %u incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_multimap()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  void *const *values;
+  size_t count;
+  int i, j;
+
+  debug_printf("Multimap: ");
+
+  counting_settings(&s);
+  s.multimap = 1;
+  hashtable_new_custom_f(&ht, &s);
+
+  /* Key i gets the values testkeys[0..i] */
+  for (j = 0; j < 10; j++)
+  {
+    for (i = j; i < 10; i++)
+    {
+      hashtable_multi_add_f(&ht, testkeys[i], strlen(testkeys[i]), 
+                            testkeys[j]);
+    }
+  }
+
+  if (hashtable_set(&ht, "x", 1, NULL) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: hashtable_set accepted on a multimap\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 10; i++)
+  {
+    hashtable_multi_get(&ht, testkeys[i], strlen(testkeys[i]), 
+                        &values, &count);
+
+    if (count != (size_t) i + 1)
+    {
+      debug_printf("Error: key %i has %zu values\n", i, count);
+      exit(EXIT_FAILURE);
+    }
+
+    for (j = 0; j <= i; j++)
+    {
+      if (values[j] != testkeys[j])
+      {
+        debug_printf("Error: key %i value %i incorrect\n", i, j);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Removing from the middle keeps the order; the last removal drops 
+   * the key */
+  hashtable_multi_remove_f(&ht, testkeys[9], strlen(testkeys[9]), 
+                           testkeys[4]);
+  hashtable_multi_get(&ht, testkeys[9], strlen(testkeys[9]), &values, &count);
+
+  if (count != 9 || values[3] != testkeys[3] || values[4] != testkeys[5] ||
+      values[8] != testkeys[9])
+  {
+    debug_printf("Error: removal from the middle incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (hashtable_multi_remove(&ht, testkeys[9], strlen(testkeys[9]), 
+                             testkeys[4]) != HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: removed a value twice\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_multi_remove_f(&ht, testkeys[0], strlen(testkeys[0]), 
+                           testkeys[0]);
+
+  if (hashtable_multi_get(&ht, testkeys[0], strlen(testkeys[0]), 
+                          &values, &count) != HASHTABLE_KEY_NOT_FOUND ||
+      values != NULL || count != 0)
+  {
+    debug_printf("Error: empty key not removed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_unset_f(&ht, testkeys[5], strlen(testkeys[5]));
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+/* op 0: multiples of step_a; 1: of either; 2: of both; 3: of step_a and
+ * not step_b */
+static void check_set(struct hashset *hs, char keys[][TEST_KEY_SIZE], 
+                      int n, int step_a, int step_b, int op, 
+                      const char *name)
+{
+  int i, a, b, expect, count;
+
+  for (count = 0, i = 0; i < n; i++)
+  {
+    a = i % step_a == 0;
+    b = i % step_b == 0;
+    expect = (op == 0 && a) || (op == 1 && (a || b)) || 
+             (op == 2 && a && b) || (op == 3 && a && !b);
+    count += expect;
+
+    if ((hashset_contains(hs, keys[i], strlen(keys[i])) == 
+         HASHTABLE_SUCCESS) != expect)
+    {
+      debug_printf("Error: %s: membership of key %i incorrect\n", name, i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (hs->table_itemcount != count)
+  {
+    debug_printf("Error: %s: %u items, expected %i\n", name, 
+                 hs->table_itemcount, count);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void test_hashset()
+{
+  struct hashset a, b, c, d, e, f;
+  struct hashtablesettings s, fixed, seeded, ranged;
+  char keys[600][TEST_KEY_SIZE];
+  ht_size_t slot;
+  int i, op, r;
+
+  debug_printf("Hash sets: ");
+
+  counting_settings(&s);
+  s.size_maximum = 16;
+
+  /* Same hashing as s, but 512 slots from the start */
+  fixed = s;
+  fixed.size_initial = 9;
+  fixed.size_maximum = 9;
+
+  seeded = s;
+  seeded.hash_seed = 1234;
+
+  /* 256 slots, which the union of the ranged tests below outgrows */
+  ranged = s;
+  ranged.size_initial = 8;
+
+  hashset_new_custom_f(&a, &s);
+  hashset_new_custom_f(&b, &s);
+
+  make_keys(keys, 600, "s");
+
+  for (i = 0; i < 600; i++)
+  {
+    if (i % 2 == 0)
+    {
+      hashset_add_f(&a, keys[i], strlen(keys[i]));
+    }
+
+    if (i % 3 == 0)
+    {
+      hashset_add_f(&b, keys[i], strlen(keys[i]));
+    }
+  }
+
+  if (hashset_add(&a, keys[0], strlen(keys[0])) != HASHTABLE_DUPLICATE)
+  {
+    debug_printf("Error: duplicate added to a set\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_set(&a, keys, 600, 2, 3, 0, "add");
+
+  /* Different sizes, then the same size, then different seeds */
+  hashset_new_custom_f(&c, &s);
+  hashset_union_f(&c, &a);
+  check_set(&c, keys, 600, 2, 3, 0, "union into empty");
+  hashset_union_f(&c, &b);
+  check_set(&c, keys, 600, 2, 3, 1, "union");
+
+  if (hashset_is_subset(&a, &c) != HASHTABLE_SUCCESS ||
+      hashset_is_subset(&c, &a) != HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: is_subset incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashset_delete(&c);
+
+  hashset_new_custom_f(&c, &fixed);
+  hashset_new_custom_f(&d, &fixed);
+  hashset_union_f(&c, &a);
+  hashset_union_f(&d, &b);
+  hashset_intersect_f(&c, &d);
+  check_set(&c, keys, 600, 2, 3, 2, "aligned intersect");
+  hashset_intersect_f(&c, &b);
+  check_set(&c, keys, 600, 2, 3, 2, "intersect");
+  hashset_delete(&c);
+  hashset_delete(&d);
+
+  hashset_new_custom_f(&c, &seeded);
+  hashset_union_f(&c, &a);
+  hashset_difference_f(&c, &b);
+  check_set(&c, keys, 600, 2, 3, 3, "difference");
+
+  if (hashset_is_subset(&c, &a) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: is_subset incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashset_difference_f(&c, &c);
+  check_set(&c, keys, 600, 1, 1, 3, "difference with itself");
+  hashset_delete(&c);
+
+  /* Sets pick their own seeds unless made like another */
+  hashset_new_custom_f(&c, &s);
+  hashset_new_like_f(&d, &a);
+
+  if (a.table_seed == b.table_seed || c.table_seed == a.table_seed ||
+      d.table_seed != a.table_seed || d.table_size != a.table_size)
+  {
+    debug_printf("Error: hashset seeds incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashset_union_f(&d, &b);
+  hashset_intersect_f(&d, &a);
+  check_set(&d, keys, 600, 2, 3, 2, "intersect like");
+  hashset_delete(&c);
+  hashset_delete(&d);
+
+  hashset_new_custom_f(&c, &seeded);
+
+  if (c.table_seed != 1234)
+  {
+    debug_printf("Error: hash_seed not used\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashset_delete(&c);
+
+  /* A range of slots at a time, against the same operation in one call */
+  hashset_new_custom_f(&c, &ranged);
+  hashset_new_like_f(&d, &c);
+
+  for (i = 0; i < 600; i++)
+  {
+    if (i % 5 == 0)
+    {
+      hashset_add_f(&c, keys[i], strlen(keys[i]));
+    }
+
+    if (i % 3 == 0)
+    {
+      hashset_add_f(&d, keys[i], strlen(keys[i]));
+    }
+  }
+
+  for (op = 1; op <= 3; op++)
+  {
+    hashset_new_like_f(&e, &c);
+    hashset_new_like_f(&f, &c);
+    hashset_union_f(&f, &c);
+
+    if (op != 1)
+    {
+      hashset_union_f(&e, &c);
+    }
+
+    for (slot = 0; slot < c.table_size; slot += 32)
+    {
+      r = op == 1 ? hashset_union_range(&e, &d, slot, 32) :
+          op == 2 ? hashset_intersect_range(&e, &d, slot, 32) :
+                    hashset_difference_range(&e, &d, slot, 32);
+
+      if (r != HASHTABLE_SUCCESS || 
+          (op == 1 && hashset_union_range(&e, &c, slot, 32) != 
+                      HASHTABLE_SUCCESS))
+      {
+        debug_printf("Error: ranged operation %i failed\n", op);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    r = op == 1 ? hashset_union(&f, &d) :
+        op == 2 ? hashset_intersect(&f, &d) : hashset_difference(&f, &d);
+
+    if (op == 1 && (e.table_size != c.table_size || 
+                    hashset_union_finish(&e) != HASHTABLE_SUCCESS || 
+                    e.table_size == c.table_size))
+    {
+      debug_printf("Error: ranged union not grown at the end\n");
+      exit(EXIT_FAILURE);
+    }
+
+    check_set(&e, keys, 600, 5, 3, op, "ranged");
+
+    if (r != HASHTABLE_SUCCESS || e.table_itemcount != f.table_itemcount ||
+        hashset_is_subset(&e, &f) != HASHTABLE_SUCCESS)
+    {
+      debug_printf("Error: ranged operation %i differs\n", op);
+      exit(EXIT_FAILURE);
+    }
+
+    hashset_delete(&e);
+    hashset_delete(&f);
+  }
+
+  /* c is not a subset of d, but its keys in some slots are */
+  for (i = 0, slot = 0; slot < c.table_size; slot++)
+  {
+    i += hashset_is_subset_range(&c, &d, slot, 1) == HASHTABLE_SUCCESS;
+  }
+
+  hashset_new_like_f(&e, &c);
+  hashset_union_f(&e, &a);
+
+  if (i == 0 || i == (int) c.table_size ||
+      hashset_is_subset_range(&c, &c, 0, c.table_size) != 
+      HASHTABLE_SUCCESS ||
+      hashset_union_range(&c, &d, 240, 32) != HASHTABLE_INVALID_ARG ||
+      hashset_intersect_range(&c, &a, 0, 32) != HASHTABLE_INVALID_ARG ||
+      hashset_difference_range(&c, &e, 0, 32) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: ranged operations incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashset_delete(&c);
+  hashset_delete(&d);
+  hashset_delete(&e);
+
+  hashset_remove_f(&a, keys[2], strlen(keys[2]));
+
+  if (hashset_remove(&a, keys[2], strlen(keys[2])) != 
+      HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: key removed twice\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashset_delete(&a);
+  hashset_delete(&b);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_intern()
+{
+  struct internpool pool, other;
+  struct hashtablesettings s;
+  char key[16];
+  const char *string;
+  size_t length;
+  uint32_t id;
+  int i;
+
+  debug_printf("Interning: ");
+
+  counting_settings(&s);
+  s.size_maximum = 16;
+  internpool_new_custom_f(&pool, &s);
+
+  /* Every string is added twice, and gets the same ID both times */
+  for (i = 0; i < 10000; i++)
+  {
+    snprintf(key, sizeof(key), "t%i", i / 2);
+    internpool_add_f(&pool, key, strlen(key), &id);
+
+    if (id != (uint32_t) i / 2)
+    {
+      debug_printf("Error: string %i got ID %u\n", i / 2, id);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  internpool_add_f(&pool, "", 0, &id);
+
+  if (id != 5000 || pool.strings_count != 5001)
+  {
+    debug_printf("Error: empty string got ID %u\n", id);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 5000; i++)
+  {
+    snprintf(key, sizeof(key), "t%i", i);
+
+    if (internpool_string(&pool, i, &string, &length) != HASHTABLE_SUCCESS ||
+        length != strlen(key) || strcmp(string, key) != 0 || 
+        string == key)
+    {
+      debug_printf("Error: string %i incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+    if (internpool_find(&pool, key, strlen(key), &id) != HASHTABLE_SUCCESS ||
+        id != (uint32_t) i)
+    {
+      debug_printf("Error: find of string %i incorrect\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (internpool_find(&pool, "t5000", 5, &id) != HASHTABLE_KEY_NOT_FOUND ||
+      internpool_string(&pool, 5001, &string, &length) != 
+      HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: found a string that was not interned\n");
+    exit(EXIT_FAILURE);
+  }
+
+  internpool_delete(&pool);
+
+  /* The defaults must not limit a pool to a handful of strings */
+  if (internpool_new(&pool) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: internpool_new failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 5000; i++)
+  {
+    snprintf(key, sizeof(key), "t%i", i);
+
+    if (internpool_add(&pool, key, strlen(key), &id) != HASHTABLE_SUCCESS)
+    {
+      debug_printf("Error: default pool full at string %i\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Pools pick their own seeds unless hash_seed is given */
+  internpool_new_f(&other);
+
+  if (other.seed == pool.seed)
+  {
+    debug_printf("Error: default pools share a seed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  internpool_delete(&other);
+  s.hash_seed = 1234;
+  internpool_new_custom_f(&other, &s);
+
+  if (other.seed != 1234)
+  {
+    debug_printf("Error: hash_seed not used\n");
+    exit(EXIT_FAILURE);
+  }
+
+  internpool_delete(&other);
+  internpool_delete(&pool);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_lfhashtable()
+{
+  struct lfhashtable lf;
+  struct hashtablesettings s;
+  struct lf_test *t;
+  pthread_t threads[LF_THREADS];
+  uint64_t i;
+  int n;
+  void *a;
+
+  debug_printf("Lock free table: ");
+
+  /* Starting small, so that it is copied to a new array several times */
+  counting_settings(&s);
+  s.size_initial = 2;
+  s.size_maximum = 16;
+  lfhashtable_new_custom_f(&lf, &s);
+
+  for (i = 1; i <= 5000; i++)
+  {
+    lfhashtable_set_f(&lf, i * 7919, (void *) (uintptr_t) i);
+
+    if (i % 2 == 0)
+    {
+      lfhashtable_update_f(&lf, i / 2 * 7919, (void *) (uintptr_t) (i + 1));
+    }
+  }
+
+  for (i = 1; i <= 5000; i++)
+  {
+    if (lfhashtable_get(&lf, i * 7919, &a) != HASHTABLE_SUCCESS ||
+        (uintptr_t) a != (i <= 2500 ? i * 2 + 1 : i))
+    {
+      debug_printf("Error: lookup of key %u incorrect\n", (unsigned) i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (lfhashtable_set(&lf, 7919, &s) != HASHTABLE_DUPLICATE ||
+      lfhashtable_update(&lf, 1, &s) != HASHTABLE_KEY_NOT_FOUND ||
+      lfhashtable_get(&lf, 1, &a) != HASHTABLE_KEY_NOT_FOUND || a != NULL ||
+      lfhashtable_set(&lf, 0, &s) != HASHTABLE_INVALID_ARG ||
+      lfhashtable_set(&lf, 1, NULL) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: incorrect return value\n");
+    exit(EXIT_FAILURE);
+  }
+
+  lfhashtable_upsert_f(&lf, 1, &s);
+  lfhashtable_upsert_f(&lf, 7919, &s);
+
+  if (lfhashtable_get(&lf, 1, &a) != HASHTABLE_SUCCESS || a != &s ||
+      lfhashtable_get(&lf, 7919, &a) != HASHTABLE_SUCCESS || a != &s)
+  {
+    debug_printf("Error: upsert incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  lfhashtable_delete(&lf);
+
+  /* The defaults must not limit a table to a handful of keys */
+  if (lfhashtable_new(&lf) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: lfhashtable_new failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 1; i <= 5000; i++)
+  {
+    if (lfhashtable_set(&lf, i, (void *) (uintptr_t) i) != HASHTABLE_SUCCESS)
+    {
+      debug_printf("Error: default table full at key %u\n", (unsigned) i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  lfhashtable_delete(&lf);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Contended: the counting allocator isn't thread safe, so this uses the
+   * standard one */
+  t = malloc_f(sizeof(struct lf_test));
+  s = hashtable_defaults;
+  s.size_initial = 2;
+  s.size_maximum = 16;
+  lfhashtable_new_custom_f(&t->lf, &s);
+  t->next_id = 0;
+  t->inserted = 0;
+
+  if (pthread_barrier_init(&t->barrier, NULL, LF_THREADS) != 0)
+  {
+    debug_printf("Error: pthread_barrier_init failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (n = 0; n < LF_THREADS; n++)
+  {
+    if (pthread_create(&threads[n], NULL, lf_thread, t) != 0)
+    {
+      debug_printf("Error: pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (n = 0; n < LF_THREADS; n++)
+  {
+    pthread_join(threads[n], NULL);
+  }
+
+  pthread_barrier_destroy(&t->barrier);
+
+  /* Each key was set by exactly one thread, and then updated to its own 
+   * value by all of them */
+  if (t->inserted != LF_KEYS / 2)
+  {
+    debug_printf("Error: %d keys inserted by set, not %d\n", 
+                 t->inserted, LF_KEYS / 2);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 1; i <= LF_KEYS; i++)
+  {
+    if (lfhashtable_get(&t->lf, i * 7919, &a) != HASHTABLE_SUCCESS ||
+        (uintptr_t) a != i)
+    {
+      debug_printf("Error: threaded key %u incorrect\n", (unsigned) i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  lfhashtable_delete(&t->lf);
+  free(t);
+
+  debug_printf("Ok\n");
+}
+
+/* Sets the first half of the keys and upserts all of them, while the 
+ * table grows, then updates each key to its final value once every 
+ * thread is done inserting. Each thread starts at a different key. */
+static void *lf_thread(void *arg)
+{
+  struct lf_test *t;
+  uint64_t i, j, start;
+  int id, r;
+  void *a;
+
+  t = arg;
+  id = __atomic_fetch_add(&t->next_id, 1, __ATOMIC_RELAXED);
+  start = (uint64_t) id * (LF_KEYS / LF_THREADS);
+
+  for (j = 0; j < LF_KEYS / 2; j++)
+  {
+    i = (start + j) % (LF_KEYS / 2) + 1;
+    r = lfhashtable_set(&t->lf, i * 7919, (void *) (uintptr_t) (id + 1));
+
+    if (r == HASHTABLE_SUCCESS)
+    {
+      __atomic_fetch_add(&t->inserted, 1, __ATOMIC_RELAXED);
+    }
+    else if (r != HASHTABLE_DUPLICATE || 
+             lfhashtable_get(&t->lf, i * 7919, &a) != HASHTABLE_SUCCESS ||
+             (uintptr_t) a < 1 || (uintptr_t) a > LF_THREADS)
+    {
+      debug_printf("Error: set of key %u returned %d\n", (unsigned) i, r);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (j = 0; j < LF_KEYS; j++)
+  {
+    i = (start + j) % LF_KEYS + 1;
+
+    if (lfhashtable_upsert(&t->lf, i * 7919, 
+                           (void *) (uintptr_t) (id + 1)) != HASHTABLE_SUCCESS)
+    {
+      debug_printf("Error: upsert of key %u failed\n", (unsigned) i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_barrier_wait(&t->barrier);
+
+  for (j = 0; j < LF_KEYS; j++)
+  {
+    i = (start + j) % LF_KEYS + 1;
+
+    if (lfhashtable_update(&t->lf, i * 7919, 
+                           (void *) (uintptr_t) i) != HASHTABLE_SUCCESS)
+    {
+      debug_printf("Error: update of key %u failed\n", (unsigned) i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return NULL;
+}
+
+static void check_memory(struct hashtable *ht, const char *when)
+{
+  struct hashtablememory usage;
+  size_t sum;
+  int i;
+
+  hashtable_memory_usage(ht, &usage);
+
+  for (sum = 0, i = 0; i < HASHTABLE_MEMORY_CATEGORIES; i++)
+  {
+    sum += usage.bytes[i];
+  }
+
+  if (usage.total != counted_bytes || sum != usage.total)
+  {
+    debug_printf("Error: %s: %zu bytes counted, %zu allocated\n", when, 
+                 usage.total, counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void test_memory()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct hashtablesnapshot snap;
+  struct hashtablememory usage;
+  struct iovec iov[2];
+  char keys[400][TEST_KEY_SIZE];
+  void *a;
+  int i, r;
+
+  debug_printf("Memory accounting: ");
+
+  counting_settings(&s);
+  s.size_maximum = 3;
+  s.bloom_bits   = 10;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 400, "m");
+
+  /* Long chains, so that some get indexes, and keys owned by the table */
+  for (i = 0; i < 400; i++)
+  {
+    iov[0].iov_base = keys[i];
+    iov[0].iov_len  = 1;
+    iov[1].iov_base = keys[i] + 1;
+    iov[1].iov_len  = strlen(keys[i]) - 1;
+    hashtable_setv(&ht, iov, 2, NULL);
+  }
+
+  check_memory(&ht, "after inserts");
+  hashtable_memory_usage(&ht, &usage);
+
+  if (usage.bytes[HASHTABLE_MEMORY_KEYS] == 0 || 
+      usage.bytes[HASHTABLE_MEMORY_INDEX] == 0 ||
+      usage.bytes[HASHTABLE_MEMORY_BLOOM] == 0 ||
+      usage.bytes[HASHTABLE_MEMORY_ITEMS] != 400 * 
+                                             sizeof(struct hashtableitem))
+  {
+    debug_printf("Error: memory categories incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 400; i += 3)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  check_memory(&ht, "after removals");
+  hashtable_delete(&ht);
+
+  /* Snapshots hold on to the items they share */
+  s.size_maximum = 16;
+  s.bloom_bits   = 0;
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < 100; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), NULL);
+  }
+
+  hashtable_snapshot(&ht, &snap);
+
+  for (i = 0; i < 100; i += 2)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  check_memory(&ht, "with a snapshot");
+  hashtable_snapshot_release(&snap);
+  check_memory(&ht, "after the snapshot");
+  hashtable_delete(&ht);
+
+  /* Value arrays, slot engines, and blocks waiting to be reclaimed */
+  s.multimap = 1;
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < 100; i++)
+  {
+    hashtable_multi_add_f(&ht, keys[i % 10], strlen(keys[i % 10]), keys[i]);
+  }
+
+  check_memory(&ht, "with value arrays");
+  hashtable_delete(&ht);
+  s.multimap = 0;
+  s.engine   = HASHTABLE_ENGINE_CUCKOO;
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < 100; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), NULL);
+  }
+
+  check_memory(&ht, "in a cuckoo table");
+  hashtable_delete(&ht);
+  s.engine  = HASHTABLE_ENGINE_CHAINED;
+  s.seqlock = 1;
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < 100; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), NULL);
+  }
+
+  for (i = 0; i < 50; i++)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  check_memory(&ht, "before reclaiming");
+  hashtable_seqlock_reclaim(&ht);
+  check_memory(&ht, "after reclaiming");
+  s.seqlock = 0;
+
+  /* A budget of a few items: resizes are skipped and then inserts fail */
+  hashtable_delete(&ht);
+  s.max_bytes = 8 * (sizeof(struct hashtableitem *) + sizeof(uint8_t)) +
+                10 * sizeof(struct hashtableitem);
+  hashtable_new_custom_f(&ht, &s);
+
+  for (r = HASHTABLE_SUCCESS, i = 0; r != HASHTABLE_OUT_OF_MEMORY; i++)
+  {
+    r = hashtable_set(&ht, keys[i], strlen(keys[i]), NULL);
+
+    if (i == 8 && r != HASHTABLE_SUCCESS_YET_OUT_OF_MEMORY)
+    {
+      debug_printf("Error: resize over budget not skipped\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hashtable_memory_usage(&ht, &usage);
+
+  if (i != 11 || ht.table_size != 8 || usage.total > s.max_bytes || 
+      hashtable_get(&ht, keys[9], strlen(keys[9]), &a) != 
+      HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: budget not kept (%i items, %zu bytes)\n", i, 
+                 usage.total);
+    exit(EXIT_FAILURE);
+  }
+
+  check_memory(&ht, "at the budget");
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void test_clone()
+{
+  struct hashtable src, dst;
+  struct hashtablesettings s;
+  struct hashtablesnapshot snap;
+  struct hashtablememory usage;
+  struct iovec iov;
+  size_t before, after;
+  char keys[300][TEST_KEY_SIZE];
+  void *a;
+  int i, r;
+
+  debug_printf("Cloning: ");
+
+  counting_settings(&s);
+  s.size_maximum = 6;
+  s.bloom_bits   = 10;
+  hashtable_new_custom_f(&src, &s);
+
+  make_keys(keys, 300, "c");
+
+  /* Half of the keys are owned by the table */
+  for (i = 0; i < 300; i++)
+  {
+    if (i % 2 == 0)
+    {
+      iov.iov_base = keys[i];
+      iov.iov_len  = strlen(keys[i]);
+      hashtable_setv(&src, &iov, 1, keys[i]);
+    }
+    else
+    {
+      hashtable_set_f(&src, keys[i], strlen(keys[i]), keys[i]);
+    }
+  }
+
+  /* The clone sees the table as it is, not as the snapshot has it */
+  hashtable_snapshot(&src, &snap);
+
+  for (i = 0; i < 300; i += 3)
+  {
+    hashtable_unset_f(&src, keys[i], strlen(keys[i]));
+  }
+
+  before = counted_bytes;
+  hashtable_clone_f(&dst, &src);
+  after = counted_bytes;
+  hashtable_memory_usage(&dst, &usage);
+  hashtable_snapshot_release(&snap);
+
+  if (usage.total != after - before || 
+      dst.table_itemcount != src.table_itemcount || 
+      dst.table_size != src.table_size)
+  {
+    debug_printf("Error: clone is the wrong size\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 300; i++)
+  {
+    r = hashtable_get(&dst, keys[i], strlen(keys[i]), &a);
+
+    if (i % 3 == 0 ? r != HASHTABLE_KEY_NOT_FOUND : 
+                     r != HASHTABLE_SUCCESS || a != keys[i])
+    {
+      debug_printf("Error: clone differs at %s\n", keys[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* The tables are independent, even with pooled items */
+  hashtable_delete(&src);
+
+  for (i = 1; i < 300; i += 3)
+  {
+    hashtable_unset_f(&dst, keys[i], strlen(keys[i]));
+  }
+
+  check_memory(&dst, "after removing pooled items");
+  hashtable_snapshot(&dst, &snap);
+
+  for (i = 0; i < 300; i += 3)
+  {
+    hashtable_set_f(&dst, keys[i], strlen(keys[i]), NULL);
+  }
+
+  for (i = 2; i < 300; i += 3)
+  {
+    hashtable_unset_f(&dst, keys[i], strlen(keys[i]));
+  }
+
+  hashtable_snapshot_release(&snap);
+  check_memory(&dst, "after a snapshot of a clone");
+
+  if (dst.table_itemcount != 100 || 
+      hashtable_get(&dst, keys[2], strlen(keys[2]), &a) != 
+      HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: clone modified incorrectly\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&dst);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  s.multimap = 1;
+  hashtable_new_custom_f(&src, &s);
+
+  if (hashtable_clone(&dst, &src) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: multimap table cloned\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&src);
+  debug_printf("Ok\n");
+}
+
+static int merge_sum(void *context, struct hashtableitem *dst_item,
+                     struct hashtableitem *src_item)
+{
+  if (context != NULL && src_item->key_hash == *((ht_hash_t *) context))
+  {
+    return HASHTABLE_DUPLICATE;
+  }
+
+  dst_item->data = (void *) ((intptr_t) dst_item->data + 
+                             (intptr_t) src_item->data);
+
+  return HASHTABLE_SUCCESS;
+}
+
+static void test_merge()
+{
+  struct hashtable dst, src;
+  struct hashtablesettings s;
+  struct hashtablememory a_usage, b_usage;
+  struct hashtableitem *item;
+  struct iovec iov;
+  char keys[500][TEST_KEY_SIZE];
+  ht_size_t slot;
+  ht_hash_t stop;
+  void *a;
+  int i, r, pass;
+
+  debug_printf("Merging: ");
+
+  counting_settings(&s);
+  s.size_initial = 2;
+  s.size_maximum = 10;
+  s.bloom_bits   = 10;
+  s.hash_seed    = 12345;
+
+  make_keys(keys, 500, "g");
+
+  /* Once into a smaller table all at once, and once into a larger one a 
+   * range of slots at a time */
+  for (pass = 0; pass < 2; pass++)
+  {
+    s.size_maximum = pass == 0 ? 6 : 10;
+    hashtable_new_custom_f(&dst, &s);
+    s.size_maximum = 10;
+    hashtable_new_custom_f(&src, &s);
+
+    for (i = 0; i < (pass == 0 ? 300 : 500); i++)
+    {
+      hashtable_set_f(&dst, keys[i], strlen(keys[i]), (void *) 1);
+    }
+
+    /* Keys 200 to 399 collide in the first pass; some keys are owned */
+    for (i = 200; i < (pass == 0 ? 500 : 400); i++)
+    {
+      iov.iov_base = keys[i];
+      iov.iov_len  = strlen(keys[i]);
+      hashtable_setv(&src, &iov, 1, (void *) 10);
+    }
+
+    if (pass == 0)
+    {
+      hashtable_merge(&dst, &src, merge_sum, NULL);
+    }
+    else
+    {
+      r = hashtable_merge_prepare(&dst, &src);
+
+      if (r != HASHTABLE_SUCCESS || dst.table_size < src.table_size)
+      {
+        debug_printf("Error: merge prepare failed\n");
+        exit(EXIT_FAILURE);
+      }
+
+      for (slot = 0; slot < src.table_size; slot += 8)
+      {
+        hashtable_merge_range(&dst, &src, slot, 8, merge_sum, NULL);
+      }
+    }
+
+    hashtable_memory_usage(&dst, &a_usage);
+    hashtable_memory_usage(&src, &b_usage);
+
+    if (src.table_itemcount != 0 || dst.table_itemcount != 500 ||
+        a_usage.total + b_usage.total != counted_bytes)
+    {
+      debug_printf("Error: merge moved the wrong items\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < 500; i++)
+    {
+      hashtable_get_f(&dst, keys[i], strlen(keys[i]), &a);
+
+      if ((intptr_t) a != (i >= 200 && i < (pass == 0 ? 300 : 400) ? 11 : 
+                           i < (pass == 0 ? 300 : 500) ? 1 : 10))
+      {
+        debug_printf("Error: merge lost %s\n", keys[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    hashtable_delete(&src);
+    hashtable_delete(&dst);
+  }
+
+  /* A callback failing stops the merge, with the rest left in src */
+  hashtable_new_custom_f(&dst, &s);
+  hashtable_new_custom_f(&src, &s);
+
+  for (i = 0; i < 100; i++)
+  {
+    hashtable_set_f(&dst, keys[i], strlen(keys[i]), (void *) 1);
+    hashtable_set_f(&src, keys[i], strlen(keys[i]), (void *) 1);
+  }
+
+  hashtable_get_item_f(&src, keys[50], strlen(keys[50]), &item);
+  stop = item->key_hash;
+
+  if (hashtable_merge(&dst, &src, merge_sum, &stop) != HASHTABLE_DUPLICATE ||
+      dst.table_itemcount != 100 || src.table_itemcount == 0 || 
+      hashtable_get(&src, keys[50], strlen(keys[50]), &a) != 
+      HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: failed merge incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&src);
+  s.hash_seed = 54321;
+  hashtable_new_custom_f(&src, &s);
+
+  if (hashtable_merge(&dst, &src, NULL, NULL) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: merged tables with different seeds\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&src);
+  hashtable_delete(&dst);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static void check_same(struct hashtable *a, struct hashtable *b, 
+                       const char *when)
+{
+  struct hashtableitem *j;
+  ht_size_t slot;
+  void *data;
+
+  for (slot = 0; slot < a->table_size; slot++)
+  {
+    for (j = (a->table)[slot]; j != NULL; j = j->next)
+    {
+      if (hashtable_get(b, j->key, j->keylen, &data) != HASHTABLE_SUCCESS ||
+          data != j->data)
+      {
+        debug_printf("Error: %s: %.*s differs\n", when, (int) j->keylen, 
+                     (const char *) j->key);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (a->table_itemcount != b->table_itemcount)
+  {
+    debug_printf("Error: %s: %u items, not %u\n", when, b->table_itemcount,
+                 a->table_itemcount);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void test_checkpoint()
+{
+  struct hashtable ht, loaded;
+  struct hashtablesettings s;
+  char keys[2000][TEST_KEY_SIZE];
+  char log[] = "/tmp/ht_checkpoint_XXXXXX";
+  char compacted[] = "/tmp/ht_checkpoint_XXXXXX";
+  struct hashtableitem *item, **itemp;
+  off_t full, delta, end;
+  int fd, fd2, i, n, compact;
+
+  debug_printf("Checkpoints: ");
+
+  counting_settings(&s);
+  s.size_initial = 4;
+  s.size_maximum = 12;
+  s.checkpoint   = 1;
+  hashtable_new_custom_f(&ht, &s);
+
+  fd  = mkstemp(log);
+  fd2 = mkstemp(compacted);
+
+  if (fd < 0 || fd2 < 0)
+  {
+    debug_printf("Error: can't create a log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  unlink(log);
+  unlink(compacted);
+
+  make_keys(keys, 2000, "k");
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), (void *) (intptr_t) i);
+  }
+
+  if (hashtable_checkpoint(&ht, fd, NULL) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: checkpoint failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  full = lseek(fd, 0, SEEK_END);
+
+  /* A few changes, a resize, and then a few more */
+  for (i = 0; i < 10; i++)
+  {
+    hashtable_update_f(&ht, keys[i], strlen(keys[i]), (void *) 7);
+    hashtable_unset_f(&ht, keys[i + 100], strlen(keys[i + 100]));
+  }
+
+  /* Any expressions may be passed, and are evaluated once */
+  hashtable_get_item_f(&ht, keys[20], strlen(keys[20]), &item);
+  itemp = &item;
+  n = 0;
+
+  if (hashtable_update_item((n++, &ht), *itemp, (void *) 7) != 
+      HASHTABLE_SUCCESS || n != 1 || item->data != (void *) 7)
+  {
+    debug_printf("Error: hashtable_update_item\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_checkpoint(&ht, fd, &compact);
+  delta = lseek(fd, 0, SEEK_END) - full;
+
+  for (i = 1000; i < 2000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), (void *) (intptr_t) i);
+  }
+
+  hashtable_unset_f(&ht, keys[500], strlen(keys[500]));
+  hashtable_checkpoint(&ht, fd, &compact);
+
+  if (delta <= 0 || delta > full / 20 || !compact)
+  {
+    debug_printf("Error: checkpoint wrote too much\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Into a table that starts at a different size */
+  s.size_initial = 2;
+  hashtable_new_custom_f(&loaded, &s);
+  lseek(fd, 0, SEEK_SET);
+
+  if (hashtable_checkpoint_load(&loaded, fd) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: load failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_same(&ht, &loaded, "after loading");
+
+  /* The loaded table carries on with the same log */
+  hashtable_update_f(&loaded, keys[1], strlen(keys[1]), (void *) 9);
+  hashtable_update_f(&ht, keys[1], strlen(keys[1]), (void *) 9);
+  hashtable_checkpoint(&loaded, fd, NULL);
+  hashtable_delete(&loaded);
+
+  /* Half a record, as if the program had died while writing it */
+  end = lseek(fd, 0, SEEK_END);
+
+  if (write(fd, &full, sizeof(full)) != sizeof(full))
+  {
+    debug_printf("Error: can't write to the log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_new_custom_f(&loaded, &s);
+  lseek(fd, 0, SEEK_SET);
+
+  if (hashtable_checkpoint_load(&loaded, fd) != HASHTABLE_SUCCESS ||
+      lseek(fd, 0, SEEK_END) != end)
+  {
+    debug_printf("Error: torn record not removed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_same(&ht, &loaded, "after a torn record");
+  hashtable_delete(&loaded);
+
+  if (hashtable_checkpoint_compact(&ht, fd2) != HASHTABLE_SUCCESS ||
+      lseek(fd2, 0, SEEK_END) >= end)
+  {
+    debug_printf("Error: compaction failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_new_custom_f(&loaded, &s);
+  lseek(fd2, 0, SEEK_SET);
+  hashtable_checkpoint_load(&loaded, fd2);
+  check_same(&ht, &loaded, "after compaction");
+
+  hashtable_delete(&loaded);
+  hashtable_delete(&ht);
+
+  /* A table with its own hash function, through a full record and then 
+   * a record of slots */
+  s.hashfunction = fnv_hash;
+  hashtable_new_custom_f(&ht, &s);
+  lseek(fd2, 0, SEEK_SET);
+
+  if (ftruncate(fd2, 0) != 0)
+  {
+    debug_printf("Error: can't empty the log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 300; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), (void *) (intptr_t) i);
+  }
+
+  hashtable_checkpoint(&ht, fd2, NULL);
+
+  for (i = 0; i < 300; i += 7)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  hashtable_update_f(&ht, keys[1], strlen(keys[1]), (void *) 9);
+  hashtable_checkpoint(&ht, fd2, NULL);
+
+  hashtable_new_custom_f(&loaded, &s);
+  lseek(fd2, 0, SEEK_SET);
+
+  if (hashtable_checkpoint_load(&loaded, fd2) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: load with a custom hash failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_same(&ht, &loaded, "with a custom hash");
+
+  hashtable_delete(&loaded);
+  hashtable_delete(&ht);
+  close(fd);
+  close(fd2);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+/* FNV-1a, standing in for any hash function other than lookup_hash */
+static ht_hash_t fnv_hash(const void *key, size_t length)
+{
+  const uint8_t *p;
+  ht_hash_t hash;
+  size_t i;
+
+  p    = key;
+  hash = 2166136261u;
+
+  for (i = 0; i < length; i++)
+  {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+static void test_latency()
+{
+  struct hashtable ht;
+  struct hashtablesettings s;
+  struct hashtablelatency *latency;
+  char keys[1000][TEST_KEY_SIZE];
+  void *data;
+  int i, r;
+
+  debug_printf("Latency histograms: ");
+
+  for (i = 1; i < HASHTABLE_LATENCY_BUCKETS; i++)
+  {
+    if (hashtable_latency_bucket_ticks(i) <= 
+        hashtable_latency_bucket_ticks(i - 1))
+    {
+      debug_printf("Error: buckets out of order at %i\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (hashtable_latency_bucket_ticks(7) != 7 || 
+      hashtable_latency_bucket_ticks(16) != 16 ||
+      hashtable_latency_bucket_ticks(17) != 18 ||
+      hashtable_latency_bucket_ticks(HASHTABLE_LATENCY_BUCKETS - 1) != 
+      (uint64_t) 15 << 60)
+  {
+    debug_printf("Error: wrong bucket boundaries\n");
+    exit(EXIT_FAILURE);
+  }
+
+  latency = malloc(sizeof(struct hashtablelatency));
+
+  if (latency == NULL)
+  {
+    debug_printf("Error: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  counting_settings(&s);
+  s.size_initial = 2;
+  s.size_maximum = 10;
+  hashtable_new_custom_f(&ht, &s);
+
+  if (hashtable_latency_snapshot(&ht, latency) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: snapshot of a table that isn't sampled\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&ht);
+
+  s.latency_sample = 4;
+  hashtable_new_custom_f(&ht, &s);
+
+  make_keys(keys, 1000, "k");
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), (void *) (intptr_t) i);
+  }
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_get_f(&ht, keys[i], strlen(keys[i]), &data);
+  }
+
+  for (i = 0; i < 1000; i++)
+  {
+    hashtable_unset_f(&ht, keys[i], strlen(keys[i]));
+  }
+
+  r = hashtable_latency_snapshot(&ht, latency);
+
+#ifdef HASHTABLE_LATENCY
+  if (r != HASHTABLE_SUCCESS || latency->samples[HASHTABLE_LATENCY_GET] != 
+      250 || latency->samples[HASHTABLE_LATENCY_SET] != 250 ||
+      latency->samples[HASHTABLE_LATENCY_UNSET] != 250 ||
+      latency->samples[HASHTABLE_LATENCY_RESIZE] < 2)
+  {
+    debug_printf("Error: wrong number of samples\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (hashtable_latency_percentile(latency, HASHTABLE_LATENCY_GET, 50) <= 0
+      || hashtable_latency_percentile(latency, HASHTABLE_LATENCY_GET, 99) <
+         hashtable_latency_percentile(latency, HASHTABLE_LATENCY_GET, 50))
+  {
+    debug_printf("Error: bad percentiles\n");
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("(get p50 %.0fns p99 %.0fns) ", 
+    hashtable_latency_percentile(latency, HASHTABLE_LATENCY_GET, 50),
+    hashtable_latency_percentile(latency, HASHTABLE_LATENCY_GET, 99));
+#else
+  /* Compiled out: latency_sample is ignored */
+  if (r != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: snapshot without HASHTABLE_LATENCY\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+  hashtable_delete(&ht);
+  free(latency);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+static int remove_multiple(void *context, const struct hashtableitem *item)
+{
+  return (intptr_t) item->data % *(int *) context == 0;
+}
+
+/* Key i should be present unless i is a multiple of one of the steps */
+static void check_removed(struct hashtable *ht, 
+                          char keys[][TEST_KEY_SIZE], int n, 
+                          int step_a, int step_b, int step_c, 
+                          const char *when)
+{
+  void *a;
+  int i, expect, count;
+
+  for (i = 0, count = 0; i < n; i++)
+  {
+    expect = i % step_a != 0 && i % step_b != 0 && i % step_c != 0;
+    count += expect;
+
+    if ((hashtable_get(ht, keys[i], strlen(keys[i]), &a) == 
+         HASHTABLE_SUCCESS) != expect || (expect && (intptr_t) a != i))
+    {
+      debug_printf("Error: %s: wrong item for %s\n", when, keys[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (ht->table_itemcount != count)
+  {
+    debug_printf("Error: %s: %u items, expected %i\n", when, 
+                 ht->table_itemcount, count);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void test_remove_if()
+{
+  struct hashtable ht, loaded, copy;
+  struct hashtablesettings s;
+  struct hashtablesnapshot snap;
+  struct iovec iov;
+  char keys[3000][TEST_KEY_SIZE];
+  char log[] = "/tmp/ht_remove_XXXXXX";
+  ht_size_t slot;
+  void *a;
+  int i, m, fd;
+
+  debug_printf("Removing by predicate: ");
+
+  counting_settings(&s);
+  s.size_initial = 2;
+  s.size_maximum = 14;
+  s.bloom_bits   = 10;
+  s.checkpoint   = 1;
+  hashtable_new_custom_f(&ht, &s);
+
+  fd = mkstemp(log);
+
+  if (fd < 0)
+  {
+    debug_printf("Error: can't create a log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  unlink(log);
+
+  make_keys(keys, 3000, "r");
+
+  /* Half of the keys are owned by the table */
+  for (i = 0; i < 3000; i++)
+  {
+    if (i % 2 == 0)
+    {
+      hashtable_set_f(&ht, keys[i], strlen(keys[i]), (void *) (intptr_t) i);
+    }
+    else
+    {
+      iov.iov_base = keys[i];
+      iov.iov_len  = strlen(keys[i]);
+      hashtable_setv(&ht, &iov, 1, (void *) (intptr_t) i);
+    }
+  }
+
+  hashtable_checkpoint(&ht, fd, NULL);
+
+  /* Every third key, in one go, under a snapshot that must keep them */
+  hashtable_snapshot(&ht, &snap);
+  m = 3;
+
+  if (hashtable_remove_if(&ht, remove_multiple, &m) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: hashtable_remove_if failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_removed(&ht, keys, 3000, 3, 3, 3, "after the first sweep");
+
+  if (hashtable_snapshot_get(&snap, keys[0], strlen(keys[0]), &a) != 
+      HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: removal changed the snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_snapshot_release(&snap);
+  check_memory(&ht, "after the first sweep");
+
+  /* Every even key, a range of slots at a time */
+  m = 2;
+
+  if (hashtable_remove_prepare(&ht) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: hashtable_remove_prepare failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (slot = 0; slot < ht.table_size; slot += 64)
+  {
+    hashtable_remove_range(&ht, slot, 64, remove_multiple, &m);
+  }
+
+  if (hashtable_shrink(&ht) != HASHTABLE_SUCCESS || ht.table_size_p != 11)
+  {
+    debug_printf("Error: the table didn't shrink\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_removed(&ht, keys, 3000, 3, 2, 2, "after shrinking");
+  check_memory(&ht, "after shrinking");
+
+  /* The checkpoint has to follow the sweeps and the smaller table */
+  hashtable_checkpoint(&ht, fd, NULL);
+  s.size_initial = 4;
+  hashtable_new_custom_f(&loaded, &s);
+  lseek(fd, 0, SEEK_SET);
+
+  if (hashtable_checkpoint_load(&loaded, fd) != HASHTABLE_SUCCESS)
+  {
+    debug_printf("Error: load failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  check_same(&ht, &loaded, "after removing");
+  hashtable_delete(&loaded);
+  close(fd);
+
+  /* Pooled items from a clone */
+  s.size_initial = 2;
+  s.checkpoint   = 0;
+  hashtable_clone_f(&copy, &ht);
+  hashtable_delete(&ht);
+  m = 5;
+  hashtable_remove_if(&copy, remove_multiple, &m);
+  check_removed(&copy, keys, 3000, 3, 2, 5, "in a clone");
+  check_memory(&copy, "in a clone");
+  hashtable_delete(&copy);
+
+  /* Everything, which takes it back to size_initial */
+  hashtable_new_custom_f(&ht, &s);
+
+  for (i = 0; i < 3000; i++)
+  {
+    hashtable_set_f(&ht, keys[i], strlen(keys[i]), (void *) (intptr_t) i);
+  }
+
+  m = 1;
+  hashtable_remove_if(&ht, remove_multiple, &m);
+
+  if (ht.table_itemcount != 0 || ht.table_size_p != s.size_initial)
+  {
+    debug_printf("Error: the emptied table is the wrong size\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_set_f(&ht, keys[1], strlen(keys[1]), (void *) 1);
+  check_memory(&ht, "after emptying");
+  hashtable_delete(&ht);
+
+  /* Only chained tables without readers or groups */
+  s.seqlock    = 1;
+  s.bloom_bits = 0;
+  hashtable_new_custom_f(&ht, &s);
+
+  if (hashtable_remove_if(&ht, remove_multiple, &m) != 
+      HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: removal from a seqlock table\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&ht);
+  s.seqlock = 0;
+  s.engine  = HASHTABLE_ENGINE_ROBINHOOD;
+  hashtable_new_custom_f(&ht, &s);
+
+  if (hashtable_shrink(&ht) != HASHTABLE_INVALID_ARG)
+  {
+    debug_printf("Error: shrinking a robin hood table\n");
+    exit(EXIT_FAILURE);
+  }
+
+  hashtable_delete(&ht);
+
+  if (counted_bytes != 0)
+  {
+    debug_printf("Error: %zu bytes leaked\n", counted_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  #ifdef BENCHMARK
+  int x, j;
+  char *c;
+  #else
+  char *a, *b, *c;
+  void *t;
+  #endif
+
+  struct hashtable ht;
+  struct hashtablesettings s;
+  int i, k;
+  struct hashtableitem *l;
+  char d[10];
+  int testkey_lens[testkey_count];
+
+  debug_printf("Sanity check: \n");
+  sanity_check();
+  debug_printf("Done\n");
+
+  debug_printf("Have %i testkeys\n", testkey_count);
+
+  for (k = 0; k < testkey_count; k++)
+  {
+    testkey_lens[k] = strlen(testkeys[k]);
+  }
+
+  #ifdef BENCHMARK
+  for (x = 0; x < BENCHMARK; x++) {
+  #endif
+
+  s = hashtable_defaults;
+  s.size_initial = 0;
+  s.size_maximum = 3;
+  s.size_extend = 1;
+  s.size_extend_trigger = 0;
+  s.hashfunction = lookup_hash;
+
+  debug_printf("Creating new hashtable size 2^3 = 8: ");
+  hashtable_new_custom_f(&ht, &s);
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  s.size_initial = 255;
+
+  debug_printf("Adding 7 items: ");
+  #ifdef VERBOSE
+    debug_printf("\n");
+  #endif
+  for (i = 0; i < 7; i++)
+  {
+    hashtable_set_f(&ht, testkeys[i], testkey_lens[i], &(d[i]));
+    #ifdef VERBOSE
+      debug_printf("  [%10u] = '%s'\n", i, testkeys[i]);
+    #endif
+    debug_ht(&ht);
+  }
+  debug_printf("Done\n");
+
+  debug_printf("Adding the 8th item: ");
+  hashtable_set_f(&ht, testkeys[7], testkey_lens[7], &(d[7]));
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  debug_printf("Adding the 9th item: ");
+  hashtable_set_f(&ht, testkeys[8], testkey_lens[8], &(d[8]));
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  debug_printf("Attempting to get a pointer to the 8th item: ");
+  hashtable_get_item_f(&ht, testkeys[7], testkey_lens[7], &l);
+
+  if (l == NULL)
+  {
+    debug_printf("Failed\n");
+    exit(EXIT_FAILURE);
+  }
+  else
+  {
+    debug_printf("Success\n");
+  }
+
+  debug_printf("Updating the 8th item via pointer: ");
+  hashtable_update_item_f(&ht, l, &(d[2]));
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  #ifndef BENCHMARK
+  t = l->data;
+  #endif
+
+  debug_printf("Updating the 5th item: ");
+  hashtable_update_f(&ht, getkey, testkey_lens[4], &(d[3]));
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  debug_printf("Unsetting the 8th item via pointer: ");
+  hashtable_unset_item_f(&ht, l);
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  debug_printf("Unsetting the 1st item: ");
+  hashtable_unset_f(&ht, testkeys[0], testkey_lens[0]);
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  #ifndef BENCHMARK
+  debug_printf("Tests: ");
+
+  if (t != &(d[2]))
+  {
+    debug_printf("Error: Update to the 8th item failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (ht.table_itemcount != 7)
+  {
+    debug_printf("Error: table_itemcount incorrect\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (hashtable_get(&ht, testkeys[0], testkey_lens[0], NULL) != 
+                                               HASHTABLE_KEY_NOT_FOUND)
+  {
+    debug_printf("Error: 1st item still exists\n");
+    exit(EXIT_FAILURE);
+  }
+
+  debug_printf("Ok\n");
+
+  debug_printf("Attempting to get:\n");
+
+  debug_printf(" The fifth item: ");
+  hashtable_get_f(&ht, getkey, testkey_lens[4], (void **) &a);
+  report_gettest(a, &(d[3]));
+
+  debug_printf(" The ninth item: ");
+  hashtable_get_f(&ht, getkey + testkey_lens[4], testkey_lens[8], 
+                  (void **) &b);
+  report_gettest(b, &(d[8]));
+
+  debug_printf(" A nonexistant item (8th): ");
+  hashtable_get_f(&ht, testkeys[7], testkey_lens[7], (void **) &c);
+  report_gettest(c, NULL);
+
+  debug_ht(&ht);
+  #else
+  for (j = 0; j < 7; j++)
+  {
+    hashtable_get_f(&ht, testkeys[j], testkey_lens[j], (void **) &c);
+  }
+  #endif
+
+  debug_printf("Destroying the table: ");
+  hashtable_delete(&ht);
+  debug_printf("Done\n");
+  debug_ht(&ht);
+
+  #ifdef BENCHMARK
+  }
+  #else
+  test_get_or_insert(testkey_lens);
+  test_allocators(testkey_lens);
+  test_tags();
+  test_bloom();
+  test_engine(HASHTABLE_ENGINE_CUCKOO, "Cuckoo");
+  test_engine(HASHTABLE_ENGINE_ROBINHOOD, "Robin Hood");
+  test_snapshot();
+  test_seqlock();
+  test_aggregate();
+  test_hash_many();
+  test_iovec();
+  test_flood();
+  test_chain_index();
+  test_multimap();
+  test_hashset();
+  test_intern();
+  test_lfhashtable();
+  test_memory();
+  test_clone();
+  test_merge();
+  test_checkpoint();
+  test_latency();
+  test_remove_if();
   #endif
 
   exit(EXIT_SUCCESS);
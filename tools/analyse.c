@@ -0,0 +1,442 @@
+/*
+    Copyright (C) 2008  Daniel Richman
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    For a full copy of the GNU Lesser General Public License,
+    see <http://www.gnu.org/licenses/>.
+*/
+
+/* ht_analyse: reports how well each hash function spreads a file of keys
+ * (one per line) over tables of various sizes, how fast it is, and how
+ * well it avalanches. Run it as
+ *
+ *   ./ht_analyse keys.txt [min_size_p max_size_p]
+ *
+ * By default the table sizes tried are those around the number of keys. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "lookup_hash.h"
+
+#define CHAIN_BUCKETS     8
+#define AVALANCHE_KEYS    1000
+#define AVALANCHE_BYTES   16
+#define THROUGHPUT_SECS   0.25
+
+struct key
+{
+  const char *key;
+  size_t keylen;
+  ht_hash_t hash;
+};
+
+struct candidate
+{
+  const char *name;
+  hash_function function;
+};
+
+static ht_hash_t fnv1a_hash(const void *key, size_t length);
+static void read_keys(const char *filename, char **buffer,
+                      struct key **keys, size_t *count, size_t *bytes);
+static int compare_keys(const void *a, const void *b);
+static void report_collisions(struct key *keys, size_t count);
+static void report_distribution(struct key *keys, size_t count,
+                                ht_size_p_t size_p);
+static void report_avalanche(hash_function function, struct key *keys,
+                             size_t count);
+static void report_throughput(hash_function function, struct key *keys,
+                              size_t count, size_t bytes);
+static inline double now();
+
+/* A well known simple hash, for comparison */
+static ht_hash_t fnv1a_hash(const void *key, size_t length)
+{
+  const uint8_t *k = key;
+  uint32_t hash = 2166136261u;
+
+  while (length--)
+  {
+    hash ^= *k++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static const struct candidate candidates[] =
+{
+  { "lookup3",  lookup_hash },
+  { "FNV-1a",   fnv1a_hash  },
+};
+
+int main(int argc, char **argv)
+{
+  char *buffer;
+  struct key *keys;
+  size_t count, bytes, c, i;
+  int min_p, max_p, p;
+
+  if (argc != 2 && argc != 4)
+  {
+    fprintf(stderr, "Usage: %s keyfile [min_size_p max_size_p]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  read_keys(argv[1], &buffer, &keys, &count, &bytes);
+
+  if (argc == 4)
+  {
+    min_p = atoi(argv[2]);
+    max_p = atoi(argv[3]);
+  }
+  else
+  {
+    /* From four items per slot to a quarter of an item per slot */
+    for (p = 0; p < ht_size_lim_p && ((size_t) 1 << p) < count; p++);
+    min_p = p - 2;
+    max_p = p + 2;
+  }
+
+  if (min_p < 0)
+  {
+    min_p = 0;
+  }
+
+  if (max_p > ht_size_lim_p)
+  {
+    max_p = ht_size_lim_p;
+  }
+
+  printf("%zu keys, %zu bytes\n", count, bytes);
+
+  for (c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++)
+  {
+    printf("\n%s\n", candidates[c].name);
+
+    for (i = 0; i < count; i++)
+    {
+      keys[i].hash = (candidates[c].function)(keys[i].key, keys[i].keylen);
+    }
+
+    report_throughput(candidates[c].function, keys, count, bytes);
+    report_collisions(keys, count);
+    report_avalanche(candidates[c].function, keys, count);
+
+    printf("  size_p  load   empty  max chain  probes/hit  "
+           "chain lengths 0..%u+\n", CHAIN_BUCKETS - 1);
+
+    for (p = min_p; p <= max_p; p++)
+    {
+      report_distribution(keys, count, p);
+    }
+  }
+
+  free(keys);
+  free(buffer);
+
+  exit(EXIT_SUCCESS);
+}
+
+static void read_keys(const char *filename, char **buffer,
+                      struct key **keys, size_t *count, size_t *bytes)
+{
+  FILE *f;
+  long size;
+  size_t i, n, start;
+
+  f = fopen(filename, "rb");
+
+  if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0)
+  {
+    perror("Error reading the key file");
+    exit(EXIT_FAILURE);
+  }
+
+  *buffer = malloc(size + 1);
+
+  if (*buffer == NULL || fread(*buffer, 1, size, f) != (size_t) size)
+  {
+    perror("Error reading the key file");
+    exit(EXIT_FAILURE);
+  }
+
+  fclose(f);
+  (*buffer)[size] = '\n';
+
+  for (n = 0, i = 0; i < (size_t) size; i++)
+  {
+    if ((*buffer)[i] == '\n')
+    {
+      n++;
+    }
+  }
+
+  *keys = malloc((n + 1) * sizeof(struct key));
+
+  if (*keys == NULL)
+  {
+    perror("Error reading the key file");
+    exit(EXIT_FAILURE);
+  }
+
+  *count = 0;
+  *bytes = 0;
+
+  /* The last line need not end with a newline; blank lines are skipped */
+  for (start = 0, i = 0; i <= (size_t) size; i++)
+  {
+    if ((*buffer)[i] == '\n')
+    {
+      if (i > start)
+      {
+        (*keys)[*count].key    = *buffer + start;
+        (*keys)[*count].keylen = i - start;
+        (*count)++;
+        *bytes += i - start;
+      }
+
+      start = i + 1;
+    }
+  }
+
+  if (*count == 0)
+  {
+    fprintf(stderr, "No keys in %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+  const struct key *x = a, *y = b;
+  size_t n;
+  int r;
+
+  if (x->hash != y->hash)
+  {
+    return x->hash < y->hash ? -1 : 1;
+  }
+
+  n = x->keylen < y->keylen ? x->keylen : y->keylen;
+  r = memcmp(x->key, y->key, n);
+
+  if (r != 0)
+  {
+    return r;
+  }
+
+  return (x->keylen > y->keylen) - (x->keylen < y->keylen);
+}
+
+/* Counts distinct keys that share a full 32 bit hash. Comparing them is
+ * the only thing key_hash can't save a lookup from. */
+static void report_collisions(struct key *keys, size_t count)
+{
+  size_t i, distinct, collisions;
+  double expected;
+
+  qsort(keys, count, sizeof(struct key), compare_keys);
+
+  for (distinct = 1, collisions = 0, i = 1; i < count; i++)
+  {
+    if (compare_keys(&keys[i - 1], &keys[i]) != 0)
+    {
+      distinct++;
+
+      if (keys[i - 1].hash == keys[i].hash)
+      {
+        collisions++;
+      }
+    }
+  }
+
+  /* n^2 / 2^33 is the number a random function would give */
+  expected = (double) distinct * distinct / 8589934592.0;
+
+  printf("  %zu distinct keys; %zu full hash collisions (%.1f expected)\n",
+         distinct, collisions, expected);
+}
+
+static void report_distribution(struct key *keys, size_t count,
+                                ht_size_p_t size_p)
+{
+  uint32_t *lengths;
+  size_t histogram[CHAIN_BUCKETS];
+  size_t size, i, empty, longest, probes;
+  ht_hash_t mask;
+
+  size = (size_t) 1 << size_p;
+  mask = size - 1;
+  lengths = calloc(size, sizeof(uint32_t));
+
+  if (lengths == NULL)
+  {
+    perror("Error allocating a table");
+    exit(EXIT_FAILURE);
+  }
+
+  /* A key found at position k in its chain costs k probes to find */
+  for (probes = 0, i = 0; i < count; i++)
+  {
+    probes += ++lengths[keys[i].hash & mask];
+  }
+
+  memset(histogram, 0, sizeof(histogram));
+
+  for (empty = 0, longest = 0, i = 0; i < size; i++)
+  {
+    if (lengths[i] == 0)
+    {
+      empty++;
+    }
+
+    if (lengths[i] > longest)
+    {
+      longest = lengths[i];
+    }
+
+    histogram[lengths[i] < CHAIN_BUCKETS ? lengths[i] : CHAIN_BUCKETS - 1]++;
+  }
+
+  /* For a random function, 1 + load/2 probes per hit and e^-load empty */
+  printf("  %6u %6.2f %6.1f%% %10zu %11.3f ", size_p, (double) count / size,
+         100.0 * empty / size, longest, (double) probes / count);
+
+  for (i = 0; i < CHAIN_BUCKETS; i++)
+  {
+    printf(" %zu", histogram[i]);
+  }
+
+  printf("\n");
+  free(lengths);
+}
+
+/* Flips each of the first AVALANCHE_BYTES * 8 bits of a sample of keys and
+ * measures how often each output bit changes; ideally half the time. */
+static void report_avalanche(hash_function function, struct key *keys,
+                             size_t count)
+{
+  static uint32_t flips[AVALANCHE_BYTES * 8][32];
+  static size_t trials[AVALANCHE_BYTES * 8];
+  char copy[AVALANCHE_BYTES];
+  size_t i, step, bit, out;
+  ht_hash_t before, changed;
+  double p, bias, worst;
+
+  memset(flips, 0, sizeof(flips));
+  memset(trials, 0, sizeof(trials));
+
+  step = count / AVALANCHE_KEYS;
+
+  if (step == 0)
+  {
+    step = 1;
+  }
+
+  for (i = 0; i < count; i += step)
+  {
+    if (keys[i].keylen > AVALANCHE_BYTES)
+    {
+      continue;
+    }
+
+    memcpy(copy, keys[i].key, keys[i].keylen);
+    before = function(copy, keys[i].keylen);
+
+    for (bit = 0; bit < keys[i].keylen * 8; bit++)
+    {
+      copy[bit / 8] ^= 1 << (bit % 8);
+      changed = before ^ function(copy, keys[i].keylen);
+      copy[bit / 8] ^= 1 << (bit % 8);
+
+      for (out = 0; out < 32; out++)
+      {
+        flips[bit][out] += (changed >> out) & 1;
+      }
+
+      trials[bit]++;
+    }
+  }
+
+  for (bias = 0, worst = 0, i = 0, bit = 0; bit < AVALANCHE_BYTES * 8; bit++)
+  {
+    if (trials[bit] == 0)
+    {
+      continue;
+    }
+
+    for (out = 0; out < 32; out++)
+    {
+      p = (double) flips[bit][out] / trials[bit];
+      p = p > 0.5 ? p - 0.5 : 0.5 - p;
+      bias += p;
+      worst = p > worst ? p : worst;
+      i++;
+    }
+  }
+
+  if (i == 0)
+  {
+    printf("  avalanche: no keys of %u bytes or less\n", AVALANCHE_BYTES);
+  }
+  else
+  {
+    printf("  avalanche bias: mean %.4f, worst %.4f (0 is ideal)\n",
+           bias / i, worst);
+  }
+}
+
+static void report_throughput(hash_function function, struct key *keys,
+                              size_t count, size_t bytes)
+{
+  volatile ht_hash_t sink;
+  double start, elapsed;
+  size_t rounds, i;
+
+  start = now();
+  rounds = 0;
+  sink = 0;
+
+  do
+  {
+    for (i = 0; i < count; i++)
+    {
+      sink += function(keys[i].key, keys[i].keylen);
+    }
+
+    rounds++;
+    elapsed = now() - start;
+  }
+  while (elapsed < THROUGHPUT_SECS);
+
+  (void) sink;
+
+  printf("  %.3f GB/s, %.1f ns per key\n",
+         (double) bytes * rounds / elapsed / 1e9,
+         elapsed * 1e9 / ((double) count * rounds));
+}
+
+static inline double now()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec + t.tv_nsec / 1e9;
+}